@@ -1,65 +1,122 @@
 #include "darknet.h"
+#include "batch_ring.h"
+#include "decode_pool.h"
+#include "pipeline.h"
 #include "list.h"
-
-#define QUEUE_SIZE 64
-
-// Added here for reference. Defined in jetson.c
+#include <unistd.h>
 
 typedef struct {
-    image im;
-    image sized;
-} loaded_image;
-
-extern void free_loaded_image(void *item);
+    list *paths;
+    int w;
+    int h;
+    int c;
+    int batch_size;
+    int decoders;
+    int decode_mb;
+    batch_ring *ring;
+    image *originals; // batch_size entries per ring buffer
+    int *slots;       // where each path went in originals
+} BatchLoaderArgs;
+
+// Called by the decode pool in path order: the image is letterboxed straight
+// into the next slot of the batch being filled
+static float *reserve_batch_slot(void *ctx, int seq) {
+    BatchLoaderArgs *args = (BatchLoaderArgs *) ctx;
+    int index, slot;
+    float *data = batch_ring_next_slot(args->ring, &index, &slot);
+    args->slots[seq] = index * args->batch_size + slot;
+    return data;
+}
 
-typedef struct {
-    void * data[QUEUE_SIZE];
-    int backlog;
-    int next_in;
-    int next_out;
-    void (*free_item) (void *);
-    pthread_mutex_t lock;
-    pthread_cond_t item_avail;
-    pthread_cond_t free_space;
-} Queue;
+// Images are decoded and letterboxed in place by a pool of threads; this
+// keeps the originals for drawing the detections and hands the slots over
+// in order
+void *batch_loader(void *args_ptr) {
+    BatchLoaderArgs *args = (BatchLoaderArgs *) args_ptr;
+    char **image_paths = (char **) list_to_array(args->paths);
+    int i, seq;
+    image im;
 
-extern Queue * create_queue(void (*free_item) (void *));
+    args->slots = (int *) calloc(args->paths->size, sizeof(int));
+    decode_pool *pool = make_decode_pool(image_paths, args->paths->size, args->w, args->h, args->c,
+                                         args->decoders, (size_t) args->decode_mb * 1024 * 1024,
+                                         reserve_batch_slot, args);
 
-extern void destroy_queue(Queue *queue);
+    while ((seq = decode_pool_next(pool, &im, 0)) >= 0) {
+        args->originals[args->slots[seq]] = im;
+        batch_ring_commit(args->ring);
+    }
 
-extern void append_to_queue(void *item, Queue *queue);
+    batch_ring_close(args->ring);
+    free_decode_pool(pool);
+    free(args->slots);
+    for (i = 0; i < args->paths->size; i++) free(image_paths[i]);
+    free(image_paths);
 
-extern void read_from_queue(void **item, Queue *queue);
+    pthread_exit(NULL);
+}
 
+// A batch that has been pushed into the pipeline and not yet returned. Its
+// ring buffer is read in place and only released once the batch is out.
 typedef struct {
-    list *paths;
-    int resize_h;
-    int resize_w;
-    Queue *queue;
-} ImageLoaderArgs;
+    int index;
+    image *images;
+    int n;
+    double start_time;
+} pending_batch;
 
-extern void *image_loader(void *args_ptr);
+static void finish_batch(network *net, image *batch, int n, float thresh, float hier_thresh, float nms, char **names, image **alphabet, int display) {
+    int b;
+    layer l = net->layers[net->n-1];
 
+    for (b = 0; b < n; b++) {
+        int nboxes = 0;
+        detection *dets = get_network_boxes(net, batch[b].w, batch[b].h, thresh, hier_thresh, 0, 1, b, &nboxes);
+        if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+        draw_detections(batch[b], dets, nboxes, thresh, names, alphabet, l.classes);
+        free_detections(dets, nboxes);
+    }
 
-void run_batch_detector(char *datacfg, char *cfgfile, char *weightfile, char *imgfile, float thresh, float hier_thresh, int display) {
-    int b;
+    // Show and free input images
+    for (b = 0; b < n; b++) {
+#ifdef OPENCV
+        if (display) {
+            char window[5];
+            sprintf(window, "%d", b);
+            show_image(batch[b], window);
+            cvWaitKey(1);
+        }
+#endif
+
+        free_image(batch[b]);
+    }
+}
 
+void run_batch_detector(char *datacfg, char *cfgfile, char *weightfile, char *imgfile, float thresh, float hier_thresh, int display, int stages, int threads, int decoders, int decode_mb) {
     list *options = read_data_cfg(datacfg);
     char *name_list = option_find_str(options, "names", "data/coco.names");
     char **names = get_labels(name_list);
 
     // Set up yolo network for detection
     image **alphabet = load_alphabet();
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     srand(2222222);
     float nms = .45;
 
     int batch_size = net->batch;
 
+    // Split the network into stages that work on consecutive batches at once
+    pipeline *pipe = 0;
+    if (stages > 1) {
+        if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN) / stages;
+        pipe = make_pipeline(cfgfile, net, stages, 2, threads);
+    }
+
     // Get image paths
     list *paths = get_paths(imgfile);
 
 #ifdef OPENCV
+    int b;
     char windows[batch_size][5];
 
     if (display) {
@@ -73,87 +130,101 @@ void run_batch_detector(char *datacfg, char *cfgfile, char *weightfile, char *im
 
     int err = 0;
 
-    // Image loader
-    Queue *image_queue = create_queue(free_loaded_image);
+    // The loader fills one batch buffer while the network reads another in
+    // place. Every batch in the pipeline holds on to its buffer as well.
+    int ring_size = pipe ? stages + 3 : 3;
+    batch_ring *ring = make_batch_ring(net->inputs, batch_size, batch_size, ring_size);
+    image *originals = (image *) calloc(ring_size * batch_size, sizeof(image));
+
     pthread_t loader_thread;
-    ImageLoaderArgs loader_args = { .resize_h = net->h, .resize_w = net->w, .paths = paths, .queue = image_queue };
+    BatchLoaderArgs loader_args = {
+            .paths = paths, .w = net->w, .h = net->h, .c = net->c,
+            .batch_size = batch_size, .decoders = decoders, .decode_mb = decode_mb,
+            .ring = ring, .originals = originals
+    };
 
-    err = pthread_create(&loader_thread, NULL, image_loader, (void *) &loader_args);
+    err = pthread_create(&loader_thread, NULL, batch_loader, (void *) &loader_args);
     if (err < 0) {
         perror("Error creating loader thread");
         exit(EXIT_FAILURE);
     }
 
-    layer l = net->layers[net->n-1];
-    int im_size = net->w * net->h * net->c;
-
-    // Image to contain batch data
-    image batch_im = make_image(net->w, net->h, net->c * batch_size);
-
-    // Array to contain unresized images of a batch
-    loaded_image *batch[batch_size];
-
     double batch_start_time = 0;
     double bps = 0;
     int total_images = 0;
+    int total_batches = 0;
+    int in_flight = 0;
+    int index = 0;
+    int n = 0;
     double start_time = what_time_is_it_now();
-    int done = 0;
 
-    while (!done) {
-        for (b = 0; b < batch_size; b++) {
-            read_from_queue((void **) &batch[b], image_queue);
-
-            if (!batch[b]->im.c) { // sentinel image
-                done = 1;
-                break;
-            }
-
-            if (batch_size == 1) // avoid copy
-                batch_im.data = batch[b]->sized.data;
-            else
-                copy_cpu(im_size, batch[b]->sized.data, 1, batch_im.data + b * im_size, 1);
-        }
-
-        // Check for end
-        if (done) break;
+    // Full batches only, except for the last one
+    while ((n = batch_ring_take(ring, -1, &index)) >= 0) {
+        // Unresized images of the batch
+        image *batch = originals + index * batch_size;
 
         // Start timing
         if (total_images == 0) start_time = what_time_is_it_now();
 
         batch_start_time = what_time_is_it_now();
 
-        total_images += batch_size;
+        total_images += n;
+
+        // Slots past n hold stale images, their detections are ignored
+        float *X = batch_ring_buffer(ring, index);
+
+        if (pipe) {
+            pending_batch *pending = calloc(1, sizeof(pending_batch));
+            pending->index = index;
+            pending->images = batch;
+            pending->n = n;
+            pending->start_time = batch_start_time;
+            pipeline_push(pipe, X, pending);
+            ++in_flight;
+
+            // Keep every stage busy, but collect results as they come out
+            if (in_flight > stages) {
+                network *out = pipeline_pop(pipe, (void **) &pending);
+                finish_batch(out, pending->images, pending->n, thresh, hier_thresh, nms, names, alphabet, display);
+                pipeline_release(pipe);
+                batch_ring_release(ring, pending->index);
+                --in_flight;
+                ++total_batches;
+                bps = total_batches / (what_time_is_it_now() - start_time);
+                printf("\rBatch size: %d\tStages: %d\tBPS: %5.3f\tLatency: %7.2f ms", batch_size, stages, bps, 1000 * (what_time_is_it_now() - pending->start_time));
+                fflush(stdout);
+                free(pending);
+            }
+            continue;
+        }
 
-        float *X = batch_im.data;
         network_predict(net, X);
+        ++total_batches;
 
         bps = 1 / (what_time_is_it_now() - batch_start_time);
         printf("\rBatch size: %d\tBPS: %5.3f", batch_size, bps);
         fflush(stdout);
 
-        for (b = 0; b < batch_size; b++) {
-            int nboxes = 0;
-            detection *dets = get_network_boxes(net, batch[b]->im.w, batch[b]->im.h, thresh, hier_thresh, 0, 1, b, &nboxes);
-            if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
-            draw_detections(batch[b]->im, dets, nboxes, thresh, names, alphabet, l.classes);
-            free_detections(dets, nboxes);
-        }
-
-        // Show and free input images
-        for (b = 0; b < batch_size; b++) {
-#ifdef OPENCV
-            if (display) {
-                show_image(batch[b]->im, windows[b]);
-                cvWaitKey(1);
-            }
-#endif
+        finish_batch(net, batch, n, thresh, hier_thresh, nms, names, alphabet, display);
+        batch_ring_release(ring, index);
+    }
 
-            free_loaded_image(batch[b]);
+    if (pipe) {
+        pending_batch *pending = 0;
+        network *out = 0;
+        pipeline_finish(pipe);
+        while ((out = pipeline_pop(pipe, (void **) &pending))) {
+            finish_batch(out, pending->images, pending->n, thresh, hier_thresh, nms, names, alphabet, display);
+            pipeline_release(pipe);
+            batch_ring_release(ring, pending->index);
+            ++total_batches;
+            free(pending);
         }
+        free_pipeline(pipe);
     }
 
     double end_time = what_time_is_it_now();
-    printf("\rDetection for %d total images with batch size %d took %f seconds (%5.3f BPS).\n", total_images, batch_size, end_time - start_time, (total_images / batch_size) / (end_time - start_time));
+    printf("\rDetection for %d total images with batch size %d took %f seconds (%5.3f BPS).\n", total_images, batch_size, end_time - start_time, total_batches / (end_time - start_time));
 
 #ifdef OPENCV
     if (display) {
@@ -164,5 +235,6 @@ void run_batch_detector(char *datacfg, char *cfgfile, char *weightfile, char *im
 
     pthread_join(loader_thread, NULL);
 
-    destroy_queue(image_queue);
+    free_batch_ring(ring);
+    free(originals);
 }
@@ -1,4 +1,7 @@
 #include "darknet.h"
+#include "data_loader.h"
+#include "checkpoint.h"
+#include "shard.h"
 
 #include <sys/time.h>
 #include <assert.h>
@@ -15,7 +18,7 @@ float *get_regression_values(char **labels, int n)
     return v;
 }
 
-void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear)
+void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear, int async_save, int keep)
 {
     int i;
 
@@ -58,10 +61,12 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
     list *plist = get_paths(train_list);
     char **paths = (char **)list_to_array(plist);
     printf("%d\n", plist->size);
-    int N = plist->size;
     double time;
 
     load_args args = {0};
+    // A shard list names shard files, the epoch counts the images in them
+    if(!tag && is_shard_list(paths, plist->size)) args.shards = open_dataset_shards(paths, plist->size);
+    int N = args.shards ? dataset_shards_count(args.shards) : plist->size;
     args.w = net->w;
     args.h = net->h;
     args.threads = 32;
@@ -89,10 +94,8 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
     }
 
     data train;
-    data buffer;
-    pthread_t load_thread;
-    args.d = &buffer;
-    load_thread = load_data(args);
+    data_loader *loader = make_data_loader(args);
+    checkpointer *saver = make_checkpointer(async_save, keep);
 
     int count = 0;
     int epoch = (*net->seen)/N;
@@ -110,10 +113,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
             args.max = net->max_ratio*dim;
             printf("%d %d\n", args.min, args.max);
 
-            pthread_join(load_thread, 0);
-            train = buffer;
-            free_data(train);
-            load_thread = load_data(args);
+            data_loader_reset(loader, args);
 
             for(i = 0; i < ngpus; ++i){
                 resize_network(nets[i], dim, dim);
@@ -122,9 +122,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
         }
         time = what_time_is_it_now();
 
-        pthread_join(load_thread, 0);
-        train = buffer;
-        load_thread = load_data(args);
+        train = data_loader_next(loader);
 
         printf("Loaded: %lf seconds\n", what_time_is_it_now()-time);
         time = what_time_is_it_now();
@@ -142,23 +140,24 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
         if(avg_loss == -1) avg_loss = loss;
         avg_loss = avg_loss*.9 + loss*.1;
         printf("%ld, %.3f: %f, %f avg, %f rate, %lf seconds, %ld images\n", get_current_batch(net), (float)(*net->seen)/N, loss, avg_loss, get_current_rate(net), what_time_is_it_now()-time, *net->seen);
-        free_data(train);
         if(*net->seen/N > epoch){
             epoch = *net->seen/N;
             char buff[256];
             sprintf(buff, "%s/%s_%d.weights",backup_directory,base, epoch);
-            save_weights(net, buff);
+            checkpoint_weights(saver, net, buff, 1);
         }
         if(get_current_batch(net)%1000 == 0){
             char buff[256];
             sprintf(buff, "%s/%s.backup",backup_directory,base);
-            save_weights(net, buff);
+            checkpoint_weights(saver, net, buff, 0);
         }
     }
     char buff[256];
     sprintf(buff, "%s/%s.weights", backup_directory, base);
-    save_weights(net, buff);
-    pthread_join(load_thread, 0);
+    checkpoint_weights(saver, net, buff, 0);
+    free_checkpointer(saver);
+    free_data_loader(loader);
+    if(args.shards) free_dataset_shards(args.shards);
 
     free_network(net);
     if(labels) free_ptrs((void**)labels, classes);
@@ -1066,6 +1065,8 @@ void run_classifier(int argc, char **argv)
     int cam_index = find_int_arg(argc, argv, "-c", 0);
     int top = find_int_arg(argc, argv, "-t", 0);
     int clear = find_arg(argc, argv, "-clear");
+    int async_save = find_arg(argc, argv, "-async_save");
+    int keep = find_int_arg(argc, argv, "-keep", 0);
     char *data = argv[3];
     char *cfg = argv[4];
     char *weights = (argc > 5) ? argv[5] : 0;
@@ -1075,7 +1076,7 @@ void run_classifier(int argc, char **argv)
     if(0==strcmp(argv[2], "predict")) predict_classifier(data, cfg, weights, filename, top);
     else if(0==strcmp(argv[2], "fout")) file_output_classifier(data, cfg, weights, filename);
     else if(0==strcmp(argv[2], "try")) try_classifier(data, cfg, weights, filename, atoi(layer_s));
-    else if(0==strcmp(argv[2], "train")) train_classifier(data, cfg, weights, gpus, ngpus, clear);
+    else if(0==strcmp(argv[2], "train")) train_classifier(data, cfg, weights, gpus, ngpus, clear, async_save, keep);
     else if(0==strcmp(argv[2], "demo")) demo_classifier(data, cfg, weights, cam_index, filename);
     else if(0==strcmp(argv[2], "gun")) gun_classifier(data, cfg, weights, cam_index, filename);
     else if(0==strcmp(argv[2], "threat")) threat_classifier(data, cfg, weights, cam_index, filename);
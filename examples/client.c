@@ -4,6 +4,8 @@
 #include "utils.h"
 #include "image.h"
 #include "cuda.h"
+#include "protocol.h"
+#include "decode_pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,7 +26,14 @@ typedef struct {
     image sized;
 } loaded_image;
 
-extern void free_loaded_image(void *item);
+void free_loaded_image(void *item) {
+    loaded_image *im = (loaded_image *) item;
+
+    free_image(im->im);
+    free_image(im->sized);
+
+    free(im);
+}
 
 typedef struct {
     void * data[QUEUE_SIZE];
@@ -49,12 +58,54 @@ typedef struct {
     list *paths;
     int resize_h;
     int resize_w;
+    int decoders;
+    int decode_mb;
     Queue *queue;
 } ImageLoaderArgs;
 
-extern void *image_loader(void *args_ptr);
+// Decodes and letterboxes the images on a pool of threads and queues them in
+// list order. Each image keeps its own letterboxed copy, which is encoded and
+// sent as it is.
+static void *image_loader(void *args_ptr) {
+    ImageLoaderArgs *args = (ImageLoaderArgs *) args_ptr;
+
+    char **image_paths = (char **) list_to_array(args->paths);
+    image im, sized;
+    int i;
+
+    decode_pool *pool = make_decode_pool(image_paths, args->paths->size, args->resize_w, args->resize_h, 3,
+                                         args->decoders, (size_t) args->decode_mb * 1024 * 1024, 0, 0);
+
+    while (decode_pool_next(pool, &im, &sized) >= 0) {
+        loaded_image *loaded_im = (loaded_image *) malloc(sizeof(loaded_image));
+        loaded_im->im = im;
+        loaded_im->sized = sized;
+
+        append_to_queue(loaded_im, args->queue);
+    }
+
+    free_decode_pool(pool);
+    for (i = 0; i < args->paths->size; i++) free(image_paths[i]);
+    free(image_paths);
+
+    loaded_image *end_im = (loaded_image *) malloc(sizeof(loaded_image));
+    end_im->im.c = 0; // signals end
+
+    append_to_queue(end_im, args->queue);
+
+    pthread_exit(NULL);
+}
+
+typedef struct {
+    int fd;
+    int frames;
+    int detections;
+    double latency;
+} ReceiverArgs;
 
-void run_client(char *imgfile, char *host, char *port, int resize, double fps) {
+extern void *detection_receiver(void *args_ptr);
+
+void run_client(char *imgfile, char *host, char *port, int resize, double fps, int dtype, int compression, int quality, int decoders, int decode_mb) {
     int fd, err;
     struct addrinfo hints;
     struct addrinfo *servinfo, *p;
@@ -65,7 +116,10 @@ void run_client(char *imgfile, char *host, char *port, int resize, double fps) {
     // Image loader
     Queue *image_queue = create_queue(free_loaded_image);
     pthread_t loader_thread;
-    ImageLoaderArgs loader_args = { .resize_h = resize, .resize_w = resize, .paths = paths, .queue = image_queue };
+    ImageLoaderArgs loader_args = {
+            .resize_h = resize, .resize_w = resize, .paths = paths,
+            .decoders = decoders, .decode_mb = decode_mb, .queue = image_queue
+    };
 
     err = pthread_create(&loader_thread, NULL, image_loader, (void *) &loader_args);
     if (err < 0) {
@@ -102,10 +156,20 @@ void run_client(char *imgfile, char *host, char *port, int resize, double fps) {
     double delay = (1 / fps) * 1000000; // usec
 
     loaded_image *loaded_im = NULL;
-    int mem_size = 3 * resize * resize * sizeof(float);
     int total_images = 0;
+    long bytes_sent = 0;
+    frame_header hdr;
 
     if (p) {
+        // Detections coming back from the server
+        pthread_t receiver_thread;
+        ReceiverArgs receiver_args = { .fd = fd };
+        err = pthread_create(&receiver_thread, NULL, detection_receiver, (void *) &receiver_args);
+        if (err < 0) {
+            perror("Error creating receiver thread");
+            exit(EXIT_FAILURE);
+        }
+
         // Send all images and close socket
 
         double start_time = what_time_is_it_now();
@@ -116,12 +180,24 @@ void run_client(char *imgfile, char *host, char *port, int resize, double fps) {
             // Done.
             if (loaded_im->im.c == 0) break;
 
-            err = writen(fd, loaded_im->sized.data, mem_size);
+            make_frame_header(&hdr, FRAME_IMAGE, total_images + 1, loaded_im->sized.c, loaded_im->sized.h, loaded_im->sized.w);
+            hdr.im_w = loaded_im->im.w;
+            hdr.im_h = loaded_im->im.h;
+
+            unsigned char *payload = pack_frame(&hdr, loaded_im->sized.data, dtype, compression, quality);
+            if (!payload) {
+                fprintf(stderr, "Error encoding image %d\n", total_images + 1);
+                exit(EXIT_FAILURE);
+            }
+
+            err = send_frame(fd, &hdr, payload);
             if (err < 0) {
                 perror("Error sending image data");
                 exit(EXIT_FAILURE);
             }
+            bytes_sent += sizeof(frame_header) + hdr.payload_size;
 
+            free(payload);
             free_loaded_image(loaded_im);
 
             total_images++;
@@ -129,11 +205,16 @@ void run_client(char *imgfile, char *host, char *port, int resize, double fps) {
             usleep(delay);
         }
 
-        shutdown(fd, SHUT_RDWR);
-        close(fd);
-
         double elapsed = what_time_is_it_now() - start_time;
-        printf("Sending images took %f seconds\t(%5.3f FPS)\n", elapsed, total_images / elapsed);
+        printf("Sending images took %f seconds\t(%5.3f FPS, %.1f KB per frame)\n", elapsed, total_images / elapsed,
+               total_images ? bytes_sent / 1024. / total_images : 0);
+
+        // Wait for the remaining detections
+        shutdown(fd, SHUT_WR);
+        pthread_join(receiver_thread, NULL);
+        close(fd);
+        printf("Received detections for %d frames (%d boxes), %.2f ms average round trip\n", receiver_args.frames,
+               receiver_args.detections, receiver_args.frames ? 1000 * receiver_args.latency / receiver_args.frames : 0);
     } else {
         fprintf(stderr, "Could not connect to host");
     }
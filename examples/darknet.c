@@ -1,4 +1,6 @@
 #include "darknet.h"
+#include "protocol.h"
+#include "shard.h"
 
 #include <time.h>
 #include <stdlib.h>
@@ -22,10 +24,15 @@ extern void run_art(int argc, char **argv);
 extern void run_super(int argc, char **argv);
 extern void run_lsd(int argc, char **argv);
 
-extern void run_jetson(char *datacfg, char *cfgfile, char *weightfile, char *imgfile, char *server_hostname, char *server_port, float thresh, int display);
-extern void run_server(char *datacfg, char *cfgfile, char *weightfile, int port, int size, int num_clients, float thresh, float hier_thresh, int partial, int display);
-extern void run_batch_detector(char *datacfg, char *cfgfile, char *weightfile, char *imgfile, float thresh, float hier_thresh, int display);
-extern void run_client(char *imgfile, char *host, char *port, int resize, double fps);
+extern void run_jetson(char *datacfg, char *cfgfile, char *weightfile, char *imgfile, char *server_hostname, char *server_port, float thresh, int display, int dtype, int compression, int decoders, int decode_mb);
+extern void run_server(char *datacfg, char *cfgfile, char *weightfile, int port, int num_clients, int max_batch, float max_delay_ms, int num_replicas, int threads, float thresh, float hier_thresh, int display);
+extern void run_batch_detector(char *datacfg, char *cfgfile, char *weightfile, char *imgfile, float thresh, float hier_thresh, int display, int stages, int threads, int decoders, int decode_mb);
+extern void run_client(char *imgfile, char *host, char *port, int resize, double fps, int dtype, int compression, int quality, int decoders, int decode_mb);
+extern void time_random_matrix(int TA, int TB, int m, int k, int n);
+extern int test_cpu_blas();
+extern void test_im2col();
+extern void test_activations(int n, float range);
+extern void test_nms(int n, int classes, int active, float thresh, int runs);
 
 void average(int argc, char *argv[])
 {
@@ -138,6 +145,41 @@ void speed(char *cfgfile, int tics)
     printf("Speed: %f Hz\n", tics/t);
 }
 
+void profile(char *cfgfile, char *weightfile, int runs, int batch, int train, char *jsonfile, char *tracefile)
+{
+    gpu_index = -1;
+    network *net = 0;
+    int i;
+    if(train){
+        net = load_network(cfgfile, weightfile, 0);
+    } else {
+        net = load_network_inference(cfgfile, weightfile);
+    }
+    if(batch) set_batch_network(net, batch);
+    network orig = *net;
+    float *input = calloc(net->inputs*net->batch, sizeof(float));
+    float *truth = calloc(net->truths*net->batch, sizeof(float));
+    for(i = 0; i < net->inputs*net->batch; ++i) input[i] = rand_uniform(0, 1);
+
+    // The first pass is not recorded, it only warms up caches and packed weights
+    for(i = 0; i <= runs; ++i){
+        if(i == 1) enable_network_profile(net);
+        net->input = input;
+        net->truth = truth;
+        net->train = train;
+        forward_network(net);
+        if(train) backward_network(net);
+    }
+    net->input = orig.input;
+    net->truth = orig.truth;
+    print_network_profile(net);
+    if(jsonfile) save_network_profile_json(net, jsonfile);
+    if(tracefile) save_network_profile_trace(net, tracefile);
+    free(input);
+    free(truth);
+    free_network(net);
+}
+
 void operations(char *cfgfile)
 {
     gpu_index = -1;
@@ -336,6 +378,30 @@ void statistics_net(char *cfgfile, char *weightfile)
     }
 }
 
+void quantize_net(char *cfgfile, char *weightfile, char *listfile, char *outfile, int n)
+{
+    gpu_index = -1;
+    network *net = load_network_inference(cfgfile, weightfile);
+    set_batch_network(net, 1);
+    list *plist = get_paths(listfile);
+    char **paths = (char **)list_to_array(plist);
+    if(n > plist->size) n = plist->size;
+    calibrate_network(net, paths, n);
+    save_weights_int8(net, outfile);
+    free_list(plist);
+    free(paths);
+    free_network(net);
+}
+
+void memory_plan(char *cfgfile, int batch)
+{
+    gpu_index = -1;
+    network *net = parse_network_cfg(cfgfile);
+    if(!batch) batch = net->batch;
+    print_memory_plan(net, batch);
+    free_network(net);
+}
+
 void denormalize_net(char *cfgfile, char *weightfile, char *outfile)
 {
     gpu_index = -1;
@@ -419,6 +485,9 @@ int main(int argc, char **argv)
         gpu_index = -1;
     }
 
+    // Largest error the exp based activations may introduce to run faster
+    set_activation_tolerance(find_float_arg(argc, argv, "-activation_tolerance", 0));
+
 #ifndef GPU
     gpu_index = -1;
 #else
@@ -477,6 +546,12 @@ int main(int argc, char **argv)
         reset_normalize_net(argv[2], argv[3], argv[4]);
     } else if (0 == strcmp(argv[1], "denormalize")){
         denormalize_net(argv[2], argv[3], argv[4]);
+    } else if (0 == strcmp(argv[1], "quantize")){
+        int n = find_int_arg(argc, argv, "-n", 100);
+        quantize_net(argv[2], argv[3], argv[4], argv[5], n);
+    } else if (0 == strcmp(argv[1], "memplan")){
+        int batch = find_int_arg(argc, argv, "-batch", 0);
+        memory_plan(argv[2], batch);
     } else if (0 == strcmp(argv[1], "statistics")){
         statistics_net(argv[2], argv[3]);
     } else if (0 == strcmp(argv[1], "normalize")){
@@ -485,6 +560,50 @@ int main(int argc, char **argv)
         rescale_net(argv[2], argv[3], argv[4]);
     } else if (0 == strcmp(argv[1], "ops")){
         operations(argv[2]);
+    } else if (0 == strcmp(argv[1], "gemm")){
+        if(argc > 6) time_random_matrix(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), atoi(argv[6]));
+        else test_cpu_blas();
+    } else if (0 == strcmp(argv[1], "im2col")){
+        test_im2col();
+    } else if (0 == strcmp(argv[1], "activations")){
+        int n = find_int_arg(argc, argv, "-n", 1<<20);
+        float range = find_float_arg(argc, argv, "-range", 8);
+        test_activations(n, range);
+    } else if (0 == strcmp(argv[1], "distort")){
+        int w = find_int_arg(argc, argv, "-w", 608);
+        int h = find_int_arg(argc, argv, "-h", 608);
+        float hue = find_float_arg(argc, argv, "-hue", .1);
+        float saturation = find_float_arg(argc, argv, "-saturation", 1.5);
+        float exposure = find_float_arg(argc, argv, "-exposure", 1.5);
+        int runs = find_int_arg(argc, argv, "-runs", 20);
+        test_distort_image(w, h, hue, saturation, exposure, runs);
+    } else if (0 == strcmp(argv[1], "warp")){
+        int w = find_int_arg(argc, argv, "-w", 608);
+        int h = find_int_arg(argc, argv, "-h", 608);
+        int runs = find_int_arg(argc, argv, "-runs", 20);
+        test_warp_image(w, h, runs);
+    } else if (0 == strcmp(argv[1], "pack")){
+        if(argc < 4){
+            fprintf(stderr, "usage: %s pack <image list> <output prefix> [-size 608] [-shard_mb 1024]\n", argv[0]);
+            return 0;
+        }
+        int size = find_int_arg(argc, argv, "-size", 608);
+        int shard_mb = find_int_arg(argc, argv, "-shard_mb", 1024);
+        pack_dataset(argv[2], argv[3], size, shard_mb);
+    } else if (0 == strcmp(argv[1], "nms")){
+        int n = find_int_arg(argc, argv, "-n", 5000);
+        int classes = find_int_arg(argc, argv, "-classes", 80);
+        int active = find_int_arg(argc, argv, "-active", 3);
+        float thresh = find_float_arg(argc, argv, "-thresh", .45);
+        int runs = find_int_arg(argc, argv, "-runs", 10);
+        test_nms(n, classes, active, thresh, runs);
+    } else if (0 == strcmp(argv[1], "profile")){
+        int runs = find_int_arg(argc, argv, "-runs", 20);
+        int batch = find_int_arg(argc, argv, "-batch", 0);
+        int train = find_arg(argc, argv, "-train");
+        char *jsonfile = find_char_arg(argc, argv, "-json", 0);
+        char *tracefile = find_char_arg(argc, argv, "-trace", 0);
+        profile(argv[2], (argc > 3 && argv[3][0] != '-') ? argv[3] : 0, runs, batch, train, jsonfile, tracefile);
     } else if (0 == strcmp(argv[1], "speed")){
         speed(argv[2], (argc > 3 && argv[3]) ? atoi(argv[3]) : 0);
     } else if (0 == strcmp(argv[1], "oneoff")){
@@ -523,7 +642,17 @@ int main(int argc, char **argv)
         // Again, only valid for entirely local detection.
         float thresh = find_float_arg(argc, argv, "-thresh", .5);
 
-        run_jetson(datacfg, cfgfile, weightfile, imgfile, server_hostname, server_port, thresh, display);
+        // Wire format of the activations sent to the server (f32, f16 or i8) and
+        // whether to LZ4 compress them (requires compiling with LZ4=1)
+        int dtype = parse_frame_dtype(find_char_arg(argc, argv, "-dtype", "f16"));
+        int compression = find_arg(argc, argv, "-lz4") ? COMPRESS_LZ4 : COMPRESS_NONE;
+
+        // Threads decoding images ahead of the network, and how much memory
+        // the images they have decoded but not yet handed over may take
+        int decoders = find_int_arg(argc, argv, "-decoders", 2);
+        int decode_mb = find_int_arg(argc, argv, "-decode_mb", 256);
+
+        run_jetson(datacfg, cfgfile, weightfile, imgfile, server_hostname, server_port, thresh, display, dtype, compression, decoders, decode_mb);
     } else if (0 == strcmp(argv[1], "client")){
         char *imgfile = argv[2];        // The .list file to draw image paths from.
 
@@ -533,7 +662,18 @@ int main(int argc, char **argv)
         int resize = atoi(argv[5]);
         double fps = atof(argv[6]); // rate at which to send images
 
-        run_client(imgfile, server_hostname, server_port, resize, fps);
+        // Wire format of the images (jpeg, u8 or f32), JPEG quality and whether to
+        // LZ4 compress raw frames (requires compiling with LZ4=1)
+        int dtype = parse_frame_dtype(find_char_arg(argc, argv, "-dtype", "jpeg"));
+        int quality = find_int_arg(argc, argv, "-quality", 90);
+        int compression = find_arg(argc, argv, "-lz4") ? COMPRESS_LZ4 : COMPRESS_NONE;
+
+        // Threads decoding images ahead of the sender, and how much memory
+        // the images they have decoded but not yet handed over may take
+        int decoders = find_int_arg(argc, argv, "-decoders", 2);
+        int decode_mb = find_int_arg(argc, argv, "-decode_mb", 256);
+
+        run_client(imgfile, server_hostname, server_port, resize, fps, dtype, compression, quality, decoders, decode_mb);
     } else if (0 == strcmp(argv[1], "server")){
         char *cfgfile = argv[2];        // cfg/yolov3-xxx-server.cfg
         char *weightfile = argv[3];    // weights/yolov3-server.weights
@@ -543,22 +683,27 @@ int main(int argc, char **argv)
 
         int port = find_int_arg(argc, argv, "-port", 12345);
 
-        // How many clients are going to connect?
-        int num_clients = find_int_arg(argc, argv, "-num_clients", 1);
+        // How many client connections to serve before shutting down (0 serves forever).
+        // Clients may connect and disconnect at any time.
+        int num_clients = find_int_arg(argc, argv, "-num_clients", 0);
 
-        // At what size do clients process each image?
-        int size = find_int_arg(argc, argv, "-size", 608);
+        // Most images to run together (at most the cfg batch size, which is the default)
+        // and how long the first image of a batch may wait for others to arrive.
+        int max_batch = find_int_arg(argc, argv, "-max_batch", 0);
+        float max_delay = find_float_arg(argc, argv, "-max_delay", 10);
+
+        // How many network replicas run inference in parallel. They share one copy of
+        // the weights and are pinned to -threads cores each (default: cores / replicas).
+        int replicas = find_int_arg(argc, argv, "-replicas", 1);
+        int threads = find_int_arg(argc, argv, "-threads", 0);
 
         // Whether or not detections should be displayed on screen
         int display = find_arg(argc, argv, "-display");
 
-        // Whether or not clients have preprocessed the image data (partial detection)
-        int partial = find_arg(argc, argv, "-partial");
-
         // Again, only valid for entirely local detection.
         float thresh = find_float_arg(argc, argv, "-thresh", .5);
 
-        run_server(datacfg, cfgfile, weightfile, port, size, num_clients, thresh, .5, partial, display);
+        run_server(datacfg, cfgfile, weightfile, port, num_clients, max_batch, max_delay, replicas, threads, thresh, .5, display);
     } else if (0 == strcmp(argv[1], "batch")){
         char *cfgfile = argv[2];        // cfg/yolov3.cfg
         char *weightfile = argv[3];    // weights/yolov3.weights
@@ -573,7 +718,17 @@ int main(int argc, char **argv)
         // Again, only valid for entirely local detection.
         float thresh = find_float_arg(argc, argv, "-thresh", .5);
 
-        run_batch_detector(datacfg, cfgfile, weightfile, imgfile, thresh, .5, display);
+        // Number of pipeline stages the network is split into, each running
+        // on its own -threads cores (default: number of cores / stages)
+        int stages = find_int_arg(argc, argv, "-pipeline", 1);
+        int threads = find_int_arg(argc, argv, "-threads", 0);
+
+        // Threads decoding images ahead of the network, and how much memory
+        // the images they have decoded but not yet batched may take
+        int decoders = find_int_arg(argc, argv, "-decoders", 2);
+        int decode_mb = find_int_arg(argc, argv, "-decode_mb", 256);
+
+        run_batch_detector(datacfg, cfgfile, weightfile, imgfile, thresh, .5, display, stages, threads, decoders, decode_mb);
     } else {
         fprintf(stderr, "Not an option: %s\n", argv[1]);
     }
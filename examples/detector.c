@@ -1,9 +1,12 @@
 #include "darknet.h"
+#include "data_loader.h"
+#include "checkpoint.h"
+#include "shard.h"
 
 static int coco_ids[] = {1,2,3,4,5,6,7,8,9,10,11,13,14,15,16,17,18,19,20,21,22,23,24,25,27,28,31,32,33,34,35,36,37,38,39,40,41,42,43,44,46,47,48,49,50,51,52,53,54,55,56,57,58,59,60,61,62,63,64,65,67,70,72,73,74,75,76,77,78,79,80,81,82,84,85,86,87,88,89,90};
 
 
-void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear)
+void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, int ngpus, int clear, int async_save, int keep)
 {
     list *options = read_data_cfg(datacfg);
     char *train_images = option_find_str(options, "train", "data/train.list");
@@ -31,7 +34,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 
     int imgs = net->batch * net->subdivisions * ngpus;
     printf("Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
-    data train, buffer;
+    data train;
 
     layer l = net->layers[net->n - 1];
 
@@ -50,12 +53,16 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     args.classes = classes;
     args.jitter = jitter;
     args.num_boxes = l.max_boxes;
-    args.d = &buffer;
     args.type = DETECTION_DATA;
+    if(is_shard_list(paths, plist->size)){
+        args.shards = open_dataset_shards(paths, plist->size);
+        args.m = dataset_shards_count(args.shards);
+    }
     //args.type = INSTANCE_DATA;
     args.threads = 64;
 
-    pthread_t load_thread = load_data(args);
+    data_loader *loader = make_data_loader(args);
+    checkpointer *saver = make_checkpointer(async_save, keep);
     double time;
     int count = 0;
     //while(i*imgs < N*120){
@@ -69,10 +76,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             args.w = dim;
             args.h = dim;
 
-            pthread_join(load_thread, 0);
-            train = buffer;
-            free_data(train);
-            load_thread = load_data(args);
+            data_loader_reset(loader, args);
 
             #pragma omp parallel for
             for(i = 0; i < ngpus; ++i){
@@ -81,9 +85,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             net = nets[0];
         }
         time=what_time_is_it_now();
-        pthread_join(load_thread, 0);
-        train = buffer;
-        load_thread = load_data(args);
+        train = data_loader_next(loader);
 
         /*
            int k;
@@ -133,7 +135,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 #endif
             char buff[256];
             sprintf(buff, "%s/%s.backup", backup_directory, base);
-            save_weights(net, buff);
+            checkpoint_weights(saver, net, buff, 0);
         }
         if(i%10000==0 || (i < 1000 && i%100 == 0)){
 #ifdef GPU
@@ -141,16 +143,18 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 #endif
             char buff[256];
             sprintf(buff, "%s/%s_%d.weights", backup_directory, base, i);
-            save_weights(net, buff);
+            checkpoint_weights(saver, net, buff, 1);
         }
-        free_data(train);
     }
 #ifdef GPU
     if(ngpus != 1) sync_nets(nets, ngpus, 0);
 #endif
     char buff[256];
     sprintf(buff, "%s/%s_final.weights", backup_directory, base);
-    save_weights(net, buff);
+    checkpoint_weights(saver, net, buff, 0);
+    free_checkpointer(saver);
+    free_data_loader(loader);
+    if(args.shards) free_dataset_shards(args.shards);
 }
 
 
@@ -566,7 +570,7 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     char **names = get_labels(name_list);
 
     image **alphabet = load_alphabet();
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     set_batch_network(net, 1);
     srand(2222222);
     double time;
@@ -828,6 +832,8 @@ void run_detector(int argc, char **argv)
     }
 
     int clear = find_arg(argc, argv, "-clear");
+    int async_save = find_arg(argc, argv, "-async_save");
+    int keep = find_int_arg(argc, argv, "-keep", 0);
     int fullscreen = find_arg(argc, argv, "-fullscreen");
     int width = find_int_arg(argc, argv, "-w", 0);
     int height = find_int_arg(argc, argv, "-h", 0);
@@ -839,7 +845,7 @@ void run_detector(int argc, char **argv)
     char *weights = (argc > 5) ? argv[5] : 0;
     char *filename = (argc > 6) ? argv[6]: 0;
     if(0==strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, outfile, fullscreen);
-    else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear);
+    else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear, async_save, keep);
     else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "valid2")) validate_detector_flip(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "recall")) validate_detector_recall(cfg, weights);
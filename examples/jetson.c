@@ -1,4 +1,7 @@
 #include "darknet.h"
+#include "protocol.h"
+#include "batch_ring.h"
+#include "decode_pool.h"
 
 #include <sys/socket.h>
 #include <netdb.h>
@@ -7,6 +10,9 @@
 
 #define QUEUE_SIZE 32
 
+// Input buffers the loader letterboxes into while the network reads another
+#define RING_SIZE 4
+
 ssize_t writen(int fd, const void *vptr, size_t n) {
     size_t nleft;
     ssize_t nwritten;
@@ -26,20 +32,6 @@ ssize_t writen(int fd, const void *vptr, size_t n) {
     return n;
 }
 
-typedef struct {
-    image im;
-    image sized;
-} loaded_image;
-
-void free_loaded_image(void *item) {
-    loaded_image *im = (loaded_image *) item;
-
-    free_image(im->im);
-    free_image(im->sized);
-
-    free(im);
-}
-
 typedef struct {
     image im;
     int nboxes;
@@ -148,35 +140,45 @@ typedef struct {
     list *paths;
     int resize_h;
     int resize_w;
-    Queue *queue;
+    int decoders;           // decode threads
+    int decode_mb;          // most memory decoded images may hold before being queued
+    batch_ring *ring;       // one image per buffer
+    image *originals;       // the unresized image of every ring buffer
+    int *buffers;           // which ring buffer each path went to
 } ImageLoaderArgs;
 
+// Called by the decode pool in list order: the image is letterboxed straight
+// into the next ring buffer, where the network reads it
+static float *reserve_input(void *ctx, int seq) {
+    ImageLoaderArgs *args = (ImageLoaderArgs *) ctx;
+    int slot;
+    return batch_ring_next_slot(args->ring, &args->buffers[seq], &slot);
+}
+
+// Decodes and letterboxes the images on a pool of threads and hands them
+// over in list order
 void *image_loader(void *args_ptr) {
     ImageLoaderArgs *args = (ImageLoaderArgs *) args_ptr;
 
-    int curr_idx = 0;
     char **image_paths = (char **) list_to_array(args->paths);
+    image im;
+    int i, seq;
 
-    char *path = 0;
-
-    for (curr_idx = 0; curr_idx < args->paths->size; curr_idx++) {
-        path = image_paths[curr_idx];
-        image im = load_image_color(path, 0, 0);
-        image sized = letterbox_image(im, args->resize_h, args->resize_w);
-
-        loaded_image *loaded_im = (loaded_image *) malloc(sizeof(loaded_image));
-        loaded_im->im = im;
-        loaded_im->sized = sized;
-
-        append_to_queue(loaded_im, args->queue);
+    args->buffers = (int *) calloc(args->paths->size, sizeof(int));
+    decode_pool *pool = make_decode_pool(image_paths, args->paths->size, args->resize_w, args->resize_h, 3,
+                                         args->decoders, (size_t) args->decode_mb * 1024 * 1024,
+                                         reserve_input, args);
 
-        free(path);
+    while ((seq = decode_pool_next(pool, &im, 0)) >= 0) {
+        args->originals[args->buffers[seq]] = im;
+        batch_ring_commit(args->ring);
     }
 
-    loaded_image *end_im = (loaded_image *) malloc(sizeof(loaded_image));
-    end_im->im.c = 0; // signals end
-
-    append_to_queue(end_im, args->queue);
+    batch_ring_close(args->ring);
+    free_decode_pool(pool);
+    free(args->buffers);
+    for (i = 0; i < args->paths->size; i++) free(image_paths[i]);
+    free(image_paths);
 
     pthread_exit(NULL);
 }
@@ -186,47 +188,43 @@ typedef struct {
     float thresh;
     float nms;
     float hier_thresh;
-    Queue *image_queue;
+    batch_ring *ring;
+    image *originals;
     Queue *out_queue;
 } DetectorArgs;
 
 void *detector(void *args_ptr) {
     DetectorArgs *args = (DetectorArgs *) args_ptr;
 
-    loaded_image *input = NULL;
+    int index;
     int b = 0;
 
     layer l = args->net->layers[args->net->n - 1];
 
-    while (1) {
-        read_from_queue((void **) &input, args->image_queue);
-
-        // Check for end of input data
-        if (!input->im.c) break;
+    while (batch_ring_take(args->ring, -1, &index) >= 0) {
+        image im = args->originals[index];
 
-        network_predict(args->net, input->sized.data);
+        network_predict(args->net, batch_ring_buffer(args->ring, index));
+        batch_ring_release(args->ring, index);
 
         // Retrieve detections
         int nboxes = 0;
-        detection *dets = get_network_boxes(args->net, input->im.w, input->im.h, args->thresh, args->hier_thresh, 0, 1,
+        detection *dets = get_network_boxes(args->net, im.w, im.h, args->thresh, args->hier_thresh, 0, 1,
                                             b, &nboxes);
         if (args->nms) do_nms_sort(dets, nboxes, l.classes, args->nms);
 
         if (args->out_queue) {
             // Forward to printer thread
             processed_image *processed_im = (processed_image *) malloc(sizeof(processed_image));
-            processed_im->im = input->im;
+            processed_im->im = im;
             processed_im->nboxes = nboxes;
             processed_im->dets = dets;
 
             append_to_queue(processed_im, args->out_queue);
         } else {
-            free_image(input->im);
+            free_image(im);
             free_detections(dets, nboxes);
         }
-
-        free_image(input->sized);
-        free(input);
     }
 
     if (args->out_queue) {
@@ -241,7 +239,8 @@ void *detector(void *args_ptr) {
 
 typedef struct {
     network *net;
-    Queue *image_queue;
+    batch_ring *ring;
+    image *originals;
     int fd;
     Queue *out_queue;
 } PartialDetectorArgs;
@@ -249,31 +248,26 @@ typedef struct {
 void *partial_detector(void *args_ptr) {
     PartialDetectorArgs *args = (PartialDetectorArgs *) args_ptr;
 
-    loaded_image *input = NULL;
+    int index;
 
     layer l = args->net->layers[args->net->n - 1];
 
     int prep_size = l.outputs * sizeof(float);
 
-    while (1) {
-        read_from_queue((void **) &input, args->image_queue);
-
-        // Check for end of input data
-        if (!input->im.c) break;
+    while (batch_ring_take(args->ring, -1, &index) >= 0) {
+        image im = args->originals[index];
 
         // Preprocess
-        network_predict(args->net, input->sized.data);
+        network_predict(args->net, batch_ring_buffer(args->ring, index));
+        batch_ring_release(args->ring, index);
 
         preprocessed_image *prep_im = (preprocessed_image *) malloc(sizeof(preprocessed_image));
-        prep_im->im = input->sized;
+        prep_im->im = im;
         prep_im->preprocessed_data = (float *) malloc(prep_size);
         memcpy(prep_im->preprocessed_data, l.output, prep_size);
         prep_im->preprocessed_data_size = prep_size;
 
         append_to_queue(prep_im, args->out_queue);
-
-        free_image(input->im);
-        free(input);
     }
 
     preprocessed_image *end_im = (preprocessed_image *) malloc(sizeof(preprocessed_image));
@@ -332,6 +326,11 @@ void *printer(void *args_ptr) {
 typedef struct {
     int fd;
     Queue *image_queue;
+    int c, h, w;            // shape of the forwarded activations
+    int in_w, in_h;         // network input size
+    int dtype;
+    int compression;
+    long bytes_sent;
 } ForwarderArgs;
 
 void *forwarder(void *args_ptr) {
@@ -339,6 +338,8 @@ void *forwarder(void *args_ptr) {
 
     preprocessed_image *input = NULL;
     int err = 0;
+    uint32_t frame_id = 0;
+    frame_header hdr;
 
     while (1) {
         read_from_queue((void **) &input, args->image_queue);
@@ -346,26 +347,57 @@ void *forwarder(void *args_ptr) {
         // Check for end of data
         if (!input->im.c) break;
 
-        // Send input image (known size)
-        err = writen(args->fd, input->im.data, input->im.c * input->im.h * input->im.w * sizeof(float));
-        if (err < 0) {
-            perror("Error sending image data");
+        make_frame_header(&hdr, FRAME_ACTIVATIONS, ++frame_id, args->c, args->h, args->w);
+        hdr.in_w = args->in_w;
+        hdr.in_h = args->in_h;
+        hdr.im_w = input->im.w;
+        hdr.im_h = input->im.h;
+
+        unsigned char *payload = pack_frame(&hdr, input->preprocessed_data, args->dtype, args->compression, 0);
+        if (!payload) {
+            fprintf(stderr, "Error encoding frame %u\n", frame_id);
             exit(EXIT_FAILURE);
         }
 
-        // Send preprocessed data (knows size)
-        err = writen(args->fd, input->preprocessed_data, input->preprocessed_data_size);
+        err = send_frame(args->fd, &hdr, payload);
         if (err < 0) {
             perror("Error sending preprocessed data");
             exit(EXIT_FAILURE);
         }
+        args->bytes_sent += sizeof(frame_header) + hdr.payload_size;
 
+        free(payload);
         free_preprocessed_image(input);
     }
 
     pthread_exit(NULL);
 }
 
+typedef struct {
+    int fd;
+    int frames;
+    int detections;
+    double latency;
+} ReceiverArgs;
+
+// Collects the detections the server sends back until it closes the connection
+void *detection_receiver(void *args_ptr) {
+    ReceiverArgs *args = (ReceiverArgs *) args_ptr;
+    frame_header hdr;
+    unsigned char *payload = NULL;
+
+    while (receive_frame(args->fd, &hdr, &payload) > 0) {
+        if (hdr.type == FRAME_DETECTIONS) {
+            args->frames++;
+            args->detections += hdr.c;
+            args->latency += (frame_timestamp_now() - hdr.timestamp) / 1000000.;
+        }
+        free(payload);
+    }
+
+    pthread_exit(NULL);
+}
+
 int connect_to_server(char *server_hostname, char *server_port) {
     int fd = 0, err = 0;
     struct addrinfo hints;
@@ -402,7 +434,7 @@ int connect_to_server(char *server_hostname, char *server_port) {
     return -1;
 }
 
-void run_remote_detection(network *net, list *paths, char *server_hostname, char *server_port) {
+void run_remote_detection(network *net, list *paths, char *server_hostname, char *server_port, int dtype, int compression, int decoders, int decode_mb) {
     int fd = connect_to_server(server_hostname, server_port);
     if (fd < 0) {
         printf("Could not connect to server\n");
@@ -413,10 +445,23 @@ void run_remote_detection(network *net, list *paths, char *server_hostname, char
 
     double start_time = what_time_is_it_now();
 
+    // Detections coming back from the server
+    pthread_t receiver_thread;
+    ReceiverArgs receiver_args = { .fd = fd };
+    err = pthread_create(&receiver_thread, NULL, detection_receiver, (void *) &receiver_args);
+    if (err < 0) {
+        perror("Error creating receiver thread");
+        exit(EXIT_FAILURE);
+    }
+
     // Image loader
-    Queue *image_queue = create_queue(free_loaded_image);
+    batch_ring *ring = make_batch_ring(net->inputs, net->batch, 1, RING_SIZE);
+    image originals[RING_SIZE];
     pthread_t loader_thread;
-    ImageLoaderArgs loader_args = { .resize_h = net->h, .resize_w = net->h, .paths = paths, .queue = image_queue };
+    ImageLoaderArgs loader_args = {
+            .resize_h = net->h, .resize_w = net->w, .paths = paths,
+            .decoders = decoders, .decode_mb = decode_mb, .ring = ring, .originals = originals
+    };
 
     err = pthread_create(&loader_thread, NULL, image_loader, (void *) &loader_args);
     if (err < 0) {
@@ -427,7 +472,7 @@ void run_remote_detection(network *net, list *paths, char *server_hostname, char
     // Partial Detector
     Queue *preprocessed_queue = create_queue(free_preprocessed_image);
     pthread_t partial_detector_thread;
-    PartialDetectorArgs partial_detector_args = { .net = net, .image_queue = image_queue, .fd = fd, .out_queue = preprocessed_queue };
+    PartialDetectorArgs partial_detector_args = { .net = net, .ring = ring, .originals = originals, .fd = fd, .out_queue = preprocessed_queue };
 
     err = pthread_create(&partial_detector_thread, NULL, partial_detector, (void *) &partial_detector_args);
     if (err < 0) {
@@ -437,7 +482,12 @@ void run_remote_detection(network *net, list *paths, char *server_hostname, char
 
     // Forwarder
     pthread_t forwarder_thread;
-    ForwarderArgs forwarder_args = { .fd = fd, .image_queue = preprocessed_queue };
+    layer l = net->layers[net->n - 1];
+    ForwarderArgs forwarder_args = {
+            .fd = fd, .image_queue = preprocessed_queue,
+            .c = l.out_c, .h = l.out_h, .w = l.out_w, .in_w = net->w, .in_h = net->h,
+            .dtype = dtype, .compression = compression
+    };
     err = pthread_create(&forwarder_thread, NULL, forwarder, (void *) &forwarder_args);
     if (err < 0) {
         perror("Error creating forwarder thread");
@@ -450,21 +500,33 @@ void run_remote_detection(network *net, list *paths, char *server_hostname, char
 
     double end_time = what_time_is_it_now();
     printf("\nNote: timing includes thread creation overhead\n");
-    printf("Preprocessing and sending of %d images took %f seconds\t(%5.3f FPS)\n", paths->size, end_time - start_time, paths->size / (end_time - start_time));
+    printf("Preprocessing and sending of %d images took %f seconds\t(%5.3f FPS, %.1f KB per frame)\n", paths->size, end_time - start_time,
+           paths->size / (end_time - start_time), forwarder_args.bytes_sent / 1024. / paths->size);
+
+    // Wait for the remaining detections
+    shutdown(fd, SHUT_WR);
+    pthread_join(receiver_thread, NULL);
+    close(fd);
+    printf("Received detections for %d frames (%d boxes), %.2f ms average round trip\n", receiver_args.frames,
+           receiver_args.detections, receiver_args.frames ? 1000 * receiver_args.latency / receiver_args.frames : 0);
 
-    destroy_queue(image_queue);
+    free_batch_ring(ring);
     destroy_queue(preprocessed_queue);
 }
 
-void run_local_detection(network *net, list *paths, char *name_list, float thresh, float nms, float hier_thresh, int display) {
+void run_local_detection(network *net, list *paths, char *name_list, float thresh, float nms, float hier_thresh, int display, int decoders, int decode_mb) {
     int err = 0;
 
     double start_time = what_time_is_it_now();
 
     // Image loader
-    Queue *image_queue = create_queue(free_loaded_image);
+    batch_ring *ring = make_batch_ring(net->inputs, net->batch, 1, RING_SIZE);
+    image originals[RING_SIZE];
     pthread_t loader_thread;
-    ImageLoaderArgs loader_args = { .resize_h = net->h, .resize_w = net->w, .paths = paths, .queue = image_queue };
+    ImageLoaderArgs loader_args = {
+            .resize_h = net->h, .resize_w = net->w, .paths = paths,
+            .decoders = decoders, .decode_mb = decode_mb, .ring = ring, .originals = originals
+    };
 
     err = pthread_create(&loader_thread, NULL, image_loader, (void *) &loader_args);
     if (err < 0) {
@@ -479,7 +541,7 @@ void run_local_detection(network *net, list *paths, char *name_list, float thres
     }
 
     pthread_t detector_thread;
-    DetectorArgs detector_args = { .net = net, .thresh = thresh, .nms = nms, .hier_thresh = hier_thresh, .image_queue = image_queue, .out_queue = processed_queue };
+    DetectorArgs detector_args = { .net = net, .thresh = thresh, .nms = nms, .hier_thresh = hier_thresh, .ring = ring, .originals = originals, .out_queue = processed_queue };
 
     err = pthread_create(&detector_thread, NULL, detector, (void *) &detector_args);
     if (err < 0) {
@@ -510,18 +572,18 @@ void run_local_detection(network *net, list *paths, char *name_list, float thres
     printf("\nNote: timing includes thread creation overhead\n");
     printf("Detection of %d images took %f seconds\t(%5.3f FPS)\n", paths->size, end_time - start_time, paths->size / (end_time - start_time));
 
-    destroy_queue(image_queue);
+    free_batch_ring(ring);
     if (display) {
         destroy_queue(processed_queue);
     }
 }
 
-void run_jetson(char *datacfg, char *cfgfile, char *weightfile, char *imgfile, char *server_hostname, char *server_port, float thresh, int display) {
+void run_jetson(char *datacfg, char *cfgfile, char *weightfile, char *imgfile, char *server_hostname, char *server_port, float thresh, int display, int dtype, int compression, int decoders, int decode_mb) {
     list *options = read_data_cfg(datacfg);
     char *name_list = option_find_str(options, "names", "data/coco.names");
 
     // Load YOLO network
-    network *net = load_network(cfgfile, weightfile, 0);
+    network *net = load_network_inference(cfgfile, weightfile);
     srand(2222222);
     float nms = .45;
     float hier_thresh = .5;
@@ -533,9 +595,9 @@ void run_jetson(char *datacfg, char *cfgfile, char *weightfile, char *imgfile, c
     list *paths = get_paths(imgfile);
 
     if (local && paths) {
-        run_local_detection(net, paths, name_list, thresh, nms, hier_thresh, display);
+        run_local_detection(net, paths, name_list, thresh, nms, hier_thresh, display, decoders, decode_mb);
     } else if (!local && paths) {
-        run_remote_detection(net, paths, server_hostname, server_port);
+        run_remote_detection(net, paths, server_hostname, server_port, dtype, compression, decoders, decode_mb);
     } else {
         printf("Invalid argument combination\n");
     }
@@ -1,94 +1,36 @@
+#define _GNU_SOURCE
 #include "darknet.h"
+#include "protocol.h"
+#include "batch_ring.h"
 
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <sched.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-#define QUEUE_SIZE 64
-#define INPUT_C 3
+typedef struct Connection Connection;
 
-// Circular queue for images awaiting processing
+// An image awaiting processing. im points into its slot of a batch_ring
+// buffer and holds the decoded network input, either an image or the
+// activations of a split network.
 typedef struct {
     int client_id;
     int image_id;
     image im;
-    float *preprocessed_data;
+    Connection *conn;
+    frame_header header;
+    double enqueue_time;
 } ClientImage;
 
-typedef struct {
-    ClientImage data[QUEUE_SIZE];
-    int backlog;
-    int next_in;
-    int next_out;
-    pthread_mutex_t lock;
-    pthread_cond_t image_avail;
-    pthread_cond_t free_space;
-} ImageQueue;
-
-ImageQueue * create_image_queue() {
-    ImageQueue *queue = (ImageQueue *) malloc(sizeof(ImageQueue));
-    if (!queue) {
-        perror("Error allocating image queue");
-        exit(EXIT_FAILURE);
-    }
-
-    queue->backlog= 0;
-    queue->next_in = 0;
-    queue->next_out = 0;
-
-    pthread_mutex_init(&queue->lock, NULL);
-    pthread_cond_init(&queue->image_avail, NULL);
-    pthread_cond_init(&queue->free_space, NULL);
-
-    return queue;
-}
-
-void destroy_image_queue(ImageQueue *queue) {
-    pthread_mutex_destroy(&queue->lock);
-    pthread_cond_destroy(&queue->image_avail);
-    pthread_cond_destroy(&queue->free_space);
-
-    while (queue->backlog > 0) {
-        free_image(queue->data[queue->next_out].im);
-        free(queue->data[queue->next_out].preprocessed_data);
-        queue->next_out = (queue->next_out + 1) % QUEUE_SIZE;
-        queue->backlog -= 1;
-    }
-
-    free(queue);
-}
-
-void append_to_image_queue(ClientImage image, ImageQueue *queue) {
-    pthread_mutex_lock(&queue->lock);
-
-    while (!(queue->backlog < QUEUE_SIZE)) {
-        pthread_cond_wait(&queue->free_space, &queue->lock);
-    }
-
-    queue->data[queue->next_in] = image;
-    queue->next_in = (queue->next_in + 1) % QUEUE_SIZE;
-    queue->backlog += 1;
-
-    pthread_cond_signal(&queue->image_avail);
-    pthread_mutex_unlock(&queue->lock);
-}
-
-void read_from_image_queue(ClientImage *image, ImageQueue *queue) {
-    pthread_mutex_lock(&queue->lock);
-
-    while (!(queue->backlog > 0)) {
-        pthread_cond_wait(&queue->image_avail, &queue->lock);
-    }
-
-    *image = queue->data[queue->next_out];
-    queue->next_out = (queue->next_out + 1) % QUEUE_SIZE;
-    queue->backlog -= 1;
-
-    pthread_cond_signal(&queue->free_space);
-    pthread_mutex_unlock(&queue->lock);
-}
-
 int socket_setup(int port, int backlog) {
     int fd, err, optval;
     struct sockaddr_in addr;
@@ -113,200 +55,431 @@ int socket_setup(int port, int backlog) {
     return fd;
 }
 
-int read_image_data(int fd, float **X, size_t X_mem_size) {
-    size_t total_bytes_read = 0;
-    ssize_t bytes_read = 0;
-
-    *X = (float *) malloc(X_mem_size);
-    void *ptr;
-
-    while (total_bytes_read < X_mem_size) {
-        ptr = (void *) *X + total_bytes_read;
-
-        bytes_read = read(fd, ptr, X_mem_size - total_bytes_read);
-
-        if (bytes_read < 0) return -1;
-        if (bytes_read == 0) break;
-
-        total_bytes_read += bytes_read;
-    }
+// State of one client connection. The reactor owns one reference and every
+// frame in flight another; the socket is closed when the last one is dropped.
+// The socket is non-blocking: inference workers append their responses to
+// the output queue and write what the socket takes right away, and the
+// reactor flushes the rest once the socket becomes writable.
+struct Connection {
+    int fd;
+    int client_id;
+    int epfd;
+    frame_header header;
+    unsigned char *payload;
+    size_t payload_capacity;
+    size_t received;
+    int refs;
+    int eof;    // the client has sent its last frame
+    int closed; // dropped by the reactor, responses are discarded
+    unsigned char *out; // packed responses not yet written
+    size_t out_size;
+    size_t out_sent;
+    size_t out_capacity;
+    pthread_mutex_t lock; // guards refs, the flags and the output queue
+};
 
-    return total_bytes_read;
+typedef struct {
+    int fd;
+    int num_clients;
+    int input_size;
+    batch_ring *ring;
+    ClientImage *pending; // batch size entries per ring buffer
+    int batch_size;
+} ReactorArgs;
+
+#define MAX_EVENTS 64
+
+// A client that stops reading its responses is dropped once this many bytes
+// are waiting for it
+#define MAX_QUEUED_BYTES (64 << 20)
+
+// Watches the socket for more frames until the client has sent its last one,
+// and for becoming writable while responses are queued or once the
+// connection can be closed. Called with conn->lock held.
+void watch_connection(Connection *conn) {
+    struct epoll_event ev;
+    int queued = conn->out_sent < conn->out_size;
+    int finished = conn->eof && conn->refs == 1;
+
+    ev.events = (conn->eof ? 0 : EPOLLIN) | (queued || finished ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    // Fails harmlessly if the reactor already dropped the socket
+    epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
 }
 
-int handle_connection(int fd, int tid, int input_h, int input_w, int prep_size, ImageQueue *queue) {
-    int bytes = 0;
-    int img_id = 0;
+void retain_connection(Connection *conn) {
+    pthread_mutex_lock(&conn->lock);
+    conn->refs++;
+    pthread_mutex_unlock(&conn->lock);
+}
 
-    int input_size = input_h * input_w * INPUT_C * sizeof(float);
+void release_connection(Connection *conn) {
+    pthread_mutex_lock(&conn->lock);
+    int refs = --conn->refs;
+    // The reactor closes the connection once its last frame is answered
+    if (refs > 0 && !conn->closed) watch_connection(conn);
+    pthread_mutex_unlock(&conn->lock);
 
-    float *input_X, *prep_X;
+    if (refs > 0) return;
 
-    while (1) {
-        input_X = NULL;
-        prep_X = NULL;
+    close(conn->fd);
+    free(conn->payload);
+    free(conn->out);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+}
 
-        bytes = read_image_data(fd, &input_X, input_size);
+// Writes as much of the output queue as the socket takes without blocking.
+// Called with conn->lock held, returns -1 once the client has gone away.
+int flush_connection(Connection *conn) {
+    while (conn->out_sent < conn->out_size) {
+        ssize_t bytes = send(conn->fd, conn->out + conn->out_sent, conn->out_size - conn->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
         if (bytes < 0) {
-            perror("Error reading image");
-            exit(EXIT_FAILURE);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            return -1;
         }
+        conn->out_sent += bytes;
+    }
+    conn->out_size = conn->out_sent = 0;
+    return 0;
+}
 
-        // This client is done
-        if (bytes == 0) break;
+// Hangs up on a client without taking down the others. The reactor sees the
+// hangup and closes the connection.
+void drop_connection(Connection *conn, const char *reason) {
+    fprintf(stderr, "Dropping client %d: %s\n", conn->client_id, reason);
+    shutdown(conn->fd, SHUT_RDWR);
+}
 
-        // Client has preprocessed the image data.
-        if (prep_size > 0) {
-            bytes = read_image_data(fd, &prep_X, prep_size);
-            if (bytes < 0) {
-                perror("Error reading prep");
-                exit(EXIT_FAILURE);
-            }
-        }
+// Appends one frame to the output queue. Called with conn->lock held.
+void queue_response(Connection *conn, frame_header *hdr, unsigned char *payload) {
+    size_t size = sizeof(frame_header) + hdr->payload_size;
 
-        img_id++;
+    // Drop what has been written already
+    if (conn->out_sent > 0) {
+        memmove(conn->out, conn->out + conn->out_sent, conn->out_size - conn->out_sent);
+        conn->out_size -= conn->out_sent;
+        conn->out_sent = 0;
+    }
 
-        ClientImage cim = {
-                .client_id = tid, .image_id = img_id,
-                .im = { .c = INPUT_C, .h = input_h, .w = input_w, .data = input_X },
-                .preprocessed_data = prep_X
-        };
+    if (conn->out_size + size > MAX_QUEUED_BYTES) {
+        drop_connection(conn, "not reading its detections");
+        return;
+    }
+
+    if (conn->out_size + size > conn->out_capacity) {
+        size_t capacity = 2 * (conn->out_size + size);
+        unsigned char *out = realloc(conn->out, capacity);
+        if (!out) {
+            drop_connection(conn, "out of memory queueing its detections");
+            return;
+        }
+        conn->out = out;
+        conn->out_capacity = capacity;
+    }
+    memcpy(conn->out + conn->out_size, hdr, sizeof(frame_header));
+    memcpy(conn->out + conn->out_size + sizeof(frame_header), payload, hdr->payload_size);
+    conn->out_size += size;
+}
 
-        append_to_image_queue(cim, queue);
+// Sends the detections of one frame back to the client that sent it, without
+// ever blocking on a slow client
+void respond_with_detections(ClientImage *cim, detection_buffer *dets, float thresh) {
+    Connection *conn = cim->conn;
+    frame_header hdr = cim->header;
+    unsigned char *payload = pack_detection_buffer(&hdr, dets, thresh);
+
+    pthread_mutex_lock(&conn->lock);
+    // A client that went away only loses its own responses
+    if (!conn->closed && !payload) {
+        drop_connection(conn, "out of memory packing its detections");
+    } else if (!conn->closed) {
+        queue_response(conn, &hdr, payload);
+        // Whatever the socket doesn't take now the reactor writes later
+        if (flush_connection(conn) == 0) watch_connection(conn);
     }
+    pthread_mutex_unlock(&conn->lock);
 
-    // Signal end
-    ClientImage cim = { tid, -1 };
-    append_to_image_queue(cim, queue);
+    free(payload);
+}
 
-    return 0;
+void close_connection(Connection *conn, int epfd, ReactorArgs *args) {
+    pthread_mutex_lock(&conn->lock);
+    conn->closed = 1;
+    pthread_mutex_unlock(&conn->lock);
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    release_connection(conn);
 }
 
-typedef struct {
-    int fd;
-    int tid;
-    int input_h;
-    int input_w;
-    int prep_size;
-    pthread_mutex_t *accept_lock;
-    ImageQueue *queue;
-} WorkerArgs;
-
-void *listen_for_requests(void *args_ptr) {
-    WorkerArgs *args = (WorkerArgs *) args_ptr;
-    int fd = args->fd;
-    int new_fd = 0;
-    int optval = 1;
-    int err;
-
-    // No while loop. For now, each worker handles exactly one client ("camera") and shuts down.
-//    while (1) {
-    pthread_mutex_lock(args->accept_lock);
-    new_fd = accept(fd, NULL, NULL);
-    pthread_mutex_unlock(args->accept_lock);
-    if (new_fd < 0) {
-        perror("Error accepting");
-//            continue;
-        pthread_exit(NULL);
+// Decodes a complete frame straight into the next slot of the batch being
+// filled, where the network will read it
+void queue_frame(Connection *conn, ReactorArgs *args) {
+    frame_header *hdr = &conn->header;
+    int index, slot;
+
+    float *data = batch_ring_next_slot(args->ring, &index, &slot);
+    if (!unpack_frame(hdr, conn->payload, data)) {
+        fprintf(stderr, "Dropping undecodable frame %u from client %d\n", hdr->frame_id, conn->client_id);
+        batch_ring_cancel(args->ring);
+        return;
     }
 
-    err = setsockopt(new_fd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(int));
-    if (err < 0) {
-        perror("Error setting new socket option");
-    }
+    retain_connection(conn);
 
-    handle_connection(new_fd, args->tid, args->input_h, args->input_w, args->prep_size, args->queue);
-    close(new_fd);
-//    }
+    ClientImage cim = {
+            .client_id = conn->client_id, .image_id = hdr->frame_id,
+            .im = { .c = hdr->c, .h = hdr->h, .w = hdr->w, .data = data },
+            .conn = conn, .header = *hdr,
+            .enqueue_time = what_time_is_it_now()
+    };
+    args->pending[index * args->batch_size + slot] = cim;
 
-    pthread_exit(NULL);
+    batch_ring_commit(args->ring);
 }
 
-void run_server(char *datacfg, char *cfgfile, char *weightfile, int port, int size, int num_clients, float thresh, float hier_thresh, int partial, int display) {
-    int err = 0;
-    int i = 0;
-    int b = 0;
-    int num_workers = num_clients;
+// Reads whatever the socket has available, queueing every frame that
+// completes. Returns 1 once the client has sent its last frame and -1 if it
+// has gone away or sent garbage.
+int read_connection(Connection *conn, ReactorArgs *args) {
+    frame_header *hdr = &conn->header;
 
-    list *options = read_data_cfg(datacfg);
-    char *name_list = option_find_str(options, "names", "data/coco.names");
-    char **names = get_labels(name_list);
+    while (1) {
+        void *ptr;
+        size_t remaining;
+        if (conn->received < sizeof(frame_header)) {
+            ptr = (char *) hdr + conn->received;
+            remaining = sizeof(frame_header) - conn->received;
+        } else {
+            ptr = conn->payload + conn->received - sizeof(frame_header);
+            remaining = sizeof(frame_header) + hdr->payload_size - conn->received;
+        }
 
-    // Set up yolo network for detection
-    image **alphabet = load_alphabet();
-    network *net = load_network(cfgfile, weightfile, 0);
-    int batch_size = net->batch;
-    srand(2222222);
-    float nms = .45;
+        if (remaining > 0) {
+            ssize_t bytes_read = recv(conn->fd, ptr, remaining, MSG_DONTWAIT);
+            if (bytes_read < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                if (errno == EINTR) continue;
+                perror("Error reading frame");
+                return -1;
+            }
 
-    // Last layer
-    layer l = net->layers[net->n-1];
+            // This client is done sending
+            if (bytes_read == 0) return 1;
 
-    int resize_h = size;
-    int resize_w = size;
+            conn->received += bytes_read;
+        }
 
-    // Create queue for client images
-    printf("Creating image queue...\n");
-    ImageQueue *queue = create_image_queue();
+        if (conn->received == sizeof(frame_header)) {
+            if (!check_frame_header(hdr)) {
+                fprintf(stderr, "Invalid frame header from client %d\n", conn->client_id);
+                return -1;
+            }
+            // Only network inputs are accepted, so the payload is bounded by
+            // the input size in the frame's dtype
+            if (hdr->type != FRAME_IMAGE && hdr->type != FRAME_ACTIVATIONS) {
+                fprintf(stderr, "Client %d sent an unexpected frame of type %d\n", conn->client_id, hdr->type);
+                return -1;
+            }
+            if (hdr->c * hdr->h * hdr->w != args->input_size) {
+                fprintf(stderr, "Client %d sent a %dx%dx%d tensor, the network takes %d values\n",
+                        conn->client_id, hdr->c, hdr->h, hdr->w, args->input_size);
+                return -1;
+            }
+            if (hdr->payload_size > conn->payload_capacity) {
+                unsigned char *payload = realloc(conn->payload, hdr->payload_size);
+                if (!payload) {
+                    fprintf(stderr, "Out of memory receiving a %u byte frame from client %d\n", hdr->payload_size, conn->client_id);
+                    return -1;
+                }
+                conn->payload = payload;
+                conn->payload_capacity = hdr->payload_size;
+            }
+        }
 
-    // Setup threads to accept connections from clients
-    printf("Setting up server...\n");
-    int fd = 0;
-    pthread_t workers[num_workers];
-    WorkerArgs wargs[num_workers];
+        if (conn->received >= sizeof(frame_header) && conn->received == sizeof(frame_header) + hdr->payload_size) {
+            queue_frame(conn, args);
+            conn->received = 0;
+        }
+    }
+}
 
-    fd = socket_setup(port, num_workers);
-    if (fd < 0) {
-        perror("Error setting up socket");
+// Single event loop that accepts the clients, reads their frames and writes
+// the responses the workers could not write right away, all without
+// blocking. Runs until num_clients connections have been closed, or forever
+// if num_clients is 0.
+void *run_reactor(void *args_ptr) {
+    ReactorArgs *args = (ReactorArgs *) args_ptr;
+    struct epoll_event ev, events[MAX_EVENTS];
+    int next_client_id = 0;
+    int done_sending = 0;
+    int closed = 0;
+    int optval = 1;
+    int i, err;
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("Error creating epoll instance");
         exit(EXIT_FAILURE);
     }
 
-    // Ignoring SIGPIPE to avoid server crashes
-    signal(SIGPIPE, SIG_IGN);
+    fcntl(args->fd, F_SETFL, fcntl(args->fd, F_GETFL, 0) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // the listening socket
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, args->fd, &ev) < 0) {
+        perror("Error watching listening socket");
+        exit(EXIT_FAILURE);
+    }
 
-    // Lock synchronize threads accepting new connections
-    pthread_mutex_t accept_lock;
-    pthread_mutex_init(&accept_lock, NULL);
-
-    int preprocessed_size = partial ? net->layers[0].inputs : 0;
-    int im_size = net->c * net->h * net->w;
-
-    for (i = 0; i < num_workers; i++) {
-        wargs[i].fd = fd;
-        wargs[i].tid = i;
-        wargs[i].input_h = resize_h;
-        wargs[i].input_w = resize_w;
-        wargs[i].prep_size = preprocessed_size * sizeof(float);
-        wargs[i].accept_lock = &accept_lock;
-        wargs[i].queue = queue;
-        err = pthread_create(&workers[i], NULL, listen_for_requests, (void *) &wargs[i]);
-        if (err < 0) {
-            perror("Error creating new thread");
+    while (args->num_clients <= 0 || closed < args->num_clients) {
+        int nev = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (nev < 0) {
+            if (errno == EINTR) continue;
+            perror("Error waiting for events");
             exit(EXIT_FAILURE);
         }
+
+        for (i = 0; i < nev; i++) {
+            Connection *conn = (Connection *) events[i].data.ptr;
+
+            if (!conn) {
+                int new_fd;
+                while ((new_fd = accept4(args->fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    err = setsockopt(new_fd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(int));
+                    if (err < 0) {
+                        perror("Error setting new socket option");
+                    }
+
+                    conn = (Connection *) calloc(1, sizeof(Connection));
+                    conn->fd = new_fd;
+                    conn->client_id = next_client_id;
+                    conn->epfd = epfd;
+                    conn->refs = 1;
+                    pthread_mutex_init(&conn->lock, NULL);
+
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = conn;
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_fd, &ev) < 0) {
+                        // Not counted as a client, so another one can take its place
+                        perror("Error watching client socket");
+                        release_connection(conn);
+                        continue;
+                    }
+                    next_client_id++;
+
+                    // Everyone is here
+                    if (args->num_clients > 0 && next_client_id == args->num_clients) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, args->fd, NULL);
+                        break;
+                    }
+                }
+                if (new_fd < 0 && errno != EAGAIN && errno != EWOULDBLOCK) perror("Error accepting");
+                continue;
+            }
+
+            int status = 0;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) status = -1;
+            else if (!conn->eof && (events[i].events & EPOLLIN)) status = read_connection(conn, args);
+
+            pthread_mutex_lock(&conn->lock);
+            if (status != 0 && !conn->eof) {
+                conn->eof = 1;
+                // No more frames are coming, hand the last partial batch to
+                // the workers
+                if (++done_sending == args->num_clients) batch_ring_close(args->ring);
+            }
+            if (status >= 0 && flush_connection(conn) < 0) status = -1;
+            int finished = conn->eof && conn->refs == 1 && conn->out_sent == conn->out_size;
+            if (status >= 0 && !finished) watch_connection(conn);
+            pthread_mutex_unlock(&conn->lock);
+
+            if (status < 0 || finished) {
+                close_connection(conn, epfd, args);
+                closed++;
+            }
+        }
     }
 
-    printf("%d workers awaiting connections on port %d...\n", num_workers, port);
+    close(epfd);
+    pthread_exit(NULL);
+}
+
+typedef struct {
+    int id;
+    network *net;
+    batch_ring *ring;
+    ClientImage *pending;
+    double max_delay;
+    int threads;
+    int first_cpu;
+    float thresh;
+    float hier_thresh;
+    char **names;
+    image **alphabet;
+    int display;
+
+    // Filled in by the worker
+    int images;
+    int batches;
+    double queue_time;
+    double max_queue_time;
+    double compute_time;
+    double start_time;
+    double end_time;
+} InferenceArgs;
+
+// Restricts the calling thread, and the OpenMP threads it later starts, to
+// count cpus starting at first
+void pin_to_cpus(int first, int count) {
+    int i;
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < count; i++) CPU_SET((first + i) % ncpu, &set);
+
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (err) fprintf(stderr, "Error pinning inference worker: %s\n", strerror(err));
+}
 
-    image batch_im = make_image(net->w, net->h, net->c * batch_size);
-    ClientImage batch[batch_size];
+void *run_inference(void *args_ptr) {
+    InferenceArgs *args = (InferenceArgs *) args_ptr;
+    network *net = args->net;
+    int i = 0;
+    int b = 0;
+    int n = 0;
+    int index = 0;
 
-    int sentinel_images = 0;
-    int total_images = 0;
+    if (args->threads > 0) {
+        pin_to_cpus(args->first_cpu, args->threads);
+#ifdef _OPENMP
+        omp_set_num_threads(args->threads);
+#endif
+    }
+
+    int batch_size = net->batch;
+    float nms = .45;
+
+    // Last layer
+    layer l = net->layers[net->n-1];
 
-    int done = 0;
     double batch_start_time = 0;
-    double bps = 0;
-    double start_time = 0;
+    double compute_time = 0;
+    double queue_time = 0;
 
     int net_w = net->w;
     int net_h = net->h;
 
+    // Reused for every batch this worker answers
+    detection_buffer **found = calloc(batch_size, sizeof(detection_buffer *));
+    for (b = 0; b < batch_size; ++b) found[b] = make_detection_buffer();
+
 #ifdef OPENCV
     // Create windows for displaying detetcions
     char windows[batch_size][5];
 
-    if (display) {
+    if (args->display) {
         for (b = 0; b < batch_size; ++b) {
             sprintf(windows[b], "%d", b);
             cvNamedWindow(windows[b], CV_WINDOW_NORMAL);
@@ -316,112 +489,215 @@ void run_server(char *datacfg, char *cfgfile, char *weightfile, int port, int si
 #endif
 
     while (1) {
-        if (batch_size == 1) { // avoid copy if batch_size is 1
-            for (b = 0; b < batch_size; b++) {
-                read_from_image_queue(&batch[b], queue);
-
-                if (batch[b].image_id == -1) { // sentinel image
-                    sentinel_images++;
-                    if (sentinel_images == num_workers) { // we are done
-                        done = 1;
-                        break;
-                    }
+        n = batch_ring_take(args->ring, args->max_delay, &index);
 
-                    // decrease b to try to get another image
-                    b--;
-                }
-            }
-
-            if (partial)
-                batch_im.data = batch[0].preprocessed_data;
-            else
-                batch_im.data = batch[0].im.data;
+        // Check for end
+        if (n < 0) break;
 
-        } else {
-            for (b = 0; b < batch_size; b++) {
-                read_from_image_queue(&batch[b], queue);
+        ClientImage *batch = args->pending + index * batch_size;
 
-                if (batch[b].image_id == -1) { // sentinel image
-                    sentinel_images++;
-                    if (sentinel_images == num_workers) { // we are done
-                        done = 1;
-                        break;
-                    }
+        batch_start_time = what_time_is_it_now();
 
-                    // decrease b to try to get another image
-                    b--;
-                    continue;
-                }
+        // Start timing
+        if (args->images == 0) args->start_time = batch_start_time;
 
-                if (partial)
-                    copy_cpu(preprocessed_size, batch[b].preprocessed_data, 1, batch_im.data + b * preprocessed_size, 1);
-                else
-                    copy_cpu(im_size, batch[b].im.data, 1, batch_im.data + b * im_size, 1);
-            }
+        queue_time = 0;
+        for (b = 0; b < n; b++) {
+            double t = batch_start_time - batch[b].enqueue_time;
+            queue_time += t;
+            if (t > args->max_queue_time) args->max_queue_time = t;
         }
+        args->queue_time += queue_time;
 
-        // Check for end
-        if (done) break;
-
-        // Start timing
-        if (total_images == 0) start_time = what_time_is_it_now();
+        args->images += n;
+        args->batches += 1;
 
-        batch_start_time = what_time_is_it_now();
+        // The frames were decoded in place. The network always runs at its
+        // full batch size; unused slots hold stale inputs whose outputs are
+        // ignored.
+        float *X = batch_ring_buffer(args->ring, index);
+        network_predict(net, X);
 
-        total_images += batch_size;
+        // Outputs of the padded slots are ignored
+        for (b = 0; b < n; b++) {
+            frame_header *hdr = &batch[b].header;
 
-        float *X = batch_im.data;
-        network_predict(net, X);
+            // Temporary workaround for input w and h to get detections: boxes
+            // are corrected for the letterboxing the client did and come back
+            // relative to its original image
+            net->w = hdr->in_w;
+            net->h = hdr->in_h;
 
-        // Temporary workaround for input w and h to get detections
-        net->w = resize_w;
-        net->h = resize_h;
+            fill_network_detections(net, hdr->im_w, hdr->im_h, args->thresh, args->hier_thresh, 0, 1, b, found[b]);
 
-        for (b = 0; b < batch_size; b++) {
-            int nboxes = 0;
-            detection *dets = get_network_boxes(net, batch[b].im.w, batch[b].im.h, thresh, hier_thresh, 0, 1, b, &nboxes);
-            if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
-            draw_detections(batch[b].im, dets, nboxes, thresh, names, alphabet, l.classes);
-            free_detections(dets, nboxes);
+            if (args->display && hdr->type == FRAME_IMAGE) {
+                int nboxes = 0;
+                detection *dets = get_network_boxes(net, batch[b].im.w, batch[b].im.h, args->thresh, args->hier_thresh, 0, 1, b, &nboxes);
+                if (nms) do_nms_sort(dets, nboxes, l.classes, nms);
+                draw_detections(batch[b].im, dets, nboxes, args->thresh, args->names, args->alphabet, l.classes);
+                free_detections(dets, nboxes);
+            }
         }
+        if (nms) do_nms_sort_batch(found, n, nms);
+        for (b = 0; b < n; b++) respond_with_detections(&batch[b], found[b], args->thresh);
 
         // Restore w and h to run next batch
         net->w = net_w;
         net->h = net_h;
 
-        bps = 1 / (what_time_is_it_now() - batch_start_time);
-        printf("\rBatch size: %d\tBPS: %5.3f", batch_size, bps);
+        args->end_time = what_time_is_it_now();
+        compute_time = args->end_time - batch_start_time;
+        args->compute_time += compute_time;
+        printf("\rWorker %d batch: %d/%d (fill %3.0f%%)\tQueue: %7.2f ms avg\tCompute: %7.2f ms\tBPS: %5.3f",
+               args->id, n, batch_size, 100. * n / batch_size, 1000 * queue_time / n, 1000 * compute_time, 1 / compute_time);
         fflush(stdout);
 
         // Show and free input images
-        for (i = 0; i < batch_size; i++) {
+        for (i = 0; i < n; i++) {
             #ifdef OPENCV
-            if (display) {
+            if (args->display && batch[i].header.type == FRAME_IMAGE) {
                 show_image(batch[i].im, windows[i]);
                 cvWaitKey(1);
             }
             #endif
 
-            free_image(batch[i].im);
-            free(batch[i].preprocessed_data);
+            release_connection(batch[i].conn);
         }
+        batch_ring_release(args->ring, index);
     }
-
-    double end_time = what_time_is_it_now();
-    printf("\rDetection for %d workers and %d total images with batch size %d took %f seconds (%5.3f BPS).\n", num_workers, total_images, batch_size, end_time - start_time, (total_images / batch_size) / (end_time - start_time));
-
-    for (i = 0; i < num_workers; i++) {
-        pthread_join(workers[i], NULL);
-    }
+    for (b = 0; b < batch_size; ++b) free_detection_buffer(found[b]);
+    free(found);
 
 #ifdef OPENCV
-    if (display) {
+    if (args->display) {
         cvWaitKey(0);
         cvDestroyAllWindows();
     }
 #endif
 
-    free_image(batch_im);
-    destroy_image_queue(queue);
-    pthread_mutex_destroy(&accept_lock);
+    pthread_exit(NULL);
+}
+
+void run_server(char *datacfg, char *cfgfile, char *weightfile, int port, int num_clients, int max_batch, float max_delay_ms, int num_replicas, int threads, float thresh, float hier_thresh, int display) {
+    int err = 0;
+    int i = 0;
+
+    list *options = read_data_cfg(datacfg);
+    char *name_list = option_find_str(options, "names", "data/coco.names");
+    char **names = get_labels(name_list);
+
+    // Set up yolo network for detection. Additional replicas share its weights
+    // and only get their own activations and workspace.
+    if (num_replicas < 1) num_replicas = 1;
+    image **alphabet = load_alphabet();
+    network *nets[num_replicas];
+    nets[0] = load_network_inference(cfgfile, weightfile);
+    for (i = 1; i < num_replicas; i++) {
+        nets[i] = load_network_replica(cfgfile, nets[0]);
+    }
+    network *net = nets[0];
+    int batch_size = net->batch;
+    srand(2222222);
+
+    // Split the cores between the replicas, each pinned to its own subset
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0 && num_replicas > 1) threads = (ncpu / num_replicas > 0) ? ncpu / num_replicas : 1;
+
+    if (display && num_replicas > 1) {
+        fprintf(stderr, "Displaying detections is only supported with a single replica\n");
+        display = 0;
+    }
+
+    // Frames are decoded straight into batch buffers. Every replica can hold
+    // one while the reactor fills another and one more waits.
+    if (max_batch < 1 || max_batch > batch_size) max_batch = batch_size;
+    int ring_size = num_replicas + 2;
+    batch_ring *ring = make_batch_ring(net->inputs, batch_size, max_batch, ring_size);
+    ClientImage *pending = (ClientImage *) calloc(ring_size * batch_size, sizeof(ClientImage));
+
+    // Setup the event loop that accepts connections from clients
+    printf("Setting up server...\n");
+    int fd = socket_setup(port, SOMAXCONN);
+    if (fd < 0) {
+        perror("Error setting up socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // Ignoring SIGPIPE to avoid server crashes
+    signal(SIGPIPE, SIG_IGN);
+
+    ReactorArgs rargs = {
+            .fd = fd, .num_clients = num_clients, .input_size = net->inputs,
+            .ring = ring, .pending = pending, .batch_size = batch_size
+    };
+
+    pthread_t reactor;
+    err = pthread_create(&reactor, NULL, run_reactor, (void *) &rargs);
+    if (err < 0) {
+        perror("Error creating new thread");
+        exit(EXIT_FAILURE);
+    }
+
+    if (num_clients > 0) printf("Awaiting connections on port %d, serving %d clients...\n", port, num_clients);
+    else printf("Awaiting connections on port %d...\n", port);
+
+    printf("%d inference replicas (%d threads each), batching up to %d images (network batch %d), waiting at most %.1f ms\n",
+           num_replicas, threads, max_batch, batch_size, max_delay_ms);
+
+    pthread_t replica_threads[num_replicas];
+    InferenceArgs iargs[num_replicas];
+
+    for (i = 0; i < num_replicas; i++) {
+        InferenceArgs a = {
+                .id = i, .net = nets[i], .ring = ring, .pending = pending,
+                .max_delay = max_delay_ms / 1000.,
+                .threads = threads, .first_cpu = i * threads,
+                .thresh = thresh, .hier_thresh = hier_thresh,
+                .names = names, .alphabet = alphabet, .display = display
+        };
+        iargs[i] = a;
+        err = pthread_create(&replica_threads[i], NULL, run_inference, (void *) &iargs[i]);
+        if (err < 0) {
+            perror("Error creating inference thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int total_images = 0;
+    int total_batches = 0;
+    double total_queue_time = 0;
+    double total_compute_time = 0;
+    double max_queue_time = 0;
+    double start_time = 0;
+    double end_time = 0;
+
+    for (i = 0; i < num_replicas; i++) {
+        pthread_join(replica_threads[i], NULL);
+        if (iargs[i].batches == 0) continue;
+        if (total_batches == 0 || iargs[i].start_time < start_time) start_time = iargs[i].start_time;
+        if (iargs[i].end_time > end_time) end_time = iargs[i].end_time;
+        if (iargs[i].max_queue_time > max_queue_time) max_queue_time = iargs[i].max_queue_time;
+        total_images += iargs[i].images;
+        total_batches += iargs[i].batches;
+        total_queue_time += iargs[i].queue_time;
+        total_compute_time += iargs[i].compute_time;
+    }
+
+    if (total_batches > 0) {
+        printf("\rDetection for %d clients and %d total images in %d batches of size %d took %f seconds (%5.3f BPS, %5.3f images/s).\n",
+               num_clients, total_images, total_batches, batch_size, end_time - start_time,
+               total_batches / (end_time - start_time), total_images / (end_time - start_time));
+        printf("Average batch fill: %.1f%%, queue time: %.2f ms avg / %.2f ms max, compute time: %.2f ms per batch\n",
+               100. * total_images / (total_batches * batch_size), 1000 * total_queue_time / total_images,
+               1000 * max_queue_time, 1000 * total_compute_time / total_batches);
+    }
+
+    pthread_join(reactor, NULL);
+    close(fd);
+
+    for (i = 1; i < num_replicas; i++) {
+        free_network(nets[i]);
+    }
+    free_batch_ring(ring);
+    free(pending);
 }
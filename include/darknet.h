@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #define SECRET_NUM -1234
@@ -61,6 +62,10 @@ typedef enum{
     MULT, ADD, SUB, DIV
 } BINARY_ACTIVATION;
 
+typedef enum{
+    CONV_GEMM, CONV_WINOGRAD, CONV_DIRECT
+} CONV_ALGORITHM;
+
 typedef enum {
     CONVOLUTIONAL,
     DECONVOLUTIONAL,
@@ -112,6 +117,8 @@ typedef struct{
 struct network;
 typedef struct network network;
 
+typedef struct network_profile network_profile;
+
 struct layer;
 typedef struct layer layer;
 
@@ -119,6 +126,7 @@ struct layer{
     LAYER_TYPE type;
     ACTIVATION activation;
     COST_TYPE cost_type;
+    CONV_ALGORITHM algorithm;
     void (*forward)   (struct layer, struct network);
     void (*backward)  (struct layer, struct network);
     void (*update)    (struct layer, update_args);
@@ -126,6 +134,8 @@ struct layer{
     void (*backward_gpu)  (struct layer, struct network);
     void (*update_gpu)    (struct layer, update_args);
     int batch_normalize;
+    int batchnorm_folded;
+    int shared;
     int shortcut;
     int batch;
     int forced;
@@ -236,6 +246,11 @@ struct layer{
 
     float * weights;
     float * weight_updates;
+    float * packed_weights;
+
+    float input_scale;
+    float * weight_scales;
+    void * qweights;
 
     float * delta;
     float * output;
@@ -480,7 +495,11 @@ typedef struct network{
     float *truth;
     float *delta;
     float *workspace;
+    float *arena;
+    size_t arena_size;
+    network_profile *profile;
     int train;
+    int inference;
     int index;
     float *cost;
     float clip;
@@ -524,6 +543,20 @@ typedef struct detection{
     int sort_class;
 } detection;
 
+// Detections of one image as a structure of arrays, kept between frames so
+// that extracting them allocates nothing once it has grown. Box i is
+// (x[i], y[i], w[i], h[i]) and its class scores are prob[i*classes + j].
+typedef struct detection_buffer{
+    int n;
+    int capacity;
+    int classes;
+    float *x, *y, *w, *h;
+    float *objectness;
+    float *prob;
+    int *cells;
+    int cells_capacity;
+} detection_buffer;
+
 typedef struct matrix{
     int rows, cols;
     float **vals;
@@ -543,6 +576,8 @@ typedef enum {
     CLASSIFICATION_DATA, DETECTION_DATA, CAPTCHA_DATA, REGION_DATA, IMAGE_DATA, COMPARE_DATA, WRITING_DATA, SWAG_DATA, TAG_DATA, OLD_CLASSIFICATION_DATA, STUDY_DATA, DET_DATA, SUPER_DATA, LETTERBOX_DATA, REGRESSION_DATA, SEGMENTATION_DATA, INSTANCE_DATA
 } data_type;
 
+typedef struct dataset_shards dataset_shards;
+
 typedef struct load_args{
     int threads;
     char **paths;
@@ -574,6 +609,7 @@ typedef struct load_args{
     image *resized;
     data_type type;
     tree *hierarchy;
+    dataset_shards *shards;
 } load_args;
 
 typedef struct{
@@ -584,6 +620,9 @@ typedef struct{
 
 
 network *load_network(char *cfg, char *weights, int clear);
+network *load_network_inference(char *cfg, char *weights);
+network *load_network_replica(char *cfg, network *base);
+
 load_args get_base_args(network *net);
 
 void free_data(data d);
@@ -674,6 +713,7 @@ void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const ch
 void get_detection_detections(layer l, int w, int h, float thresh, detection *dets);
 
 char *option_find_str(list *l, char *key, char *def);
+char *option_find_str_quiet(list *l, char *key, char *def);
 int option_find_int(list *l, char *key, int def);
 int option_find_int_quiet(list *l, char *key, int def);
 
@@ -681,6 +721,14 @@ network *parse_network_cfg(char *filename);
 void save_weights(network *net, char *filename);
 void load_weights(network *net, char *filename);
 void save_weights_upto(network *net, char *filename, int cutoff);
+void save_weights_int8(network *net, char *filename);
+void calibrate_network(network *net, char **paths, int n);
+void print_memory_plan(network *net, int batch);
+void enable_network_profile(network *net);
+void disable_network_profile(network *net);
+void print_network_profile(network *net);
+void save_network_profile_json(network *net, char *filename);
+void save_network_profile_trace(network *net, char *filename);
 void load_weights_upto(network *net, char *filename, int start, int cutoff);
 
 void zero_objectness(layer l);
@@ -691,10 +739,15 @@ void set_batch_network(network *net, int b);
 void set_temp_network(network *net, float t);
 image load_image(char *filename, int w, int h, int c);
 image load_image_color(char *filename, int w, int h);
+image load_image_from_memory(unsigned char *buf, int len, int channels);
+unsigned char *encode_image_jpg(image im, int quality, int *size);
 image make_image(int w, int h, int c);
 image resize_image(image im, int w, int h);
 void censor_image(image im, int dx, int dy, int w, int h);
 image letterbox_image(image im, int w, int h);
+void letterbox_image_into(image im, int w, int h, image boxed);
+void letterbox_bytes_into(unsigned char *data, int sw, int sh, int c, int w, int h, float *boxed);
+image load_image_letterbox(char *filename, int w, int h, int c, float *boxed);
 image crop_image(image im, int dx, int dy, int w, int h);
 image center_crop_image(image im, int w, int h);
 image resize_min(image im, int min);
@@ -704,6 +757,8 @@ image mask_to_rgb(image mask);
 int resize_network(network *net, int w, int h);
 void free_matrix(matrix m);
 void test_resize(char *filename);
+void test_distort_image(int w, int h, float hue, float saturation, float exposure, int runs);
+void test_warp_image(int w, int h, int runs);
 void save_image(image p, const char *name);
 void show_image(image p, const char *name);
 image copy_image(image p);
@@ -737,6 +792,7 @@ matrix network_predict_data(network *net, data test);
 image **load_alphabet();
 image get_network_image(network *net);
 float *network_predict(network *net, float *input);
+void set_activation_tolerance(float tolerance);
 
 int network_width(network *net);
 int network_height(network *net);
@@ -744,12 +800,18 @@ float *network_predict_image(network *net, image im);
 void network_detect(network *net, image im, float thresh, float hier_thresh, float nms, detection *dets);
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int b, int *num);
 void free_detections(detection *dets, int n);
+detection_buffer *make_detection_buffer();
+void free_detection_buffer(detection_buffer *d);
+int fill_network_detections(network *net, int w, int h, float thresh, float hier, int *map, int relative, int b, detection_buffer *d);
 
 void reset_network_state(network *net, int b);
 
 char **get_labels(char *filename);
 void do_nms_obj(detection *dets, int total, int classes, float thresh);
 void do_nms_sort(detection *dets, int total, int classes, float thresh);
+void do_nms_sort_buffer(detection_buffer *d, float thresh);
+void do_nms_sort_batch(detection_buffer **d, int n, float thresh);
+void do_soft_nms_buffer(detection_buffer *d, float sigma, float thresh);
 
 matrix make_matrix(int rows, int cols);
 
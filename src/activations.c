@@ -1,10 +1,16 @@
 #include "activations.h"
+#include "utils.h"
 
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ACTIVATIONS_X86
+#endif
+
 char *get_activation_string(ACTIVATION a)
 {
     switch(a){
@@ -92,14 +98,177 @@ float activate(float x, ACTIVATION a)
     return 0;
 }
 
-void activate_array(float *x, const int n, const ACTIVATION a)
+// Largest absolute error of the fast logistic, loggy, tanh and elu over
+// the whole float range, measured by test_activations
+#define FAST_ACTIVATION_ERROR 1e-6
+
+typedef void (*activation_kernel)(float *x, const int n, const ACTIVATION a);
+
+static activation_kernel fast_activations = 0;
+static activation_kernel select_fast_activations();
+
+// Lets activate_array trade accuracy for speed: the exp based activations
+// switch to fast_exp when tolerance allows for its error. 0 keeps libm.
+void set_activation_tolerance(float tolerance)
+{
+    fast_activations = tolerance >= FAST_ACTIVATION_ERROR ? select_fast_activations() : 0;
+}
+
+// exp(x) as 2^k * p(r) with x = k*ln2 + r, |r| <= ln2/2 and p the Cephes
+// expf polynomial. Branch free so that loops over it vectorize; inputs are
+// clamped to where 2^k stays a normal float.
+static inline float fast_exp(float x)
+{
+    union {float f; int32_t i;} scale;
+    x = x < -87.3f ? -87.3f : x;
+    x = x > 88.3f ? 88.3f : x;
+    int k = (int)(x*1.44269504f + 128.5f) - 128;
+    float r = x - k*0.693359375f + k*2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p*r + 1.3981999507e-3f;
+    p = p*r + 8.3334519073e-3f;
+    p = p*r + 4.1665795894e-2f;
+    p = p*r + 1.6666665459e-1f;
+    p = p*r + 5.0000001201e-1f;
+    p = p*r*r + r + 1;
+    scale.i = (k + 127) << 23;
+    return p*scale.f;
+}
+
+static inline float fast_logistic_activate(float x){return 1.f/(1.f + fast_exp(-x));}
+static inline float fast_loggy_activate(float x){return 2.f/(1.f + fast_exp(-x)) - 1;}
+static inline float fast_tanh_activate(float x){return 2.f/(1.f + fast_exp(-2*x)) - 1;}
+static inline float fast_elu_activate(float x){return x >= 0 ? x : fast_exp(x) - 1;}
+
+// One loop per activation with the function inlined, so the switch is out of
+// the hot loop and the branch free ones are vectorized by the compiler
+#define ACTIVATE_LOOP(f) for(i = 0; i < n; ++i) x[i] = f(x[i]); break
+
+static void activate_array_exact(float *x, const int n, const ACTIVATION a)
 {
     int i;
-    for(i = 0; i < n; ++i){
-        x[i] = activate(x[i], a);
+    switch(a){
+        case LINEAR:
+            break;
+        case LOGISTIC:
+            ACTIVATE_LOOP(logistic_activate);
+        case LOGGY:
+            ACTIVATE_LOOP(loggy_activate);
+        case RELU:
+            ACTIVATE_LOOP(relu_activate);
+        case ELU:
+            ACTIVATE_LOOP(elu_activate);
+        case RELIE:
+            ACTIVATE_LOOP(relie_activate);
+        case RAMP:
+            ACTIVATE_LOOP(ramp_activate);
+        case LEAKY:
+            ACTIVATE_LOOP(leaky_activate);
+        case TANH:
+            ACTIVATE_LOOP(tanh_activate);
+        case PLSE:
+            ACTIVATE_LOOP(plse_activate);
+        case STAIR:
+            ACTIVATE_LOOP(stair_activate);
+        case HARDTAN:
+            ACTIVATE_LOOP(hardtan_activate);
+        case LHTAN:
+            ACTIVATE_LOOP(lhtan_activate);
+    }
+}
+
+static void activate_array_fast(float *x, const int n, const ACTIVATION a)
+{
+    int i;
+    switch(a){
+        case LOGISTIC:
+            ACTIVATE_LOOP(fast_logistic_activate);
+        case LOGGY:
+            ACTIVATE_LOOP(fast_loggy_activate);
+        case TANH:
+            ACTIVATE_LOOP(fast_tanh_activate);
+        case ELU:
+            ACTIVATE_LOOP(fast_elu_activate);
+        default:
+            activate_array_exact(x, n, a);
     }
 }
 
+#ifdef ACTIVATIONS_X86
+
+// fast_exp on 8 lanes, with the polynomial evaluated by fma
+__attribute__((target("avx2,fma")))
+static inline __m256 fast_exp_avx2(__m256 x)
+{
+    x = _mm256_max_ps(x, _mm256_set1_ps(-87.3f));
+    x = _mm256_min_ps(x, _mm256_set1_ps(88.3f));
+    __m256i k = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _mm256_set1_ps(128.5f)));
+    k = _mm256_sub_epi32(k, _mm256_set1_epi32(128));
+    __m256 kf = _mm256_cvtepi32_ps(k);
+    __m256 r = _mm256_fnmadd_ps(kf, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fmadd_ps(kf, _mm256_set1_ps(2.12194440e-4f), r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(_mm256_mul_ps(p, r), r, _mm256_add_ps(r, _mm256_set1_ps(1)));
+    __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(k, _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(scale));
+}
+
+#define AVX2_ACTIVATE_LOOP(expr) \
+    for(; i + 8 <= n; i += 8){ \
+        __m256 v = _mm256_loadu_ps(x + i); \
+        _mm256_storeu_ps(x + i, expr); \
+    } \
+    break
+
+__attribute__((target("avx2,fma")))
+static void activate_array_fast_avx2(float *x, const int n, const ACTIVATION a)
+{
+    int i = 0;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 two = _mm256_set1_ps(2);
+    switch(a){
+        case LOGISTIC:
+            AVX2_ACTIVATE_LOOP(_mm256_div_ps(one, _mm256_add_ps(one, fast_exp_avx2(_mm256_sub_ps(zero, v)))));
+        case LOGGY:
+            AVX2_ACTIVATE_LOOP(_mm256_sub_ps(_mm256_div_ps(two, _mm256_add_ps(one, fast_exp_avx2(_mm256_sub_ps(zero, v)))), one));
+        case TANH:
+            AVX2_ACTIVATE_LOOP(_mm256_sub_ps(_mm256_div_ps(two, _mm256_add_ps(one, fast_exp_avx2(_mm256_mul_ps(v, _mm256_set1_ps(-2))))), one));
+        case ELU:
+            AVX2_ACTIVATE_LOOP(_mm256_blendv_ps(_mm256_sub_ps(fast_exp_avx2(v), one), v, _mm256_cmp_ps(v, zero, _CMP_GE_OQ)));
+        default:
+            activate_array_exact(x, n, a);
+            return;
+    }
+    // The last n % 8 elements
+    activate_array_fast(x + i, n - i, a);
+}
+
+#endif
+
+// Picks the widest fast kernel this cpu runs, like get_gemm_kernel. NEON is
+// part of the aarch64 baseline, where the portable loops are vectorized
+// already.
+static activation_kernel select_fast_activations()
+{
+#ifdef ACTIVATIONS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return activate_array_fast_avx2;
+#endif
+    return activate_array_fast;
+}
+
+void activate_array(float *x, const int n, const ACTIVATION a)
+{
+    if(fast_activations) fast_activations(x, n, a);
+    else activate_array_exact(x, n, a);
+}
+
 float gradient(float x, ACTIVATION a)
 {
     switch(a){
@@ -133,11 +302,108 @@ float gradient(float x, ACTIVATION a)
     return 0;
 }
 
+#define GRADIENT_LOOP(f) for(i = 0; i < n; ++i) delta[i] *= f(x[i]); break
+
 void gradient_array(const float *x, const int n, const ACTIVATION a, float *delta)
+{
+    int i;
+    switch(a){
+        case LINEAR:
+            break;
+        case LOGISTIC:
+            GRADIENT_LOOP(logistic_gradient);
+        case LOGGY:
+            GRADIENT_LOOP(loggy_gradient);
+        case RELU:
+            GRADIENT_LOOP(relu_gradient);
+        case ELU:
+            GRADIENT_LOOP(elu_gradient);
+        case RELIE:
+            GRADIENT_LOOP(relie_gradient);
+        case RAMP:
+            GRADIENT_LOOP(ramp_gradient);
+        case LEAKY:
+            GRADIENT_LOOP(leaky_gradient);
+        case TANH:
+            GRADIENT_LOOP(tanh_gradient);
+        case PLSE:
+            GRADIENT_LOOP(plse_gradient);
+        case STAIR:
+            GRADIENT_LOOP(stair_gradient);
+        case HARDTAN:
+            GRADIENT_LOOP(hardtan_gradient);
+        case LHTAN:
+            GRADIENT_LOOP(lhtan_gradient);
+    }
+}
+
+// The per element switch activate_array used to run
+static void activate_array_scalar(float *x, const int n, const ACTIVATION a)
 {
     int i;
     for(i = 0; i < n; ++i){
-        delta[i] *= gradient(x[i], a);
+        x[i] = activate(x[i], a);
+    }
+}
+
+// Runs kernel iters times over a copy of input, returns the seconds per run
+// and leaves the last result in x
+static double time_activation_kernel(activation_kernel kernel, ACTIVATION a, float *input, float *x, int n, int iters)
+{
+    int i;
+    double start = what_time_is_it_now();
+    for(i = 0; i < iters; ++i){
+        memcpy(x, input, n*sizeof(float));
+        kernel(x, n, a);
+    }
+    return (what_time_is_it_now() - start)/iters;
+}
+
+static float max_activation_error(float *x, float *ref, int n)
+{
+    int j;
+    float err = 0;
+    for(j = 0; j < n; ++j) err = fmaxf(err, fabsf(x[j] - ref[j]));
+    return err;
+}
+
+static void time_activation(ACTIVATION a, float *input, float *x, int n, int iters)
+{
+    double scalar, exact, fast, widest;
+    float *ref = calloc(n, sizeof(float));
+    float exact_err, fast_err, widest_err;
+    activation_kernel kernel = select_fast_activations();
+
+    scalar = time_activation_kernel(activate_array_scalar, a, input, x, n, iters);
+    memcpy(ref, x, n*sizeof(float));
+    exact = time_activation_kernel(activate_array_exact, a, input, x, n, iters);
+    exact_err = max_activation_error(x, ref, n);
+    fast = time_activation_kernel(activate_array_fast, a, input, x, n, iters);
+    fast_err = max_activation_error(x, ref, n);
+
+    printf("%-9s scalar %6.2f ns/elem | specialized %6.2f ns/elem (%5.2fx) err %.1e | fast %6.2f ns/elem (%5.2fx) err %.1e",
+            get_activation_string(a), scalar*1e9/n, exact*1e9/n, scalar/exact, exact_err,
+            fast*1e9/n, scalar/fast, fast_err);
+    if(kernel != activate_array_fast){
+        widest = time_activation_kernel(kernel, a, input, x, n, iters);
+        widest_err = max_activation_error(x, ref, n);
+        printf(" | avx2 %6.2f ns/elem (%5.2fx) err %.1e", widest*1e9/n, scalar/widest, widest_err);
     }
-} 
+    printf("\n");
+    free(ref);
+}
+
+// Times every activation over n inputs spread across [-range, range] (the
+// copy in each iteration is included in all timings)
+void test_activations(int n, float range)
+{
+    int i;
+    float *input = calloc(n, sizeof(float));
+    float *x = calloc(n, sizeof(float));
+    ACTIVATION all[] = {LINEAR, LEAKY, RELU, LOGISTIC, TANH, LOGGY, ELU, RELIE, RAMP, PLSE, HARDTAN, LHTAN, STAIR};
+    for(i = 0; i < n; ++i) input[i] = rand_uniform(-range, range);
+    for(i = 0; i < sizeof(all)/sizeof(all[0]); ++i) time_activation(all[i], input, x, n, 20);
+    free(input);
+    free(x);
+}
 
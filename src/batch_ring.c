@@ -0,0 +1,218 @@
+#include "batch_ring.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+typedef enum{
+    RING_FREE,
+    RING_FILLING,
+    RING_READY,
+    RING_BUSY
+} RING_STATE;
+
+// A fixed set of batch-shaped input buffers. One producer writes images
+// straight into slot after slot of the buffer being filled; consumers take
+// whole buffers, hand them to the network as they are and give them back.
+// The producer may hand slots out ahead of the images it has finished, to
+// writers working in parallel, as long as it commits them in the same order.
+struct batch_ring{
+    int inputs;
+    int batch;
+    int max_batch;
+    int size;
+    float **buffers;
+    int *state;
+    int *count;
+    int *reserved;
+    int *next;
+    double *first_time;
+
+    // Buffers waiting for a consumer, oldest first
+    int *ready;
+    int ready_head;
+    int ready_count;
+
+    // Buffer taking the next commit, and the buffer handing out slots with
+    // the buffers in between linked through next
+    int filling;
+    int reserving;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+// size buffers of batch*inputs floats each; a buffer is handed out once
+// max_batch images have been written to it
+batch_ring *make_batch_ring(int inputs, int batch, int max_batch, int size)
+{
+    int i;
+    batch_ring *r = calloc(1, sizeof(batch_ring));
+    if(max_batch < 1 || max_batch > batch) max_batch = batch;
+    r->inputs = inputs;
+    r->batch = batch;
+    r->max_batch = max_batch;
+    r->size = size;
+    r->buffers = calloc(size, sizeof(float *));
+    r->state = calloc(size, sizeof(int));
+    r->count = calloc(size, sizeof(int));
+    r->reserved = calloc(size, sizeof(int));
+    r->next = calloc(size, sizeof(int));
+    r->first_time = calloc(size, sizeof(double));
+    r->ready = calloc(size, sizeof(int));
+    for(i = 0; i < size; ++i){
+        r->buffers[i] = calloc((size_t)inputs*batch, sizeof(float));
+        if(!r->buffers[i]) malloc_error();
+    }
+    r->filling = -1;
+    r->reserving = -1;
+    pthread_mutex_init(&r->lock, 0);
+    pthread_cond_init(&r->changed, 0);
+    return r;
+}
+
+void free_batch_ring(batch_ring *r)
+{
+    int i;
+    for(i = 0; i < r->size; ++i) free(r->buffers[i]);
+    free(r->buffers);
+    free(r->state);
+    free(r->count);
+    free(r->reserved);
+    free(r->next);
+    free(r->first_time);
+    free(r->ready);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->changed);
+    free(r);
+}
+
+float *batch_ring_buffer(batch_ring *r, int index)
+{
+    return r->buffers[index];
+}
+
+// Called with the lock held
+static void seal_filling(batch_ring *r)
+{
+    int index = r->filling;
+    r->state[index] = RING_READY;
+    r->ready[(r->ready_head + r->ready_count) % r->size] = index;
+    ++r->ready_count;
+    if(r->reserving == index) r->reserving = -1;
+    r->filling = r->next[index];
+    pthread_cond_broadcast(&r->changed);
+}
+
+// Producer: returns where the next image goes, slot *slot of buffer *index,
+// waiting for a free buffer if every one is in use. Every slot handed out
+// must be given back by batch_ring_commit, in the order they were handed
+// out, or the last one by batch_ring_cancel.
+float *batch_ring_next_slot(batch_ring *r, int *index, int *slot)
+{
+    int i;
+    pthread_mutex_lock(&r->lock);
+    while(r->reserving < 0){
+        for(i = 0; i < r->size; ++i){
+            if(r->state[i] == RING_FREE){
+                r->state[i] = RING_FILLING;
+                r->count[i] = 0;
+                r->reserved[i] = 0;
+                r->next[i] = -1;
+                if(r->filling < 0) r->filling = i;
+                else{
+                    int last = r->filling;
+                    while(r->next[last] >= 0) last = r->next[last];
+                    r->next[last] = i;
+                }
+                r->reserving = i;
+                break;
+            }
+        }
+        if(r->reserving < 0) pthread_cond_wait(&r->changed, &r->lock);
+    }
+    *index = r->reserving;
+    *slot = r->reserved[r->reserving]++;
+    if(r->reserved[*index] == r->max_batch) r->reserving = -1;
+    pthread_mutex_unlock(&r->lock);
+    return r->buffers[*index] + (size_t)*slot*r->inputs;
+}
+
+// The oldest slot handed out holds its image now
+void batch_ring_commit(batch_ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    int index = r->filling;
+    if(r->count[index]++ == 0) r->first_time[index] = what_time_is_it_now();
+    if(r->count[index] == r->max_batch) seal_filling(r);
+    else pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// The slot last returned by batch_ring_next_slot was not used after all
+void batch_ring_cancel(batch_ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    int index = r->filling;
+    while(r->next[index] >= 0) index = r->next[index];
+    --r->reserved[index];
+    r->reserving = index;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Producer: no more images. Consumers get what is left, then -1.
+void batch_ring_close(batch_ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->closed = 1;
+    if(r->filling >= 0 && r->count[r->filling] > 0) seal_filling(r);
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Consumer: waits for a full buffer, or takes the one being filled once its
+// first image has waited max_delay seconds (never if max_delay < 0). Returns
+// the number of images in buffer *index, whose remaining slots hold stale
+// data, or -1 once the ring is closed and drained.
+int batch_ring_take(batch_ring *r, double max_delay, int *index)
+{
+    int n = -1;
+    struct timespec ts;
+    pthread_mutex_lock(&r->lock);
+    while(1){
+        if(r->ready_count){
+            *index = r->ready[r->ready_head];
+            r->ready_head = (r->ready_head + 1) % r->size;
+            --r->ready_count;
+            r->state[*index] = RING_BUSY;
+            n = r->count[*index];
+            break;
+        }
+        if(max_delay >= 0 && r->filling >= 0 && r->count[r->filling] > 0){
+            double deadline = r->first_time[r->filling] + max_delay;
+            if(what_time_is_it_now() >= deadline){
+                // Let the producer finish the images it is writing first
+                if(r->reserved[r->filling] > r->count[r->filling]) pthread_cond_wait(&r->changed, &r->lock);
+                else seal_filling(r);
+                continue;
+            }
+            ts.tv_sec = (time_t) deadline;
+            ts.tv_nsec = (long) ((deadline - ts.tv_sec) * 1e9);
+            pthread_cond_timedwait(&r->changed, &r->lock, &ts);
+            continue;
+        }
+        if(r->closed) break;
+        pthread_cond_wait(&r->changed, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+void batch_ring_release(batch_ring *r, int index)
+{
+    pthread_mutex_lock(&r->lock);
+    r->state[index] = RING_FREE;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
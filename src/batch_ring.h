@@ -0,0 +1,16 @@
+#ifndef BATCH_RING_H
+#define BATCH_RING_H
+#include "darknet.h"
+
+typedef struct batch_ring batch_ring;
+batch_ring *make_batch_ring(int inputs, int batch, int max_batch, int size);
+void free_batch_ring(batch_ring *r);
+float *batch_ring_buffer(batch_ring *r, int index);
+float *batch_ring_next_slot(batch_ring *r, int *index, int *slot);
+void batch_ring_commit(batch_ring *r);
+void batch_ring_cancel(batch_ring *r);
+void batch_ring_close(batch_ring *r);
+int batch_ring_take(batch_ring *r, double max_delay, int *index);
+void batch_ring_release(batch_ring *r, int index);
+
+#endif
@@ -77,20 +77,43 @@ void shortcut_cpu(int batch, int w1, int h1, int c1, float *add, int w2, int h2,
     int minh = (h1 < h2) ? h1 : h2;
     int minc = (c1 < c2) ? c1 : c2;
 
-    int i,j,k,b;
-    for(b = 0; b < batch; ++b){
-        for(k = 0; k < minc; ++k){
-            for(j = 0; j < minh; ++j){
-                for(i = 0; i < minw; ++i){
-                    int out_index = i*sample + w2*(j*sample + h2*(k + c2*b));
-                    int add_index = i*stride + w1*(j*stride + h1*(k + c1*b));
-                    out[out_index] = s1*out[out_index] + s2*add[add_index];
-                }
+    int p;
+    #pragma omp parallel for
+    for(p = 0; p < batch*minc; ++p){
+        int b = p / minc;
+        int k = p % minc;
+        int i, j;
+        for(j = 0; j < minh; ++j){
+            for(i = 0; i < minw; ++i){
+                int out_index = i*sample + w2*(j*sample + h2*(k + c2*b));
+                int add_index = i*stride + w1*(j*stride + h1*(k + c1*b));
+                out[out_index] = s1*out[out_index] + s2*add[add_index];
             }
         }
     }
 }
 
+// out = s1*x + s2*add, what shortcut_cpu computes on a copy of x when both
+// inputs have the same shape, in a single pass
+void shortcut_same_cpu(int n, float *x, float *add, float s1, float s2, float *out)
+{
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < n; ++i) out[i] = s1*x[i] + s2*add[i];
+}
+
+// Large contiguous copies split across threads
+void copy_cpu_parallel(int N, float *X, float *Y)
+{
+    int block = 1 << 14;
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < N; i += block){
+        int n = N - i < block ? N - i : block;
+        memcpy(Y + i, X + i, n*sizeof(float));
+    }
+}
+
 void mean_cpu(float *x, int batch, int filters, int spatial, float *mean)
 {
     float scale = 1./(batch * spatial);
@@ -331,9 +354,41 @@ void softmax_cpu(float *input, int n, int batch, int batch_offset, int groups, i
     }
 }
 
+// Every input pixel becomes a stride x stride block of the output: the first
+// row of each block is written, the others are copies of it
+static void upsample_forward_cpu(float *in, int w, int h, int c, int batch, int stride, float scale, float *out)
+{
+    int p;
+    int out_w = w*stride;
+    #pragma omp parallel for
+    for(p = 0; p < batch*c; ++p){
+        int i, j, k;
+        float *src = in + (size_t)p*w*h;
+        float *dst = out + (size_t)p*w*h*stride*stride;
+        for(j = 0; j < h; ++j){
+            float *s = src + j*w;
+            float *row = dst + (size_t)j*stride*out_w;
+            if(stride == 2){
+                for(i = 0; i < w; ++i){
+                    float v = scale*s[i];
+                    row[2*i] = v;
+                    row[2*i+1] = v;
+                }
+            } else {
+                for(i = 0; i < out_w; ++i) row[i] = scale*s[i/stride];
+            }
+            for(k = 1; k < stride; ++k) memcpy(row + k*out_w, row, out_w*sizeof(float));
+        }
+    }
+}
+
 void upsample_cpu(float *in, int w, int h, int c, int batch, int stride, int forward, float scale, float *out)
 {
     int i, j, k, b;
+    if(forward){
+        upsample_forward_cpu(in, w, h, c, batch, stride, scale, out);
+        return;
+    }
     for(b = 0; b < batch; ++b){
         for(k = 0; k < c; ++k){
             for(j = 0; j < h*stride; ++j){
@@ -1,17 +1,18 @@
 #include "box.h"
+#include "utils.h"
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
 
 int nms_comparator(const void *pa, const void *pb)
 {
-    detection a = *(detection *)pa;
-    detection b = *(detection *)pb;
+    const detection *a = (const detection *)pa;
+    const detection *b = (const detection *)pb;
     float diff = 0;
-    if(b.sort_class >= 0){
-        diff = a.prob[b.sort_class] - b.prob[b.sort_class];
+    if(b->sort_class >= 0){
+        diff = a->prob[b->sort_class] - b->prob[b->sort_class];
     } else {
-        diff = a.objectness - b.objectness;
+        diff = a->objectness - b->objectness;
     }
     if(diff < 0) return 1;
     else if(diff > 0) return -1;
@@ -88,6 +89,56 @@ void do_nms_sort(detection *dets, int total, int classes, float thresh)
     }
 }
 
+detection_buffer *make_detection_buffer()
+{
+    return calloc(1, sizeof(detection_buffer));
+}
+
+void free_detection_buffer(detection_buffer *d)
+{
+    if(!d) return;
+    free(d->x);
+    free(d->y);
+    free(d->w);
+    free(d->h);
+    free(d->objectness);
+    free(d->prob);
+    free(d->cells);
+    free(d);
+}
+
+// Empties d for detections with the given number of classes
+void reset_detection_buffer(detection_buffer *d, int classes)
+{
+    d->n = 0;
+    if(d->classes != classes){
+        // prob is sized for the old class count, the next reserve regrows it
+        d->classes = classes;
+        d->capacity = 0;
+    }
+}
+
+// Makes room for n more boxes and for n cells of scratch
+void reserve_detection_buffer(detection_buffer *d, int n)
+{
+    if(n > d->cells_capacity){
+        d->cells_capacity = n;
+        d->cells = realloc(d->cells, n*sizeof(int));
+        if(!d->cells) malloc_error();
+    }
+    if(d->n + n <= d->capacity) return;
+    int capacity = d->capacity ? d->capacity : 256;
+    while(capacity < d->n + n) capacity *= 2;
+    d->x = realloc(d->x, capacity*sizeof(float));
+    d->y = realloc(d->y, capacity*sizeof(float));
+    d->w = realloc(d->w, capacity*sizeof(float));
+    d->h = realloc(d->h, capacity*sizeof(float));
+    d->objectness = realloc(d->objectness, capacity*sizeof(float));
+    d->prob = realloc(d->prob, (size_t)capacity*d->classes*sizeof(float));
+    if(!d->x || !d->y || !d->w || !d->h || !d->objectness || !d->prob) malloc_error();
+    d->capacity = capacity;
+}
+
 box float_to_box(float *f, int stride)
 {
     box b = {0};
@@ -10,5 +10,7 @@ float box_rmse(box a, box b);
 dbox diou(box a, box b);
 box decode_box(box b, box anchor);
 box encode_box(box b, box anchor);
+void reset_detection_buffer(detection_buffer *d, int classes);
+void reserve_detection_buffer(detection_buffer *d, int n);
 
 #endif
@@ -0,0 +1,185 @@
+#include "checkpoint.h"
+#include "parser.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Saves weights without holding up training: the network is serialized into
+// a staging buffer on the caller's thread, which is all a checkpoint costs
+// it, and a background thread writes the buffer to filename.tmp and renames
+// it over filename. A crash mid-write leaves the previous file intact.
+// Checkpoints of the same weights, e.g. the .backup and the numbered file of
+// one iteration, share the staged buffer and are written one after another
+// by the same thread.
+struct checkpointer{
+    int async;
+    int keep;
+    // Numbered checkpoints written so far, oldest first
+    char **kept;
+    int nkept;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int writing; // the thread is alive and takes more files
+    int started;
+    // Files of the staged weights, guarded by lock
+    char **names;
+    int *numbered;
+    int nnames;
+    int next;
+    int names_capacity;
+
+    // Kept from one checkpoint to the next
+    char *buffer;
+    size_t capacity;
+    size_t size;
+    size_t seen;
+    int staged;
+};
+
+checkpointer *make_checkpointer(int async, int keep)
+{
+    checkpointer *c = calloc(1, sizeof(checkpointer));
+    c->async = async;
+    c->keep = keep;
+    if(keep > 0) c->kept = calloc(keep + 1, sizeof(char *));
+    pthread_mutex_init(&c->lock, 0);
+    return c;
+}
+
+// Past keep numbered checkpoints the oldest goes
+static void keep_file(checkpointer *c, char *filename)
+{
+    int i;
+    c->kept[c->nkept++] = copy_string(filename);
+    if(c->nkept > c->keep){
+        fprintf(stderr, "Removing %s\n", c->kept[0]);
+        unlink(c->kept[0]);
+        free(c->kept[0]);
+        --c->nkept;
+        for(i = 0; i < c->nkept; ++i) c->kept[i] = c->kept[i+1];
+    }
+}
+
+static void write_file(checkpointer *c, char *filename, int numbered)
+{
+    char tmp[4096 + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp != 0;
+    if(fp){
+        ok = fwrite(c->buffer, 1, c->size, fp) == c->size;
+        ok = (fflush(fp) == 0) && ok;
+        ok = (fsync(fileno(fp)) == 0) && ok;
+        ok = (fclose(fp) == 0) && ok;
+    }
+    if(ok) ok = rename(tmp, filename) == 0;
+    if(ok){
+        if(numbered && c->keep > 0) keep_file(c, filename);
+    } else {
+        fprintf(stderr, "Couldn't write %s, keeping the previous weights\n", filename);
+        unlink(tmp);
+    }
+}
+
+// Writes the staged buffer to every queued file, including the ones queued
+// while it runs
+static void *write_checkpoints(void *ptr)
+{
+    checkpointer *c = (checkpointer *)ptr;
+    while(1){
+        pthread_mutex_lock(&c->lock);
+        if(c->next == c->nnames){
+            c->writing = 0;
+            pthread_mutex_unlock(&c->lock);
+            break;
+        }
+        char *name = c->names[c->next];
+        int numbered = c->numbered[c->next];
+        ++c->next;
+        pthread_mutex_unlock(&c->lock);
+        write_file(c, name, numbered);
+    }
+    return 0;
+}
+
+static void wait_for_write(checkpointer *c)
+{
+    if(!c->started) return;
+    pthread_join(c->thread, 0);
+    c->started = 0;
+}
+
+// Called with c->lock held or without a writer
+static void queue_file(checkpointer *c, char *filename, int numbered)
+{
+    if(c->nnames == c->names_capacity){
+        c->names_capacity = c->names_capacity ? 2*c->names_capacity : 4;
+        c->names = realloc(c->names, c->names_capacity*sizeof(char *));
+        c->numbered = realloc(c->numbered, c->names_capacity*sizeof(int));
+        if(!c->names || !c->numbered) malloc_error();
+    }
+    c->names[c->nnames] = copy_string(filename);
+    c->numbered[c->nnames] = numbered;
+    ++c->nnames;
+}
+
+static void clear_files(checkpointer *c)
+{
+    int i;
+    for(i = 0; i < c->nnames; ++i) free(c->names[i]);
+    c->nnames = c->next = 0;
+}
+
+// Saves the weights of net to filename like save_weights. Only numbered
+// checkpoints count towards keep; rolling files such as .backup, which are
+// overwritten in place, never do. Only waits for the file to be written when
+// the checkpointer isn't async, or when the previous weights are still being
+// written.
+void checkpoint_weights(checkpointer *c, network *net, char *filename, int numbered)
+{
+    fprintf(stderr, "Saving weights to %s\n", filename);
+    int same = c->staged && c->seen == *net->seen;
+
+    // Same weights as the write in flight: it takes this file as well
+    pthread_mutex_lock(&c->lock);
+    if(same && c->writing){
+        queue_file(c, filename, numbered);
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    wait_for_write(c);
+    clear_files(c);
+    if(!same){
+        c->size = weights_to_buffer(net, &c->buffer, &c->capacity);
+        c->seen = *net->seen;
+        c->staged = 1;
+    }
+    queue_file(c, filename, numbered);
+    c->writing = 1;
+    if(c->async && !pthread_create(&c->thread, 0, write_checkpoints, c)){
+        c->started = 1;
+    } else {
+        write_checkpoints(c);
+    }
+}
+
+// Waits for the last write
+void free_checkpointer(checkpointer *c)
+{
+    int i;
+    wait_for_write(c);
+    clear_files(c);
+    for(i = 0; i < c->nkept; ++i) free(c->kept[i]);
+    free(c->kept);
+    free(c->names);
+    free(c->numbered);
+    free(c->buffer);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
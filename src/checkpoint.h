@@ -0,0 +1,10 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include "darknet.h"
+
+typedef struct checkpointer checkpointer;
+checkpointer *make_checkpointer(int async, int keep);
+void checkpoint_weights(checkpointer *c, network *net, char *filename, int numbered);
+void free_checkpointer(checkpointer *c);
+
+#endif
@@ -2,10 +2,13 @@
 #include "utils.h"
 #include "batchnorm_layer.h"
 #include "im2col.h"
+#include "winograd.h"
 #include "col2im.h"
 #include "blas.h"
 #include "gemm.h"
+#include "quantize.h"
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #ifdef AI2
@@ -83,6 +86,13 @@ image get_convolutional_delta(convolutional_layer l)
     return float_to_image(l.out_w,l.out_h,l.out_c,l.delta);
 }
 
+// Below this many input channels the Winograd transforms cost more than the
+// multiplies they save
+#define WINOGRAD_MIN_CHANNELS 16
+// Grouped layers with more channels per group than this are still faster
+// through im2col and GEMM
+#define DIRECT_MAX_GROUP_CHANNELS 4
+
 static size_t get_workspace_size(layer l){
 #ifdef CUDNN
     if(gpu_index >= 0){
@@ -115,7 +125,12 @@ static size_t get_workspace_size(layer l){
         return most;
     }
 #endif
-    return (size_t)l.out_h*l.out_w*l.size*l.size*l.c/l.groups*sizeof(float);
+    size_t size = (size_t)l.out_h*l.out_w*l.size*l.size*l.c/l.groups*sizeof(float);
+    if(l.algorithm == CONV_WINOGRAD){
+        size_t winograd_size = winograd_workspace_size(l.c, l.n, l.out_h, l.out_w);
+        if(winograd_size > size) size = winograd_size;
+    }
+    return size;
 }
 
 #ifdef GPU
@@ -442,11 +457,173 @@ void backward_bias(float *bias_updates, float *delta, int batch, int n, int size
     }
 }
 
+// Direct convolution for grouped and depthwise layers, where im2col would
+// blow up the input for a tiny per-group GEMM.
+static void forward_convolutional_direct(convolutional_layer l, network net)
+{
+    int cg = l.c/l.groups;
+    int ng = l.n/l.groups;
+    int out = l.out_h*l.out_w;
+    int i, f;
+    for(i = 0; i < l.batch; ++i){
+        #pragma omp parallel for
+        for(f = 0; f < l.n; ++f){
+            float *o = l.output + (i*l.n + f)*out;
+            float *w = l.weights + f*cg*l.size*l.size;
+            int ch, ky, kx, y, x;
+            for(ch = 0; ch < cg; ++ch){
+                float *im = net.input + (i*l.c + f/ng*cg + ch)*l.h*l.w;
+                for(ky = 0; ky < l.size; ++ky){
+                    for(kx = 0; kx < l.size; ++kx){
+                        float wv = w[(ch*l.size + ky)*l.size + kx];
+                        int x_start = (l.pad - kx > 0) ? (l.pad - kx + l.stride - 1)/l.stride : 0;
+                        int x_end = (l.w - 1 + l.pad - kx < 0) ? 0 : (l.w - 1 + l.pad - kx)/l.stride + 1;
+                        if(x_end > l.out_w) x_end = l.out_w;
+                        for(y = 0; y < l.out_h; ++y){
+                            int iy = y*l.stride + ky - l.pad;
+                            if(iy < 0 || iy >= l.h) continue;
+                            float *row = im + iy*l.w + kx - l.pad;
+                            float *orow = o + y*l.out_w;
+                            for(x = x_start; x < x_end; ++x){
+                                orow[x] += wv*row[x*l.stride];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Folds the inference-time batchnorm into the weights and biases, using the
+// same epsilon as normalize_cpu. The batchnorm parameters are left as the
+// identity so the layer still saves as a valid batch_normalize=1 layer.
+void fold_convolutional_batchnorm(convolutional_layer *l)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return;
+#endif
+    if(!l->batch_normalize || l->batchnorm_folded || l->binary || l->xnor) return;
+    int size = l->nweights/l->n;
+    int i, j;
+    for(i = 0; i < l->n; ++i){
+        float scale = l->scales[i]/(sqrt(l->rolling_variance[i]) + .000001f);
+        for(j = 0; j < size; ++j){
+            l->weights[i*size + j] *= scale;
+        }
+        l->biases[i] -= l->rolling_mean[i]*scale;
+        l->scales[i] = 1;
+        l->rolling_mean[i] = 0;
+        l->rolling_variance[i] = 1;
+    }
+    l->batchnorm_folded = 1;
+}
+
+void set_convolutional_algorithm(convolutional_layer *l, char *s)
+{
+    int winograd = l->size == 3 && l->stride == 1 && l->groups == 1 && !l->binary && !l->xnor;
+    if(strcmp(s, "gemm")==0){
+        l->algorithm = CONV_GEMM;
+    } else if(strcmp(s, "winograd")==0){
+        if(!winograd) fprintf(stderr, "Winograd needs an ungrouped 3x3 stride 1 convolution, going with gemm\n");
+        l->algorithm = winograd ? CONV_WINOGRAD : CONV_GEMM;
+    } else if(strcmp(s, "direct")==0){
+        l->algorithm = CONV_DIRECT;
+    } else {
+        if(strcmp(s, "auto")!=0) fprintf(stderr, "Couldn't find convolution algorithm %s, going with auto\n", s);
+        if(winograd && l->c >= WINOGRAD_MIN_CHANNELS) l->algorithm = CONV_WINOGRAD;
+        else if(l->groups > 1 && l->c/l->groups <= DIRECT_MAX_GROUP_CHANNELS) l->algorithm = CONV_DIRECT;
+        else l->algorithm = CONV_GEMM;
+    }
+    l->workspace_size = get_workspace_size(*l);
+}
+
+void pack_convolutional_weights(convolutional_layer *l)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return;
+#endif
+    if(l->binary || l->xnor || l->qweights || l->algorithm == CONV_DIRECT) return;
+    if(l->algorithm == CONV_WINOGRAD){
+        if(!l->packed_weights) l->packed_weights = calloc(winograd_packed_size(l->c, l->n), sizeof(float));
+        winograd_pack_weights(l->weights, l->c, l->n, l->packed_weights);
+        return;
+    }
+    int m = l->n/l->groups;
+    int k = l->size*l->size*l->c/l->groups;
+    size_t size = gemm_packed_size(m, k);
+    int j;
+    if(!l->packed_weights) l->packed_weights = calloc(size*l->groups, sizeof(float));
+    for(j = 0; j < l->groups; ++j){
+        gemm_pack_matrix(0, m, k, 1, l->weights + j*l->nweights/l->groups, k, l->packed_weights + j*size);
+    }
+}
+
+static size_t align_int8(size_t n)
+{
+    return (n + 63)/64*64;
+}
+
+// Quantized input, its int8 im2col and the packed GEMM operand all
+// live in net.workspace, so a layer can only run in int8 if they fit.
+static size_t get_int8_workspace_size(layer l)
+{
+    size_t k = l.size*l.size*l.c;
+    size_t n = l.out_h*l.out_w;
+    size_t size = align_int8(l.inputs) + gemm_int8_packed_b_size(k, n);
+    if(l.size != 1 || l.stride != 1) size += align_int8(k*n);
+    return size;
+}
+
+int convolutional_layer_quantizable(convolutional_layer l)
+{
+    return l.groups == 1 && !l.binary && !l.xnor && get_int8_workspace_size(l) <= l.workspace_size;
+}
+
+void pack_convolutional_int8_weights(convolutional_layer *l, int8_t *q)
+{
+#ifdef GPU
+    if(gpu_index >= 0) return;
+#endif
+    int k = l->size*l->size*l->c;
+    if(!l->qweights) l->qweights = calloc(gemm_int8_packed_a_size(l->n, k), 1);
+    gemm_int8_pack_a(l->n, k, q, l->qweights);
+}
+
+static void forward_convolutional_layer_int8(convolutional_layer l, network net)
+{
+    int m = l.n;
+    int k = l.size*l.size*l.c;
+    int n = l.out_h*l.out_w;
+    int8_t *q = (int8_t *)net.workspace;
+    int8_t *col = q;
+    void *packed = q + align_int8(l.inputs);
+    if(l.size != 1 || l.stride != 1){
+        col = q + align_int8(l.inputs);
+        packed = col + align_int8((size_t)k*n);
+    }
+    int i;
+    for(i = 0; i < l.batch; ++i){
+        quantize_array(net.input + i*l.inputs, l.inputs, l.input_scale, q);
+        if(col != q) im2col_cpu_int8(q, l.c, l.h, l.w, l.size, l.stride, l.pad, col);
+        gemm_int8_pack_b(k, n, col, packed);
+        gemm_int8(m, n, k, l.qweights, packed, l.output + i*l.outputs, n,
+                l.weight_scales, l.input_scale, l.biases, l.activation);
+    }
+}
+
 void forward_convolutional_layer(convolutional_layer l, network net)
 {
     int i, j;
+    if(l.qweights && !net.train){
+        forward_convolutional_layer_int8(l, net);
+        return;
+    }
+    // Batchnorm is folded into the packed weights of inference networks, so
+    // bias and activation go in the GEMM epilogue and l.output is written once
+    int fused = l.packed_weights && !net.train && (!l.batch_normalize || l.batchnorm_folded);
 
-    fill_cpu(l.outputs*l.batch, 0, l.output, 1);
+    if(!fused) fill_cpu(l.outputs*l.batch, 0, l.output, 1);
 
     if(l.xnor){
         binarize_weights(l.weights, l.n, l.c/l.groups*l.size*l.size, l.binary_weights);
@@ -458,7 +635,15 @@ void forward_convolutional_layer(convolutional_layer l, network net)
     int m = l.n/l.groups;
     int k = l.size*l.size*l.c/l.groups;
     int n = l.out_w*l.out_h;
-    for(i = 0; i < l.batch; ++i){
+    if(l.algorithm == CONV_WINOGRAD && l.packed_weights && !net.train){
+        for(i = 0; i < l.batch; ++i){
+            winograd_convolution(net.input + i*l.inputs, l.c, l.h, l.w, l.pad,
+                    l.packed_weights, l.n, net.workspace, l.workspace_size, l.output + i*l.outputs,
+                    fused ? l.biases : 0, l.activation);
+        }
+    } else if(l.algorithm == CONV_DIRECT){
+        forward_convolutional_direct(l, net);
+    } else for(i = 0; i < l.batch; ++i){
         for(j = 0; j < l.groups; ++j){
             float *a = l.weights + j*l.nweights/l.groups;
             float *b = net.workspace;
@@ -470,17 +655,24 @@ void forward_convolutional_layer(convolutional_layer l, network net)
             } else {
                 im2col_cpu(im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, b);
             }
-            gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
+            if(fused){
+                gemm_cpu_prepacked_bias(0,m,n,k,l.packed_weights + j*gemm_packed_size(m, k),b,n,c,n,l.biases + j*m,l.activation);
+            } else if(l.packed_weights && !net.train){
+                gemm_cpu_prepacked(0,m,n,k,l.packed_weights + j*gemm_packed_size(m, k),b,n,1,c,n);
+            } else {
+                gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
+            }
         }
     }
 
-    if(l.batch_normalize){
-        forward_batchnorm_layer(l, net);
-    } else {
-        add_bias(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w);
+    if(!fused){
+        if(l.batch_normalize){
+            forward_batchnorm_layer(l, net);
+        } else {
+            add_bias(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w);
+        }
+        activate_array(l.output, l.outputs*l.batch, l.activation);
     }
-
-    activate_array(l.output, l.outputs*l.batch, l.activation);
     if(l.binary || l.xnor) swap_binary(&l);
 }
 
@@ -32,6 +32,11 @@ void update_convolutional_layer(convolutional_layer layer, update_args a);
 image *visualize_convolutional_layer(convolutional_layer layer, char *window, image *prev_weights);
 void binarize_weights(float *weights, int n, int size, float *binary);
 void swap_binary(convolutional_layer *l);
+void pack_convolutional_weights(convolutional_layer *l);
+void fold_convolutional_batchnorm(convolutional_layer *l);
+int convolutional_layer_quantizable(convolutional_layer l);
+void pack_convolutional_int8_weights(convolutional_layer *l, int8_t *q);
+void set_convolutional_algorithm(convolutional_layer *l, char *s);
 void binarize_weights2(float *weights, int n, int size, char *binary, float *scales);
 
 void backward_convolutional_layer(convolutional_layer layer, network net);
@@ -1,4 +1,5 @@
 #include "data.h"
+#include "shard.h"
 #include "utils.h"
 #include "image.h"
 #include "cuda.h"
@@ -102,6 +103,58 @@ matrix load_image_paths(char **paths, int n, int w, int h)
     return X;
 }
 
+// Float planes of a packed image, in a buffer every loader thread keeps and
+// only grows
+static __thread float *unpacked_pixels = 0;
+static __thread size_t unpacked_size = 0;
+
+static image unpack_bytes(unsigned char *bytes, int w, int h, int c)
+{
+    int i, k;
+    size_t n = (size_t)w*h*c;
+    if(n > unpacked_size){
+        free(unpacked_pixels);
+        unpacked_pixels = calloc(n, sizeof(float));
+        if(!unpacked_pixels) malloc_error();
+        unpacked_size = n;
+    }
+    image im = float_to_image(w, h, c, unpacked_pixels);
+    for(k = 0; k < c; ++k){
+        float *plane = im.data + (size_t)k*w*h;
+        unsigned char *src = bytes + k;
+        for(i = 0; i < w*h; ++i) plane[i] = src[i*c]/255.f;
+    }
+    return im;
+}
+
+// One training crop of im in crop (size x size), randomly scaled, rotated,
+// flipped and distorted unless center is set. With bytes set im only gives
+// the size, and the pixels are read from bytes (interleaved) instead.
+static void augment_image(image im, unsigned char *bytes, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center, image crop)
+{
+    if(center){
+        if(bytes) im = unpack_bytes(bytes, im.w, im.h, im.c);
+        image c = center_crop_image(im, size, size);
+        if(rand()%2) flip_image(c);
+        copy_image_into(c, crop);
+        free_image(c);
+    } else {
+        augment_args a = random_augment_args(im, angle, aspect, min, max, size, size);
+        if(bytes) augment_bytes_into(bytes, im.w, im.h, im.c, a, rand()%2, crop);
+        else augment_image_into(im, a, rand()%2, crop);
+    }
+    random_distort_image(crop, hue, saturation, exposure);
+}
+
+image load_augmented_image(char *path, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center)
+{
+    image im = load_image_color(path, 0, 0);
+    image crop = make_image(size, size, im.c);
+    augment_image(im, 0, min, max, size, angle, aspect, hue, saturation, exposure, center, crop);
+    free_image(im);
+    return crop;
+}
+
 matrix load_image_augment_paths(char **paths, int n, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center)
 {
     int i;
@@ -111,23 +164,7 @@ matrix load_image_augment_paths(char **paths, int n, int min, int max, int size,
     X.cols = 0;
 
     for(i = 0; i < n; ++i){
-        image im = load_image_color(paths[i], 0, 0);
-        image crop;
-        if(center){
-            crop = center_crop_image(im, size, size);
-        } else {
-            crop = random_augment_image(im, angle, aspect, min, max, size, size);
-        }
-        int flip = rand()%2;
-        if (flip) flip_image(crop);
-        random_distort_image(crop, hue, saturation, exposure);
-
-        /*
-        show_image(im, "orig");
-        show_image(crop, "crop");
-        cvWaitKey(0);
-        */
-        free_image(im);
+        image crop = load_augmented_image(paths[i], min, max, size, angle, aspect, hue, saturation, exposure, center);
         X.vals[i] = crop.data;
         X.cols = crop.h*crop.w*crop.c;
     }
@@ -405,9 +442,9 @@ void fill_truth_iseg(char *path, int num_boxes, float *truth, int classes, int w
 }
 
 
-void fill_truth_detection(char *path, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy)
+// Where the box labels of the image at path live
+void detection_label_path(char *path, char *labelpath)
 {
-    char labelpath[4096];
     find_replace(path, "images", "labels", labelpath);
     find_replace(labelpath, "JPEGImages", "labels", labelpath);
 
@@ -416,8 +453,12 @@ void fill_truth_detection(char *path, int num_boxes, float *truth, int classes,
     find_replace(labelpath, ".png", ".txt", labelpath);
     find_replace(labelpath, ".JPG", ".txt", labelpath);
     find_replace(labelpath, ".JPEG", ".txt", labelpath);
-    int count = 0;
-    box_label *boxes = read_boxes(labelpath, &count);
+}
+
+// Shuffles boxes, moves them along with the image and writes at most
+// num_boxes of them to truth
+void fill_truth_boxes(box_label *boxes, int count, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy)
+{
     randomize_boxes(boxes, count);
     correct_boxes(boxes, count, dx, dy, sx, sy, flip);
     if(count > num_boxes) count = num_boxes;
@@ -444,6 +485,15 @@ void fill_truth_detection(char *path, int num_boxes, float *truth, int classes,
         truth[(i-sub)*5+3] = h;
         truth[(i-sub)*5+4] = id;
     }
+}
+
+void fill_truth_detection(char *path, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy)
+{
+    char labelpath[4096];
+    detection_label_path(path, labelpath);
+    int count = 0;
+    box_label *boxes = read_boxes(labelpath, &count);
+    fill_truth_boxes(boxes, count, num_boxes, truth, classes, flip, dx, dy, sx, sy);
     free(boxes);
 }
 
@@ -954,54 +1004,146 @@ data load_data_swag(char **paths, int n, int classes, float jitter)
     return d;
 }
 
-data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure)
+// Places orig at a random scale, aspect and offset in sized, which is
+// filled with .5 elsewhere, maybe flips and distorts it, and writes its
+// boxes, moved along, to truth (num_boxes*5 floats). With bytes set orig
+// only gives the size, as in augment_image.
+static void augment_detection(image orig, unsigned char *bytes, box_label *labels, int count, int boxes, int classes, float jitter, float hue, float saturation, float exposure, image sized, float *truth)
 {
-    char **random_paths = get_random_paths(paths, n, m);
-    int i;
-    data d = {0};
-    d.shallow = 0;
+    int w = sized.w;
+    int h = sized.h;
 
-    d.X.rows = n;
-    d.X.vals = calloc(d.X.rows, sizeof(float*));
-    d.X.cols = h*w*3;
+    float dw = jitter * orig.w;
+    float dh = jitter * orig.h;
 
-    d.y = make_matrix(n, 5*boxes);
-    for(i = 0; i < n; ++i){
-        image orig = load_image_color(random_paths[i], 0, 0);
-        image sized = make_image(w, h, orig.c);
-        fill_image(sized, .5);
+    float new_ar = (orig.w + rand_uniform(-dw, dw)) / (orig.h + rand_uniform(-dh, dh));
+    float scale = rand_uniform(.25, 2);
+
+    float nw, nh;
 
-        float dw = jitter * orig.w;
-        float dh = jitter * orig.h;
+    if(new_ar < 1){
+        nh = scale * h;
+        nw = nh * new_ar;
+    } else {
+        nw = scale * w;
+        nh = nw / new_ar;
+    }
 
-        float new_ar = (orig.w + rand_uniform(-dw, dw)) / (orig.h + rand_uniform(-dh, dh));
-        float scale = rand_uniform(.25, 2);
+    float dx = rand_uniform(0, w - nw);
+    float dy = rand_uniform(0, h - nh);
 
-        float nw, nh;
+    int flip = rand()%2;
+    if(bytes) place_bytes_flip(bytes, orig.w, orig.h, orig.c, nw, nh, dx, dy, flip, .5, sized);
+    else place_image_flip(orig, nw, nh, dx, dy, flip, .5, sized);
+    random_distort_image(sized, hue, saturation, exposure);
 
-        if(new_ar < 1){
-            nh = scale * h;
-            nw = nh * new_ar;
-        } else {
-            nw = scale * w;
-            nh = nw / new_ar;
-        }
+    memset(truth, 0, 5*boxes*sizeof(float));
+    fill_truth_boxes(labels, count, boxes, truth, classes, flip, -dx/w, -dy/h, nw/w, nh/h);
+}
 
-        float dx = rand_uniform(0, w - nw);
-        float dy = rand_uniform(0, h - nh);
+void load_detection_image(char *path, int boxes, int classes, float jitter, float hue, float saturation, float exposure, image sized, float *truth)
+{
+    char labelpath[4096];
+    image orig = load_image_color(path, 0, 0);
+    detection_label_path(path, labelpath);
+    int count = 0;
+    box_label *labels = read_boxes(labelpath, &count);
+    augment_detection(orig, 0, labels, count, boxes, classes, jitter, hue, saturation, exposure, sized, truth);
+    free(labels);
+    free_image(orig);
+}
 
-        place_image(orig, nw, nh, dx, dy, sized);
+// The boxes of a packed image in the form read_boxes returns them
+static box_label *shard_labels(shard_record r)
+{
+    int i;
+    box_label *labels = calloc(r.nboxes + 1, sizeof(box_label));
+    for(i = 0; i < r.nboxes; ++i){
+        shard_box b = r.boxes[i];
+        labels[i].id = b.id;
+        labels[i].x = b.x;
+        labels[i].y = b.y;
+        labels[i].w = b.w;
+        labels[i].h = b.h;
+        labels[i].left   = b.x - b.w/2;
+        labels[i].right  = b.x + b.w/2;
+        labels[i].top    = b.y - b.h/2;
+        labels[i].bottom = b.y + b.h/2;
+    }
+    return labels;
+}
 
-        random_distort_image(sized, hue, saturation, exposure);
+// Loads image index of a training set (a.paths, or a.shards when set) into
+// X and its truth into y, for DETECTION_DATA and CLASSIFICATION_DATA. Packed
+// images are resampled straight from the mapped shard.
+void load_training_row(load_args a, int index, float *X, float *y)
+{
+    char *path = a.shards ? 0 : a.paths[index];
+    image im = {0};
+    unsigned char *bytes = 0;
+    box_label *labels = 0;
+    int count = 0;
+    if(a.shards){
+        shard_record r = get_shard_record(a.shards, index);
+        im = make_empty_image(r.w, r.h, r.c);
+        bytes = r.pixels;
+        labels = shard_labels(r);
+        count = r.nboxes;
+        path = r.path;
+    }
+    if(a.type == DETECTION_DATA){
+        image sized = float_to_image(a.w, a.h, 3, X);
+        if(a.shards) augment_detection(im, bytes, labels, count, a.num_boxes, a.classes, a.jitter, a.hue, a.saturation, a.exposure, sized, y);
+        else load_detection_image(path, a.num_boxes, a.classes, a.jitter, a.hue, a.saturation, a.exposure, sized, y);
+    } else {
+        if(!a.shards) im = load_image_color(path, 0, 0);
+        image crop = float_to_image(a.size, a.size, 3, X);
+        augment_image(im, bytes, a.min, a.max, a.size, a.angle, a.aspect, a.hue, a.saturation, a.exposure, a.center, crop);
+        memset(y, 0, a.classes*sizeof(float));
+        if(a.labels){
+            fill_truth(path, a.labels, a.classes, y);
+            if(a.hierarchy) fill_hierarchy(y, a.classes, a.hierarchy);
+        }
+    }
+    free(labels);
+    free_image(im);
+}
 
-        int flip = rand()%2;
-        if(flip) flip_image(sized);
-        d.X.vals[i] = sized.data;
+// A DETECTION_DATA or CLASSIFICATION_DATA batch of random images from
+// a.shards
+data load_data_shards(load_args a)
+{
+    int i;
+    data d = {0};
+    int n = dataset_shards_count(a.shards);
+    if(a.type == DETECTION_DATA){
+        d.X = make_matrix(a.n, a.w*a.h*3);
+        d.y = make_matrix(a.n, 5*a.num_boxes);
+    } else {
+        d.X = make_matrix(a.n, a.size*a.size*3);
+        d.y = make_matrix(a.n, a.classes);
+        d.w = d.h = a.size;
+    }
+    for(i = 0; i < a.n; ++i) load_training_row(a, rand()%n, d.X.vals[i], d.y.vals[i]);
+    return d;
+}
 
+data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure)
+{
+    char **random_paths = get_random_paths(paths, n, m);
+    int i;
+    data d = {0};
+    d.shallow = 0;
 
-        fill_truth_detection(random_paths[i], boxes, d.y.vals[i], classes, flip, -dx/w, -dy/h, nw/w, nh/h);
+    d.X.rows = n;
+    d.X.vals = calloc(d.X.rows, sizeof(float*));
+    d.X.cols = h*w*3;
 
-        free_image(orig);
+    d.y = make_matrix(n, 5*boxes);
+    for(i = 0; i < n; ++i){
+        image sized = make_image(w, h, 3);
+        load_detection_image(random_paths[i], boxes, classes, jitter, hue, saturation, exposure, sized, d.y.vals[i]);
+        d.X.vals[i] = sized.data;
     }
     free(random_paths);
     return d;
@@ -1015,7 +1157,9 @@ void *load_thread(void *ptr)
     if(a.saturation == 0) a.saturation = 1;
     if(a.aspect == 0) a.aspect = 1;
 
-    if (a.type == OLD_CLASSIFICATION_DATA){
+    if (a.shards && (a.type == DETECTION_DATA || a.type == CLASSIFICATION_DATA)){
+        *a.d = load_data_shards(a);
+    } else if (a.type == OLD_CLASSIFICATION_DATA){
         *a.d = load_data_old(a.paths, a.n, a.m, a.labels, a.classes, a.w, a.h);
     } else if (a.type == REGRESSION_DATA){
         *a.d = load_data_regression(a.paths, a.n, a.m, a.classes, a.min, a.max, a.size, a.angle, a.aspect, a.hue, a.saturation, a.exposure);
@@ -26,6 +26,12 @@ data load_data_captcha(char **paths, int n, int m, int k, int w, int h);
 data load_data_captcha_encode(char **paths, int n, int m, int w, int h);
 data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure);
 data load_data_tag(char **paths, int n, int m, int k, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure);
+image load_augmented_image(char *path, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center);
+void detection_label_path(char *path, char *labelpath);
+void fill_truth_boxes(box_label *boxes, int count, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy);
+void load_training_row(load_args a, int index, float *X, float *y);
+data load_data_shards(load_args a);
+void load_detection_image(char *path, int boxes, int classes, float jitter, float hue, float saturation, float exposure, image sized, float *truth);
 matrix load_image_augment_paths(char **paths, int n, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center);
 data load_data_super(char **paths, int n, int m, int w, int h, int scale);
 data load_data_augment(char **paths, int n, int m, char **labels, int k, tree *hierarchy, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center);
@@ -46,5 +52,6 @@ void randomize_data(data d);
 data *split_data(data d, int part, int total);
 data concat_datas(data *d, int n);
 void fill_truth(char *path, char **labels, int k, float *truth);
+void fill_hierarchy(float *truth, int k, tree *hierarchy);
 
 #endif
@@ -0,0 +1,224 @@
+#include "data_loader.h"
+#include "data.h"
+#include "shard.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+// One batch: the rows of X and y point into X_data and y_data, which are
+// only reallocated when the batch shape grows
+typedef struct{
+    load_args args;
+    data d;
+    float *X_data;
+    float *y_data;
+    size_t X_size;
+    size_t y_size;
+    int *indexes;
+    int remaining;
+} loader_batch;
+
+// Worker threads that stay up for the whole training run and load one image
+// per job straight into its row of a batch. While the trainer reads one of
+// the two batches the workers fill the other.
+struct data_loader{
+    int threads;
+    pthread_t *workers;
+    loader_batch batches[2];
+    int loading;
+    int next_job;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t jobs;
+    pthread_cond_t done;
+
+    // Other data types load whole batches with load_data
+    int whole_batches;
+    load_args args;
+    pthread_t thread;
+    data buffer;
+    data current;
+};
+
+static int loads_per_image(data_type type)
+{
+    return type == DETECTION_DATA || type == CLASSIFICATION_DATA;
+}
+
+static void *loader_worker(void *ptr)
+{
+    data_loader *l = (data_loader *)ptr;
+    pthread_mutex_lock(&l->lock);
+    while(1){
+        while(!l->stop && (l->loading < 0 || l->next_job == l->batches[l->loading].d.X.rows)){
+            pthread_cond_wait(&l->jobs, &l->lock);
+        }
+        if(l->stop) break;
+        loader_batch *b = l->batches + l->loading;
+        int row = l->next_job++;
+        pthread_mutex_unlock(&l->lock);
+
+        load_training_row(b->args, b->indexes[row], b->d.X.vals[row], b->d.y.vals[row]);
+
+        pthread_mutex_lock(&l->lock);
+        if(--b->remaining == 0) pthread_cond_broadcast(&l->done);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return 0;
+}
+
+static void resize_rows(matrix *m, float **block, size_t *size, int rows, int cols)
+{
+    int i;
+    size_t needed = (size_t)rows*cols;
+    if(needed > *size){
+        free(*block);
+        *block = calloc(needed, sizeof(float));
+        if(!*block) malloc_error();
+        *size = needed;
+    }
+    if(rows != m->rows){
+        m->vals = realloc(m->vals, rows*sizeof(float *));
+        if(!m->vals) malloc_error();
+    }
+    m->rows = rows;
+    m->cols = cols;
+    for(i = 0; i < rows; ++i) m->vals[i] = *block + (size_t)i*cols;
+}
+
+// Called with the lock held
+static void start_batch(data_loader *l, int index, load_args args)
+{
+    int i;
+    loader_batch *b = l->batches + index;
+    if(args.exposure == 0) args.exposure = 1;
+    if(args.saturation == 0) args.saturation = 1;
+    if(args.aspect == 0) args.aspect = 1;
+    b->args = args;
+
+    int cols, ycols;
+    if(args.type == DETECTION_DATA){
+        cols = args.w*args.h*3;
+        ycols = 5*args.num_boxes;
+        b->d.w = args.w;
+        b->d.h = args.h;
+    } else {
+        cols = args.size*args.size*3;
+        ycols = args.classes;
+        b->d.w = args.size;
+        b->d.h = args.size;
+    }
+    if(args.n != b->d.X.rows) b->indexes = realloc(b->indexes, args.n*sizeof(int));
+    resize_rows(&b->d.X, &b->X_data, &b->X_size, args.n, cols);
+    resize_rows(&b->d.y, &b->y_data, &b->y_size, args.n, ycols);
+    b->d.shallow = 1;
+    int m = args.shards ? dataset_shards_count(args.shards) : args.m;
+    for(i = 0; i < args.n; ++i) b->indexes[i] = m ? rand()%m : i;
+
+    b->remaining = args.n;
+    l->loading = index;
+    l->next_job = 0;
+    pthread_cond_broadcast(&l->jobs);
+}
+
+// Called with the lock held
+static void wait_for_batch(data_loader *l)
+{
+    while(l->batches[l->loading].remaining) pthread_cond_wait(&l->done, &l->lock);
+}
+
+// Starts loading the batches that args describes (paths and m or shards,
+// n, type and the augmentation settings; d is ignored) in the background
+data_loader *make_data_loader(load_args args)
+{
+    int i;
+    data_loader *l = calloc(1, sizeof(data_loader));
+    if(!loads_per_image(args.type)){
+        l->whole_batches = 1;
+        l->args = args;
+        l->args.d = &l->buffer;
+        l->thread = load_data(l->args);
+        return l;
+    }
+    l->threads = args.threads > 0 ? args.threads : 1;
+    l->loading = -1;
+    pthread_mutex_init(&l->lock, 0);
+    pthread_cond_init(&l->jobs, 0);
+    pthread_cond_init(&l->done, 0);
+    l->workers = calloc(l->threads, sizeof(pthread_t));
+    for(i = 0; i < l->threads; ++i){
+        if(pthread_create(l->workers + i, 0, loader_worker, l)) error("Thread creation failed");
+    }
+    pthread_mutex_lock(&l->lock);
+    start_batch(l, 0, args);
+    pthread_mutex_unlock(&l->lock);
+    return l;
+}
+
+// Waits for the batch being loaded, starts on the next one and returns it.
+// The batch belongs to the loader and stays valid until the next call.
+data data_loader_next(data_loader *l)
+{
+    if(l->whole_batches){
+        pthread_join(l->thread, 0);
+        free_data(l->current);
+        l->current = l->buffer;
+        l->thread = load_data(l->args);
+        return l->current;
+    }
+    pthread_mutex_lock(&l->lock);
+    wait_for_batch(l);
+    int ready = l->loading;
+    start_batch(l, !ready, l->batches[ready].args);
+    pthread_mutex_unlock(&l->lock);
+    return l->batches[ready].d;
+}
+
+// Batches from the next call on are loaded with args, e.g. at a new size.
+// The one in flight is dropped.
+void data_loader_reset(data_loader *l, load_args args)
+{
+    if(l->whole_batches){
+        pthread_join(l->thread, 0);
+        free_data(l->buffer);
+        l->args = args;
+        l->args.d = &l->buffer;
+        l->thread = load_data(l->args);
+        return;
+    }
+    pthread_mutex_lock(&l->lock);
+    wait_for_batch(l);
+    start_batch(l, l->loading, args);
+    pthread_mutex_unlock(&l->lock);
+}
+
+void free_data_loader(data_loader *l)
+{
+    int i;
+    if(l->whole_batches){
+        pthread_join(l->thread, 0);
+        free_data(l->buffer);
+        free_data(l->current);
+        free(l);
+        return;
+    }
+    pthread_mutex_lock(&l->lock);
+    wait_for_batch(l);
+    l->stop = 1;
+    pthread_cond_broadcast(&l->jobs);
+    pthread_mutex_unlock(&l->lock);
+    for(i = 0; i < l->threads; ++i) pthread_join(l->workers[i], 0);
+    for(i = 0; i < 2; ++i){
+        loader_batch *b = l->batches + i;
+        free(b->d.X.vals);
+        free(b->d.y.vals);
+        free(b->X_data);
+        free(b->y_data);
+        free(b->indexes);
+    }
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->jobs);
+    pthread_cond_destroy(&l->done);
+    free(l->workers);
+    free(l);
+}
@@ -0,0 +1,11 @@
+#ifndef DATA_LOADER_H
+#define DATA_LOADER_H
+#include "darknet.h"
+
+typedef struct data_loader data_loader;
+data_loader *make_data_loader(load_args args);
+data data_loader_next(data_loader *l);
+void data_loader_reset(data_loader *l, load_args args);
+void free_data_loader(data_loader *l);
+
+#endif
@@ -0,0 +1,188 @@
+#include "decode_pool.h"
+#include "image.h"
+#include "utils.h"
+#include "stb_image.h"
+
+#include <stdlib.h>
+
+typedef struct{
+    int ready;
+    size_t bytes;
+    image im;
+    image sized;
+} decoded_image;
+
+// Worker threads decode paths in any order into a reorder window, the
+// consumer takes them back out strictly in path order. Images being decoded
+// or waiting for the consumer may hold at most max_bytes between them.
+struct decode_pool{
+    char **paths;
+    int n;
+    int w;
+    int h;
+    int c;
+
+    int threads;
+    pthread_t *workers;
+
+    // Where letterboxed images go instead of a buffer of their own, asked
+    // for in path order
+    float *(*dest)(void *ctx, int index);
+    void *dest_ctx;
+    int next_dest;
+
+    int window;
+    decoded_image *slots;
+    int next_claim;
+    int next_out;
+
+    size_t max_bytes;
+    size_t bytes;
+    int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+// What decoding path will allocate, from its header alone
+static size_t decoded_bytes(decode_pool *p, char *path)
+{
+    int w = 0, h = 0, c = 0;
+    if(!stbi_info(path, &w, &h, &c)) w = h = 0;
+    if(p->dest) return (size_t)w*h*p->c*sizeof(float);
+    return ((size_t)w*h + (size_t)p->w*p->h)*p->c*sizeof(float);
+}
+
+static void *decode_worker(void *ptr)
+{
+    decode_pool *p = (decode_pool *)ptr;
+    pthread_mutex_lock(&p->lock);
+    while(1){
+        while(!p->stop && p->next_claim < p->n && p->next_claim >= p->next_out + p->window){
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        if(p->stop || p->next_claim >= p->n) break;
+        int seq = p->next_claim++;
+        pthread_mutex_unlock(&p->lock);
+
+        size_t bytes = decoded_bytes(p, p->paths[seq]);
+
+        float *dest = 0;
+        if(p->dest){
+            pthread_mutex_lock(&p->lock);
+            while(!p->stop && seq != p->next_dest) pthread_cond_wait(&p->changed, &p->lock);
+            if(p->stop) break;
+            pthread_mutex_unlock(&p->lock);
+            // May wait for room, which the images ahead of this one free up
+            dest = p->dest(p->dest_ctx, seq);
+            pthread_mutex_lock(&p->lock);
+            ++p->next_dest;
+            pthread_cond_broadcast(&p->changed);
+            pthread_mutex_unlock(&p->lock);
+        }
+
+        // The oldest image always goes ahead, so the consumer can never be
+        // left waiting on an image that waits for budget
+        pthread_mutex_lock(&p->lock);
+        while(!p->stop && seq != p->next_out && p->bytes + bytes > p->max_bytes){
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        if(p->stop) break;
+        p->bytes += bytes;
+        pthread_mutex_unlock(&p->lock);
+
+        image im, sized = make_empty_image(0, 0, 0);
+        if(dest){
+            im = load_image_letterbox(p->paths[seq], p->w, p->h, p->c, dest);
+        } else if(p->w && p->h){
+            sized = make_image(p->w, p->h, p->c);
+            im = load_image_letterbox(p->paths[seq], p->w, p->h, p->c, sized.data);
+        } else {
+            im = load_image(p->paths[seq], 0, 0, p->c);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        decoded_image *d = p->slots + seq % p->window;
+        d->im = im;
+        d->sized = sized;
+        d->bytes = bytes;
+        d->ready = 1;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+// Decodes the n paths on threads workers. With w and h set every image is
+// also letterboxed to w x h, straight into dest(dest_ctx, index) if dest is
+// given. max_bytes bounds the memory held by decoded images the consumer has
+// not taken yet (0 for no bound).
+decode_pool *make_decode_pool(char **paths, int n, int w, int h, int c, int threads, size_t max_bytes,
+        float *(*dest)(void *ctx, int index), void *dest_ctx)
+{
+    int i;
+    decode_pool *p = calloc(1, sizeof(decode_pool));
+    if(threads < 1) threads = 1;
+    p->paths = paths;
+    p->n = n;
+    p->w = w;
+    p->h = h;
+    p->c = c;
+    p->threads = threads;
+    p->dest = dest;
+    p->dest_ctx = dest_ctx;
+    p->window = 4*threads;
+    p->slots = calloc(p->window, sizeof(decoded_image));
+    p->max_bytes = max_bytes ? max_bytes : (size_t)-1;
+    pthread_mutex_init(&p->lock, 0);
+    pthread_cond_init(&p->changed, 0);
+    p->workers = calloc(threads, sizeof(pthread_t));
+    for(i = 0; i < threads; ++i){
+        if(pthread_create(p->workers + i, 0, decode_worker, p)) error("Decode thread creation failed");
+    }
+    return p;
+}
+
+// Waits for the next image in path order and hands it over to the caller,
+// who frees im and sized (empty when the pool letterboxes into dest).
+// Returns its index in paths, or -1 after the last.
+int decode_pool_next(decode_pool *p, image *im, image *sized)
+{
+    pthread_mutex_lock(&p->lock);
+    if(p->next_out >= p->n){
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+    decoded_image *d = p->slots + p->next_out % p->window;
+    while(!d->ready) pthread_cond_wait(&p->changed, &p->lock);
+    *im = d->im;
+    if(sized) *sized = d->sized;
+    else free_image(d->sized);
+    d->ready = 0;
+    p->bytes -= d->bytes;
+    int seq = p->next_out++;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+    return seq;
+}
+
+// Stops the workers, dropping whatever the consumer has not taken
+void free_decode_pool(decode_pool *p)
+{
+    int i;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+    for(i = 0; i < p->threads; ++i) pthread_join(p->workers[i], 0);
+    for(i = 0; i < p->window; ++i){
+        if(!p->slots[i].ready) continue;
+        free_image(p->slots[i].im);
+        free_image(p->slots[i].sized);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->changed);
+    free(p->workers);
+    free(p->slots);
+    free(p);
+}
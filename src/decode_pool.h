@@ -0,0 +1,11 @@
+#ifndef DECODE_POOL_H
+#define DECODE_POOL_H
+#include "darknet.h"
+
+typedef struct decode_pool decode_pool;
+decode_pool *make_decode_pool(char **paths, int n, int w, int h, int c, int threads, size_t max_bytes,
+        float *(*dest)(void *ctx, int index), void *dest_ctx);
+int decode_pool_next(decode_pool *p, image *im, image *sized);
+void free_decode_pool(decode_pool *p);
+
+#endif
@@ -192,7 +192,7 @@ void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const ch
     demo_thresh = thresh;
     demo_hier = hier;
     printf("Demo\n");
-    net = load_network(cfgfile, weightfile, 0);
+    net = load_network_inference(cfgfile, weightfile);
     set_batch_network(net, 1);
     pthread_t detect_thread;
     pthread_t fetch_thread;
@@ -3,8 +3,37 @@
 #include "cuda.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <string.h>
 #include <math.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GEMM_NEON
+#endif
+
+// Cache blocking for the packed path. KC*NR floats of B stay in L1 while a
+// MC*KC block of A sits in L2; MC and NC are multiples of every kernel's
+// MR and NR.
+#define GEMM_KC 256
+#define GEMM_MC 144
+#define GEMM_NC 4096
+#define GEMM_MAX_TILE (8*32)
+
+typedef void (*gemm_microkernel)(int kc, const float *a, const float *b, float *c, int ldc);
+
+typedef struct{
+    char *name;
+    int mr;
+    int nr;
+    gemm_microkernel kernel;
+} gemm_kernel;
+
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
         float *B, int ldb,
@@ -37,31 +66,6 @@ float *random_matrix(int rows, int cols)
     return m;
 }
 
-void time_random_matrix(int TA, int TB, int m, int k, int n)
-{
-    float *a;
-    if(!TA) a = random_matrix(m,k);
-    else a = random_matrix(k,m);
-    int lda = (!TA)?k:m;
-    float *b;
-    if(!TB) b = random_matrix(k,n);
-    else b = random_matrix(n,k);
-    int ldb = (!TB)?n:k;
-
-    float *c = random_matrix(m,n);
-    int i;
-    clock_t start = clock(), end;
-    for(i = 0; i<10; ++i){
-        gemm_cpu(TA,TB,m,n,k,1,a,lda,b,ldb,1,c,n);
-    }
-    end = clock();
-    printf("Matrix Multiplication %dx%d * %dx%d, TA=%d, TB=%d: %lf ms\n",m,k,k,n, TA, TB, (float)(end-start)/CLOCKS_PER_SEC);
-    free(a);
-    free(b);
-    free(c);
-}
-
-
 void gemm(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A, int lda, 
         float *B, int ldb,
@@ -141,20 +145,426 @@ void gemm_tt(int M, int N, int K, float ALPHA,
     }
 }
 
+/*
+ * Microkernels: C[MR x NR] += a * b, where a is a packed MR-row panel and b
+ * a packed NR-column panel, both of depth kc.
+ */
 
-void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA, 
+#define GEMM_GENERIC_MR 4
+#define GEMM_GENERIC_NR 8
+
+static void gemm_kernel_generic(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    float acc[GEMM_GENERIC_MR][GEMM_GENERIC_NR] = {{0}};
+    int i, j, p;
+    for(p = 0; p < kc; ++p){
+        for(i = 0; i < GEMM_GENERIC_MR; ++i){
+            float a_part = a[i];
+            for(j = 0; j < GEMM_GENERIC_NR; ++j){
+                acc[i][j] += a_part*b[j];
+            }
+        }
+        a += GEMM_GENERIC_MR;
+        b += GEMM_GENERIC_NR;
+    }
+    for(i = 0; i < GEMM_GENERIC_MR; ++i){
+        for(j = 0; j < GEMM_GENERIC_NR; ++j){
+            c[i*ldc + j] += acc[i][j];
+        }
+    }
+}
+
+#ifdef GEMM_X86
+
+#define AVX2_ROW(r) \
+    a_part = _mm256_broadcast_ss(a + r); \
+    c##r##0 = _mm256_fmadd_ps(a_part, b0, c##r##0); \
+    c##r##1 = _mm256_fmadd_ps(a_part, b1, c##r##1);
+
+#define AVX2_STORE(r) \
+    _mm256_storeu_ps(c + r*ldc,     _mm256_add_ps(_mm256_loadu_ps(c + r*ldc),     c##r##0)); \
+    _mm256_storeu_ps(c + r*ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + r*ldc + 8), c##r##1));
+
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_avx2(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    __m256 a_part, b0, b1;
+    int p;
+    for(p = 0; p < kc; ++p){
+        b0 = _mm256_loadu_ps(b);
+        b1 = _mm256_loadu_ps(b + 8);
+        AVX2_ROW(0) AVX2_ROW(1) AVX2_ROW(2)
+        AVX2_ROW(3) AVX2_ROW(4) AVX2_ROW(5)
+        a += 6;
+        b += 16;
+    }
+    AVX2_STORE(0) AVX2_STORE(1) AVX2_STORE(2)
+    AVX2_STORE(3) AVX2_STORE(4) AVX2_STORE(5)
+}
+
+#define AVX512_ROW(r) \
+    a_part = _mm512_set1_ps(a[r]); \
+    c##r##0 = _mm512_fmadd_ps(a_part, b0, c##r##0); \
+    c##r##1 = _mm512_fmadd_ps(a_part, b1, c##r##1);
+
+#define AVX512_STORE(r) \
+    _mm512_storeu_ps(c + r*ldc,      _mm512_add_ps(_mm512_loadu_ps(c + r*ldc),      c##r##0)); \
+    _mm512_storeu_ps(c + r*ldc + 16, _mm512_add_ps(_mm512_loadu_ps(c + r*ldc + 16), c##r##1));
+
+__attribute__((target("avx512f")))
+static void gemm_kernel_avx512(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps();
+    __m512 c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();
+    __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps();
+    __m512 c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();
+    __m512 c40 = _mm512_setzero_ps(), c41 = _mm512_setzero_ps();
+    __m512 c50 = _mm512_setzero_ps(), c51 = _mm512_setzero_ps();
+    __m512 a_part, b0, b1;
+    int p;
+    for(p = 0; p < kc; ++p){
+        b0 = _mm512_loadu_ps(b);
+        b1 = _mm512_loadu_ps(b + 16);
+        AVX512_ROW(0) AVX512_ROW(1) AVX512_ROW(2)
+        AVX512_ROW(3) AVX512_ROW(4) AVX512_ROW(5)
+        a += 6;
+        b += 32;
+    }
+    AVX512_STORE(0) AVX512_STORE(1) AVX512_STORE(2)
+    AVX512_STORE(3) AVX512_STORE(4) AVX512_STORE(5)
+}
+
+#endif
+
+#ifdef GEMM_NEON
+
+#define NEON_ROW(r, av, lane) \
+    c##r##0 = vfmaq_laneq_f32(c##r##0, b0, av, lane); \
+    c##r##1 = vfmaq_laneq_f32(c##r##1, b1, av, lane);
+
+#define NEON_STORE(r) \
+    vst1q_f32(c + r*ldc,     vaddq_f32(vld1q_f32(c + r*ldc),     c##r##0)); \
+    vst1q_f32(c + r*ldc + 4, vaddq_f32(vld1q_f32(c + r*ldc + 4), c##r##1));
+
+static void gemm_kernel_neon(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    float32x4_t z = vdupq_n_f32(0);
+    float32x4_t c00 = z, c01 = z, c10 = z, c11 = z, c20 = z, c21 = z, c30 = z, c31 = z;
+    float32x4_t c40 = z, c41 = z, c50 = z, c51 = z, c60 = z, c61 = z, c70 = z, c71 = z;
+    int p;
+    for(p = 0; p < kc; ++p){
+        float32x4_t a0 = vld1q_f32(a);
+        float32x4_t a1 = vld1q_f32(a + 4);
+        float32x4_t b0 = vld1q_f32(b);
+        float32x4_t b1 = vld1q_f32(b + 4);
+        NEON_ROW(0, a0, 0) NEON_ROW(1, a0, 1) NEON_ROW(2, a0, 2) NEON_ROW(3, a0, 3)
+        NEON_ROW(4, a1, 0) NEON_ROW(5, a1, 1) NEON_ROW(6, a1, 2) NEON_ROW(7, a1, 3)
+        a += 8;
+        b += 8;
+    }
+    NEON_STORE(0) NEON_STORE(1) NEON_STORE(2) NEON_STORE(3)
+    NEON_STORE(4) NEON_STORE(5) NEON_STORE(6) NEON_STORE(7)
+}
+
+#endif
+
+static gemm_kernel gemm_kernels[] = {
+#ifdef GEMM_X86
+    {"avx512", 6, 32, gemm_kernel_avx512},
+    {"avx2",   6, 16, gemm_kernel_avx2},
+#endif
+#ifdef GEMM_NEON
+    {"neon",   8, 8,  gemm_kernel_neon},
+#endif
+    {"generic", GEMM_GENERIC_MR, GEMM_GENERIC_NR, gemm_kernel_generic}
+};
+
+static int gemm_kernel_supported(gemm_kernel *k)
+{
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if(0 == strcmp(k->name, "avx512")) return __builtin_cpu_supports("avx512f");
+    if(0 == strcmp(k->name, "avx2")) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    return 1;
+}
+
+static gemm_kernel *selected_gemm_kernel = 0;
+static pthread_once_t gemm_kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_gemm_kernel()
+{
+    int i;
+    int n = sizeof(gemm_kernels)/sizeof(gemm_kernels[0]);
+    for(i = 0; i < n; ++i){
+        if(gemm_kernel_supported(gemm_kernels + i)) break;
+    }
+    selected_gemm_kernel = gemm_kernels + i;
+}
+
+// Selected exactly once, so replica and pipeline threads may race to get here
+static gemm_kernel *get_gemm_kernel()
+{
+    pthread_once(&gemm_kernel_once, select_gemm_kernel);
+    return selected_gemm_kernel;
+}
+
+char *gemm_kernel_name()
+{
+    return get_gemm_kernel()->name;
+}
+
+static void *gemm_alloc(size_t n)
+{
+    void *ptr = 0;
+    if(posix_memalign(&ptr, 64, n*sizeof(float))) malloc_error();
+    return ptr;
+}
+
+// Packing buffers, kept per thread and only grown, so the GEMMs of a forward
+// pass reuse them instead of allocating on every call
+static __thread float *gemm_buffer_a = 0;
+static __thread size_t gemm_buffer_a_size = 0;
+static __thread float *gemm_buffer_b = 0;
+static __thread size_t gemm_buffer_b_size = 0;
+
+static float *gemm_buffer(float **buf, size_t *size, size_t n)
+{
+    if(n > *size){
+        free(*buf);
+        *buf = gemm_alloc(n);
+        *size = n;
+    }
+    return *buf;
+}
+
+static void gemm_pack_a(int TA, int mc, int kc, float ALPHA, float *A, int lda, int mr, float *packed)
+{
+    int ir, i, p;
+    for(ir = 0; ir < mc; ir += mr){
+        int rows = (mc - ir < mr) ? mc - ir : mr;
+        float *dst = packed + ir*kc;
+        if(!TA){
+            for(i = 0; i < rows; ++i){
+                float *src = A + (ir + i)*lda;
+                for(p = 0; p < kc; ++p){
+                    dst[p*mr + i] = ALPHA*src[p];
+                }
+            }
+        } else {
+            for(p = 0; p < kc; ++p){
+                float *src = A + p*lda + ir;
+                for(i = 0; i < rows; ++i){
+                    dst[p*mr + i] = ALPHA*src[i];
+                }
+            }
+        }
+        for(p = 0; p < kc; ++p){
+            for(i = rows; i < mr; ++i){
+                dst[p*mr + i] = 0;
+            }
+        }
+    }
+}
+
+static void gemm_pack_b(int TB, int kc, int nc, float *B, int ldb, int nr, float *packed)
+{
+    int jr;
+    #pragma omp parallel for
+    for(jr = 0; jr < nc; jr += nr){
+        int j, p;
+        int cols = (nc - jr < nr) ? nc - jr : nr;
+        float *dst = packed + jr*kc;
+        if(!TB){
+            for(p = 0; p < kc; ++p){
+                float *src = B + p*ldb + jr;
+                for(j = 0; j < cols; ++j){
+                    dst[p*nr + j] = src[j];
+                }
+                for(; j < nr; ++j){
+                    dst[p*nr + j] = 0;
+                }
+            }
+        } else {
+            for(j = 0; j < cols; ++j){
+                float *src = B + (jr + j)*ldb;
+                for(p = 0; p < kc; ++p){
+                    dst[p*nr + j] = src[p];
+                }
+            }
+            for(p = 0; p < kc; ++p){
+                for(j = cols; j < nr; ++j){
+                    dst[p*nr + j] = 0;
+                }
+            }
+        }
+    }
+}
+
+// Bias and activation applied to a finished tile of C while it is still in cache
+static void gemm_epilogue(float *c, int ldc, int rows, int cols, float *bias, ACTIVATION a)
+{
+    int i, j;
+    for(i = 0; i < rows; ++i){
+        float b = bias[i];
+        float *row = c + i*ldc;
+        switch(a){
+            case LINEAR:
+                for(j = 0; j < cols; ++j) row[j] += b;
+                break;
+            case LEAKY:
+                for(j = 0; j < cols; ++j){
+                    float x = row[j] + b;
+                    row[j] = (x > 0) ? x : .1f*x;
+                }
+                break;
+            default:
+                for(j = 0; j < cols; ++j) row[j] = activate(row[j] + b, a);
+        }
+    }
+}
+
+static void gemm_macro_kernel(gemm_kernel *k, int mc, int nc, int kc, float *packed_a, float *packed_b, float *C, int ldc,
+        int overwrite, float *bias, ACTIVATION a)
+{
+    int mr = k->mr;
+    int nr = k->nr;
+    int m_panels = (mc + mr - 1)/mr;
+    int n_panels = (nc + nr - 1)/nr;
+    int t;
+    #pragma omp parallel for
+    for(t = 0; t < m_panels*n_panels; ++t){
+        int ir = (t % m_panels)*mr;
+        int jr = (t / m_panels)*nr;
+        int rows = (mc - ir < mr) ? mc - ir : mr;
+        int cols = (nc - jr < nr) ? nc - jr : nr;
+        float *c = C + ir*ldc + jr;
+        if(rows == mr && cols == nr && !overwrite){
+            k->kernel(kc, packed_a + ir*kc, packed_b + jr*kc, c, ldc);
+        } else {
+            int i, j;
+            float tile[GEMM_MAX_TILE] = {0};
+            k->kernel(kc, packed_a + ir*kc, packed_b + jr*kc, tile, nr);
+            for(i = 0; i < rows; ++i){
+                for(j = 0; j < cols; ++j){
+                    if(overwrite) c[i*ldc + j] = tile[i*nr + j];
+                    else c[i*ldc + j] += tile[i*nr + j];
+                }
+            }
+        }
+        if(bias) gemm_epilogue(c, ldc, rows, cols, bias + ir, a);
+    }
+}
+
+void gemm_cpu_packed(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A, int lda, 
         float *B, int ldb,
+        float *C, int ldc)
+{
+    gemm_kernel *k = get_gemm_kernel();
+    int max_nc = (N < GEMM_NC) ? (N + k->nr - 1)/k->nr*k->nr : GEMM_NC;
+    float *packed_a = gemm_buffer(&gemm_buffer_a, &gemm_buffer_a_size, GEMM_MC*GEMM_KC);
+    float *packed_b = gemm_buffer(&gemm_buffer_b, &gemm_buffer_b_size, GEMM_KC*max_nc);
+    int ic, jc, pc;
+    for(jc = 0; jc < N; jc += GEMM_NC){
+        int nc = (N - jc < GEMM_NC) ? N - jc : GEMM_NC;
+        for(pc = 0; pc < K; pc += GEMM_KC){
+            int kc = (K - pc < GEMM_KC) ? K - pc : GEMM_KC;
+            float *b = TB ? B + jc*ldb + pc : B + pc*ldb + jc;
+            gemm_pack_b(TB, kc, nc, b, ldb, k->nr, packed_b);
+            for(ic = 0; ic < M; ic += GEMM_MC){
+                int mc = (M - ic < GEMM_MC) ? M - ic : GEMM_MC;
+                float *a = TA ? A + pc*lda + ic : A + ic*lda + pc;
+                gemm_pack_a(TA, mc, kc, ALPHA, a, lda, k->mr, packed_a);
+                gemm_macro_kernel(k, mc, nc, kc, packed_a, packed_b, C + ic*ldc + jc, ldc, 0, 0, LINEAR);
+            }
+        }
+    }
+}
+
+size_t gemm_packed_size(int M, int K)
+{
+    gemm_kernel *k = get_gemm_kernel();
+    return (size_t)((M + k->mr - 1)/k->mr)*k->mr*K;
+}
+
+void gemm_pack_matrix(int TA, int M, int K, float ALPHA, float *A, int lda, float *packed)
+{
+    gemm_kernel *k = get_gemm_kernel();
+    int padded_m = (M + k->mr - 1)/k->mr*k->mr;
+    int pc;
+    for(pc = 0; pc < K; pc += GEMM_KC){
+        int kc = (K - pc < GEMM_KC) ? K - pc : GEMM_KC;
+        float *a = TA ? A + pc*lda : A + pc;
+        gemm_pack_a(TA, M, kc, ALPHA, a, lda, k->mr, packed + (size_t)pc*padded_m);
+    }
+}
+
+static void gemm_prepacked(int TB, int M, int N, int K,
+        float *packed_A,
+        float *B, int ldb,
+        float *C, int ldc,
+        int overwrite, float *bias, ACTIVATION activation)
+{
+    gemm_kernel *k = get_gemm_kernel();
+    int padded_m = (M + k->mr - 1)/k->mr*k->mr;
+    int ic, jc, pc;
+    int max_nc = (N < GEMM_NC) ? (N + k->nr - 1)/k->nr*k->nr : GEMM_NC;
+    float *packed_b = gemm_buffer(&gemm_buffer_b, &gemm_buffer_b_size, GEMM_KC*max_nc);
+    for(jc = 0; jc < N; jc += GEMM_NC){
+        int nc = (N - jc < GEMM_NC) ? N - jc : GEMM_NC;
+        for(pc = 0; pc < K; pc += GEMM_KC){
+            int kc = (K - pc < GEMM_KC) ? K - pc : GEMM_KC;
+            int last = pc + kc >= K;
+            float *b = TB ? B + jc*ldb + pc : B + pc*ldb + jc;
+            gemm_pack_b(TB, kc, nc, b, ldb, k->nr, packed_b);
+            for(ic = 0; ic < M; ic += GEMM_MC){
+                int mc = (M - ic < GEMM_MC) ? M - ic : GEMM_MC;
+                float *a = packed_A + (size_t)pc*padded_m + ic*kc;
+                gemm_macro_kernel(k, mc, nc, kc, a, packed_b, C + ic*ldc + jc, ldc,
+                        overwrite && pc == 0, (bias && last) ? bias + ic : 0, activation);
+            }
+        }
+    }
+}
+
+void gemm_cpu_prepacked(int TB, int M, int N, int K,
+        float *packed_A,
+        float *B, int ldb,
         float BETA,
         float *C, int ldc)
 {
-    //printf("cpu: %d %d %d %d %d %f %d %d %f %d\n",TA, TB, M, N, K, ALPHA, lda, ldb, BETA, ldc);
     int i, j;
-    for(i = 0; i < M; ++i){
-        for(j = 0; j < N; ++j){
-            C[i*ldc + j] *= BETA;
+    if(BETA != 0 && BETA != 1){
+        for(i = 0; i < M; ++i){
+            for(j = 0; j < N; ++j){
+                C[i*ldc + j] *= BETA;
+            }
         }
     }
+    gemm_prepacked(TB, M, N, K, packed_A, B, ldb, C, ldc, BETA == 0, 0, LINEAR);
+}
+
+void gemm_cpu_prepacked_bias(int TB, int M, int N, int K,
+        float *packed_A,
+        float *B, int ldb,
+        float *C, int ldc,
+        float *bias, ACTIVATION a)
+{
+    gemm_prepacked(TB, M, N, K, packed_A, B, ldb, C, ldc, 1, bias, a);
+}
+
+void gemm_cpu_naive(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float *C, int ldc)
+{
     if(!TA && !TB)
         gemm_nn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
     else if(TA && !TB)
@@ -165,6 +575,448 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         gemm_tt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
 }
 
+void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc)
+{
+    //printf("cpu: %d %d %d %d %d %f %d %d %f %d\n",TA, TB, M, N, K, ALPHA, lda, ldb, BETA, ldc);
+    int i, j;
+    if(BETA != 1){
+        for(i = 0; i < M; ++i){
+            for(j = 0; j < N; ++j){
+                C[i*ldc + j] *= BETA;
+            }
+        }
+    }
+    // Packing only pays off once both panels get reused a few times
+    if(M < 4 || N < 16 || (size_t)M*N*K < 32768){
+        gemm_cpu_naive(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
+    } else {
+        gemm_cpu_packed(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
+    }
+}
+
+void time_random_matrix(int TA, int TB, int m, int k, int n)
+{
+    float *a;
+    if(!TA) a = random_matrix(m,k);
+    else a = random_matrix(k,m);
+    int lda = (!TA)?k:m;
+    float *b;
+    if(!TB) b = random_matrix(k,n);
+    else b = random_matrix(n,k);
+    int ldb = (!TB)?n:k;
+
+    float *c_naive = calloc(m*n, sizeof(float));
+    float *c_packed = calloc(m*n, sizeof(float));
+    int i;
+    int iter = 10;
+    double flop = 2.*m*n*k*iter;
+
+    double start = what_time_is_it_now();
+    for(i = 0; i < iter; ++i){
+        gemm_cpu_naive(TA,TB,m,n,k,1,a,lda,b,ldb,c_naive,n);
+    }
+    double naive = what_time_is_it_now() - start;
+
+    start = what_time_is_it_now();
+    for(i = 0; i < iter; ++i){
+        gemm_cpu_packed(TA,TB,m,n,k,1,a,lda,b,ldb,c_packed,n);
+    }
+    double packed = what_time_is_it_now() - start;
+
+    float max_err = 0;
+    for(i = 0; i < m*n; ++i){
+        float err = fabs(c_naive[i] - c_packed[i])/(fabs(c_naive[i]) + 1);
+        if(err > max_err) max_err = err;
+    }
+    printf("Matrix Multiplication %dx%d * %dx%d, TA=%d, TB=%d: naive %.2f GFLOPS, %s %.2f GFLOPS (%.2fx), max rel err %g\n",
+            m,k,k,n, TA, TB, flop/naive/1e9, gemm_kernel_name(), flop/packed/1e9, naive/packed, max_err);
+    free(a);
+    free(b);
+    free(c_naive);
+    free(c_packed);
+}
+
+// INT8 GEMM: operands are packed in pairs along K, A as [M/4][K/2][4][2] and
+// B as [N/16][K/2][16][2], both zero padded, accumulated in int32 and scaled
+// back to float per output row. The x86 kernels take pairs widened to int16
+// so a single madd gives two products; NEON keeps them int8 and widens in
+// the kernel, so packed operands are half the size there. Callers only see
+// the size in bytes.
+#define GEMM_INT8_MR 4
+#define GEMM_INT8_NR 16
+
+#ifdef GEMM_NEON
+typedef int8_t int8_packed;
+#else
+typedef int16_t int8_packed;
+#endif
+
+typedef void (*gemm_int8_microkernel)(int kp, const int8_packed *a, const int8_packed *b, int32_t *c);
+
+static void gemm_int8_kernel_generic(int kp, const int8_packed *a, const int8_packed *b, int32_t *c)
+{
+    int32_t acc[GEMM_INT8_MR][GEMM_INT8_NR] = {{0}};
+    int p, r, j;
+    for(p = 0; p < kp; ++p){
+        for(r = 0; r < GEMM_INT8_MR; ++r){
+            int32_t a0 = a[(p*GEMM_INT8_MR + r)*2];
+            int32_t a1 = a[(p*GEMM_INT8_MR + r)*2 + 1];
+            for(j = 0; j < GEMM_INT8_NR; ++j){
+                acc[r][j] += a0*b[(p*GEMM_INT8_NR + j)*2] + a1*b[(p*GEMM_INT8_NR + j)*2 + 1];
+            }
+        }
+    }
+    memcpy(c, acc, sizeof(acc));
+}
+
+#ifdef GEMM_X86
+#define INT8_ROW(r, madd) \
+    memcpy(&pair, a + (p*GEMM_INT8_MR + r)*2, sizeof(pair)); \
+    a_part = _mm256_set1_epi32(pair); \
+    c##r##0 = madd(c##r##0, a_part, b0); \
+    c##r##1 = madd(c##r##1, a_part, b1);
+
+#define INT8_KERNEL(name, madd) \
+static void name(int kp, const int8_packed *a, const int8_packed *b, int32_t *c) \
+{ \
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256(); \
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256(); \
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256(); \
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256(); \
+    __m256i a_part, b0, b1; \
+    int32_t pair; \
+    int p; \
+    for(p = 0; p < kp; ++p){ \
+        b0 = _mm256_loadu_si256((const __m256i *)(b + p*2*GEMM_INT8_NR)); \
+        b1 = _mm256_loadu_si256((const __m256i *)(b + p*2*GEMM_INT8_NR + 16)); \
+        INT8_ROW(0, madd) \
+        INT8_ROW(1, madd) \
+        INT8_ROW(2, madd) \
+        INT8_ROW(3, madd) \
+    } \
+    _mm256_storeu_si256((__m256i *)(c),      c00); \
+    _mm256_storeu_si256((__m256i *)(c + 8),  c01); \
+    _mm256_storeu_si256((__m256i *)(c + 16), c10); \
+    _mm256_storeu_si256((__m256i *)(c + 24), c11); \
+    _mm256_storeu_si256((__m256i *)(c + 32), c20); \
+    _mm256_storeu_si256((__m256i *)(c + 40), c21); \
+    _mm256_storeu_si256((__m256i *)(c + 48), c30); \
+    _mm256_storeu_si256((__m256i *)(c + 56), c31); \
+}
+
+#define AVX2_MADD(c, a, b) _mm256_add_epi32(c, _mm256_madd_epi16(a, b))
+#define VNNI_MADD(c, a, b) _mm256_dpwssd_avx_epi32(c, a, b)
+
+__attribute__((target("avx2")))
+INT8_KERNEL(gemm_int8_kernel_avx2, AVX2_MADD)
+
+__attribute__((target("avx2,avxvnni")))
+INT8_KERNEL(gemm_int8_kernel_avxvnni, VNNI_MADD)
+
+
+// Runs on a block of bm x bn consecutive A and B panels at once: the next
+// panel of each operand starts kp pairs later, and the bm*bn 4x16 tiles are
+// written one after the other, A panel major.
+__attribute__((target("avx512f,avx512vnni")))
+static void gemm_int8_kernel_avx512vnni(int kp, const int8_packed *a, const int8_packed *b, int32_t *c)
+{
+    const int8_packed *a1 = a + kp*2*GEMM_INT8_MR;
+    const int8_packed *b1 = b + kp*2*GEMM_INT8_NR;
+    __m512i acc[2*GEMM_INT8_MR][2];
+    int32_t pair;
+    int p, r;
+    for(r = 0; r < 2*GEMM_INT8_MR; ++r){
+        acc[r][0] = _mm512_setzero_si512();
+        acc[r][1] = _mm512_setzero_si512();
+    }
+    for(p = 0; p < kp; ++p){
+        __m512i b0 = _mm512_loadu_si512(b + p*2*GEMM_INT8_NR);
+        __m512i b_1 = _mm512_loadu_si512(b1 + p*2*GEMM_INT8_NR);
+        for(r = 0; r < GEMM_INT8_MR; ++r){
+            memcpy(&pair, a + (p*GEMM_INT8_MR + r)*2, sizeof(pair));
+            __m512i a_part = _mm512_set1_epi32(pair);
+            acc[r][0] = _mm512_dpwssd_epi32(acc[r][0], a_part, b0);
+            acc[r][1] = _mm512_dpwssd_epi32(acc[r][1], a_part, b_1);
+            memcpy(&pair, a1 + (p*GEMM_INT8_MR + r)*2, sizeof(pair));
+            a_part = _mm512_set1_epi32(pair);
+            acc[GEMM_INT8_MR + r][0] = _mm512_dpwssd_epi32(acc[GEMM_INT8_MR + r][0], a_part, b0);
+            acc[GEMM_INT8_MR + r][1] = _mm512_dpwssd_epi32(acc[GEMM_INT8_MR + r][1], a_part, b_1);
+        }
+    }
+    for(r = 0; r < GEMM_INT8_MR; ++r){
+        _mm512_storeu_si512(c + r*GEMM_INT8_NR, acc[r][0]);
+        _mm512_storeu_si512(c + 64 + r*GEMM_INT8_NR, acc[r][1]);
+        _mm512_storeu_si512(c + 128 + r*GEMM_INT8_NR, acc[GEMM_INT8_MR + r][0]);
+        _mm512_storeu_si512(c + 192 + r*GEMM_INT8_NR, acc[GEMM_INT8_MR + r][1]);
+    }
+}
+#endif
+
+#ifdef GEMM_NEON
+// vld2q_s8 splits the 16 B pairs into their k and k+1 values. Products of
+// two int8 values in [-127, 127] sum to at most 2*127*127, which fits in
+// int16, so vmull_s8 and vmlal_s8 give a_k*b_k + a_k1*b_k1 for 8 columns at
+// a time, then vaddw widens them into the int32 accumulators.
+#define NEON_INT8_HALF(r, half, get) \
+    prod = vmull_s8(get(bp.val[0]), a0); \
+    prod = vmlal_s8(prod, get(bp.val[1]), a1); \
+    c##r##half##0 = vaddw_s16(c##r##half##0, vget_low_s16(prod)); \
+    c##r##half##1 = vaddw_high_s16(c##r##half##1, prod);
+
+#define NEON_INT8_ROW(r) \
+    a0 = vdup_n_s8(a[(p*GEMM_INT8_MR + r)*2]); \
+    a1 = vdup_n_s8(a[(p*GEMM_INT8_MR + r)*2 + 1]); \
+    NEON_INT8_HALF(r, 0, vget_low_s8) \
+    NEON_INT8_HALF(r, 1, vget_high_s8)
+
+#define NEON_INT8_STORE(r) \
+    vst1q_s32(c + r*GEMM_INT8_NR,      c##r##00); \
+    vst1q_s32(c + r*GEMM_INT8_NR + 4,  c##r##01); \
+    vst1q_s32(c + r*GEMM_INT8_NR + 8,  c##r##10); \
+    vst1q_s32(c + r*GEMM_INT8_NR + 12, c##r##11);
+
+static void gemm_int8_kernel_neon(int kp, const int8_packed *a, const int8_packed *b, int32_t *c)
+{
+    int32x4_t z = vdupq_n_s32(0);
+    int32x4_t c000 = z, c001 = z, c010 = z, c011 = z;
+    int32x4_t c100 = z, c101 = z, c110 = z, c111 = z;
+    int32x4_t c200 = z, c201 = z, c210 = z, c211 = z;
+    int32x4_t c300 = z, c301 = z, c310 = z, c311 = z;
+    int8x8_t a0, a1;
+    int16x8_t prod;
+    int p;
+    for(p = 0; p < kp; ++p){
+        int8x16x2_t bp = vld2q_s8(b + p*2*GEMM_INT8_NR);
+        NEON_INT8_ROW(0)
+        NEON_INT8_ROW(1)
+        NEON_INT8_ROW(2)
+        NEON_INT8_ROW(3)
+    }
+    NEON_INT8_STORE(0)
+    NEON_INT8_STORE(1)
+    NEON_INT8_STORE(2)
+    NEON_INT8_STORE(3)
+}
+#endif
+
+typedef struct{
+    int bm;
+    int bn;
+    gemm_int8_microkernel kernel;
+    gemm_int8_microkernel single;
+} gemm_int8_kernel;
+
+static gemm_int8_kernel selected_gemm_int8_kernel;
+static pthread_once_t gemm_int8_kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_gemm_int8_kernel()
+{
+    gemm_int8_kernel k = {1, 1, gemm_int8_kernel_generic, gemm_int8_kernel_generic};
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) k.kernel = k.single = gemm_int8_kernel_avx2;
+    if(__builtin_cpu_supports("avxvnni")) k.kernel = k.single = gemm_int8_kernel_avxvnni;
+    if(__builtin_cpu_supports("avx512vnni")){
+        k.bm = k.bn = 2;
+        k.kernel = gemm_int8_kernel_avx512vnni;
+    }
+#endif
+#ifdef GEMM_NEON
+    k.kernel = k.single = gemm_int8_kernel_neon;
+#endif
+    selected_gemm_int8_kernel = k;
+}
+
+static gemm_int8_kernel *get_gemm_int8_kernel()
+{
+    pthread_once(&gemm_int8_kernel_once, select_gemm_int8_kernel);
+    return &selected_gemm_int8_kernel;
+}
+
+// Sizes of the packed operands in bytes
+size_t gemm_int8_packed_a_size(int M, int K)
+{
+    return (size_t)(M + GEMM_INT8_MR - 1)/GEMM_INT8_MR*GEMM_INT8_MR*((K + 1)/2)*2*sizeof(int8_packed);
+}
+
+size_t gemm_int8_packed_b_size(int K, int N)
+{
+    return (size_t)(N + GEMM_INT8_NR - 1)/GEMM_INT8_NR*GEMM_INT8_NR*((K + 1)/2)*2*sizeof(int8_packed);
+}
+
+void gemm_int8_pack_a(int M, int K, int8_t *A, void *packed_A)
+{
+    int8_packed *packed = packed_A;
+    int kp = (K + 1)/2;
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < M + GEMM_INT8_MR - 1; i += GEMM_INT8_MR){
+        int8_packed *dst = packed + (size_t)i*kp*2;
+        int r, p;
+        if(i >= M) continue;
+        for(p = 0; p < kp; ++p){
+            for(r = 0; r < GEMM_INT8_MR; ++r){
+                int row = i + r;
+                int k = 2*p;
+                dst[(p*GEMM_INT8_MR + r)*2]     = (row < M) ? A[(size_t)row*K + k] : 0;
+                dst[(p*GEMM_INT8_MR + r)*2 + 1] = (row < M && k + 1 < K) ? A[(size_t)row*K + k + 1] : 0;
+            }
+        }
+    }
+}
+
+void gemm_int8_pack_b(int K, int N, int8_t *B, void *packed_B)
+{
+    int8_packed *packed = packed_B;
+    int kp = (K + 1)/2;
+    int jr;
+    #pragma omp parallel for
+    for(jr = 0; jr < N + GEMM_INT8_NR - 1; jr += GEMM_INT8_NR){
+        int8_packed *dst = packed + (size_t)jr*kp*2;
+        int cols = (N - jr < GEMM_INT8_NR) ? N - jr : GEMM_INT8_NR;
+        int p, j;
+        if(jr >= N) continue;
+        for(p = 0; p < kp; ++p){
+            int8_t *b0 = B + (size_t)(2*p)*N + jr;
+            int8_t *b1 = (2*p + 1 < K) ? b0 + N : 0;
+            for(j = 0; j < cols; ++j){
+                dst[(p*GEMM_INT8_NR + j)*2]     = b0[j];
+                dst[(p*GEMM_INT8_NR + j)*2 + 1] = b1 ? b1[j] : 0;
+            }
+            for(; j < GEMM_INT8_NR; ++j){
+                dst[(p*GEMM_INT8_NR + j)*2]     = 0;
+                dst[(p*GEMM_INT8_NR + j)*2 + 1] = 0;
+            }
+        }
+    }
+}
+
+static void gemm_int8_store(int32_t *tile, int rows, int cols, float *scales, float scale,
+        float *bias, ACTIVATION a, float *c, int ldc)
+{
+    int i, j;
+    for(i = 0; i < rows; ++i){
+        float s = scales[i]*scale;
+        for(j = 0; j < cols; ++j){
+            c[i*ldc + j] = tile[i*GEMM_INT8_NR + j]*s;
+        }
+    }
+    gemm_epilogue(c, ldc, rows, cols, bias, a);
+}
+
+// C = activate(A*B * scales[i]*scale + bias[i]) on packed int8 operands
+void gemm_int8(int M, int N, int K,
+        void *packed_A,
+        void *packed_B,
+        float *C, int ldc,
+        float *scales, float scale, float *bias, ACTIVATION a)
+{
+    int8_packed *pa = packed_A;
+    int8_packed *pb = packed_B;
+    gemm_int8_kernel *k = get_gemm_int8_kernel();
+    int kp = (K + 1)/2;
+    int m_panels = (M + GEMM_INT8_MR - 1)/GEMM_INT8_MR;
+    int n_panels = (N + GEMM_INT8_NR - 1)/GEMM_INT8_NR;
+    int m_blocks = (m_panels + k->bm - 1)/k->bm;
+    int n_blocks = (n_panels + k->bn - 1)/k->bn;
+    // Keep whichever operand is smaller in cache while the other streams past
+    int a_outer = (size_t)m_panels*GEMM_INT8_MR > (size_t)n_panels*GEMM_INT8_NR;
+    int t;
+    #pragma omp parallel for
+    for(t = 0; t < m_blocks*n_blocks; ++t){
+        int mb = (a_outer ? t / n_blocks : t % m_blocks)*k->bm;
+        int nb = (a_outer ? t % n_blocks : t / m_blocks)*k->bn;
+        int32_t tiles[4*GEMM_INT8_MR*GEMM_INT8_NR];
+        int full = mb + k->bm <= m_panels && nb + k->bn <= n_panels;
+        int mi, nj;
+        if(full){
+            k->kernel(kp, pa + (size_t)mb*GEMM_INT8_MR*kp*2, pb + (size_t)nb*GEMM_INT8_NR*kp*2, tiles);
+        }
+        for(mi = mb; mi < mb + k->bm && mi < m_panels; ++mi){
+            for(nj = nb; nj < nb + k->bn && nj < n_panels; ++nj){
+                int ir = mi*GEMM_INT8_MR;
+                int jr = nj*GEMM_INT8_NR;
+                int rows = (M - ir < GEMM_INT8_MR) ? M - ir : GEMM_INT8_MR;
+                int cols = (N - jr < GEMM_INT8_NR) ? N - jr : GEMM_INT8_NR;
+                int32_t *tile = tiles + ((mi - mb)*k->bn + nj - nb)*GEMM_INT8_MR*GEMM_INT8_NR;
+                if(!full){
+                    tile = tiles;
+                    k->single(kp, pa + (size_t)ir*kp*2, pb + (size_t)jr*kp*2, tile);
+                }
+                gemm_int8_store(tile, rows, cols, scales + ir, scale, bias + ir, a, C + ir*ldc + jr, ldc);
+            }
+        }
+    }
+}
+
+void time_int8_matrix(int m, int k, int n)
+{
+    int i, j;
+    int8_t *a = calloc((size_t)m*k, sizeof(int8_t));
+    int8_t *b = calloc((size_t)k*n, sizeof(int8_t));
+    for(i = 0; i < m*k; ++i) a[i] = rand()%255 - 127;
+    for(i = 0; i < k*n; ++i) b[i] = rand()%255 - 127;
+    void *pa = gemm_alloc((gemm_int8_packed_a_size(m, k) + 3)/4);
+    void *pb = gemm_alloc((gemm_int8_packed_b_size(k, n) + 3)/4);
+    float *c = calloc((size_t)m*n, sizeof(float));
+    float *scales = calloc(m, sizeof(float));
+    float *bias = calloc(m, sizeof(float));
+    for(i = 0; i < m; ++i) scales[i] = 1;
+    gemm_int8_pack_a(m, k, a, pa);
+
+    double start = what_time_is_it_now();
+    gemm_int8_pack_b(k, n, b, pb);
+    gemm_int8(m, n, k, pa, pb, c, n, scales, 1, bias, LINEAR);
+    double t = what_time_is_it_now() - start;
+
+    int errors = 0;
+    for(i = 0; i < m; i += 7){
+        for(j = 0; j < n; j += 13){
+            int p;
+            int32_t sum = 0;
+            for(p = 0; p < k; ++p) sum += a[(size_t)i*k + p]*b[(size_t)p*n + j];
+            if(c[(size_t)i*n + j] != (float)sum) ++errors;
+        }
+    }
+    printf("Int8 Matrix Multiplication %dx%d * %dx%d: %lf s, %.2f GOPS%s\n",
+            m, k, k, n, t, 2.*m*n*k/t/1e9, errors ? " MISMATCH" : "");
+    free(a);
+    free(b);
+    free(pa);
+    free(pb);
+    free(c);
+    free(scales);
+    free(bias);
+}
+
+int test_cpu_blas()
+{
+    // Convolutional shapes (filters x size*size*c x out_w*out_h) from yolov3-416
+    time_random_matrix(0,0,32,27,173056);
+    time_random_matrix(0,0,64,288,43264);
+    time_random_matrix(0,0,32,64,43264);
+    time_random_matrix(0,0,128,576,10816);
+    time_random_matrix(0,0,256,1152,2704);
+    time_random_matrix(0,0,512,2304,676);
+    time_random_matrix(0,0,1024,4608,169);
+    time_random_matrix(0,0,255,1024,169);
+
+    // Backward shapes
+    time_random_matrix(0,1,256,2704,1152);
+    time_random_matrix(1,0,1152,256,2704);
+
+    time_int8_matrix(64,288,43264);
+    time_int8_matrix(128,576,10816);
+    time_int8_matrix(256,1152,2704);
+    time_int8_matrix(512,2304,676);
+    time_int8_matrix(1024,4608,169);
+    return 0;
+}
+
 #ifdef GPU
 
 #include <math.h>
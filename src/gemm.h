@@ -1,5 +1,8 @@
 #ifndef GEMM_H
 #define GEMM_H
+#include <stddef.h>
+#include <stdint.h>
+#include "activations.h"
 
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
@@ -18,6 +21,43 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float BETA,
         float *C, int ldc);
 
+void gemm_cpu_naive(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float *C, int ldc);
+
+void gemm_cpu_packed(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float *C, int ldc);
+
+char *gemm_kernel_name();
+float *random_matrix(int rows, int cols);
+
+size_t gemm_packed_size(int M, int K);
+void gemm_pack_matrix(int TA, int M, int K, float ALPHA, float *A, int lda, float *packed);
+void gemm_cpu_prepacked(int TB, int M, int N, int K,
+        float *packed_A,
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc);
+void gemm_cpu_prepacked_bias(int TB, int M, int N, int K,
+        float *packed_A,
+        float *B, int ldb,
+        float *C, int ldc,
+        float *bias, ACTIVATION a);
+
+size_t gemm_int8_packed_a_size(int M, int K);
+size_t gemm_int8_packed_b_size(int K, int N);
+void gemm_int8_pack_a(int M, int K, int8_t *A, void *packed);
+void gemm_int8_pack_b(int K, int N, int8_t *B, void *packed);
+void gemm_int8(int M, int N, int K,
+        void *packed_A,
+        void *packed_B,
+        float *C, int ldc,
+        float *scales, float scale, float *bias, ACTIVATION a);
+void time_int8_matrix(int m, int k, int n);
+
 #ifdef GPU
 void gemm_gpu(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A_gpu, int lda, 
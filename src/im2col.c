@@ -1,5 +1,9 @@
 #include "im2col.h"
+#include "gemm.h"
+#include "utils.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 float im2col_get_pixel(float *im, int height, int width, int channels,
                         int row, int col, int channel, int pad)
 {
@@ -13,7 +17,7 @@ float im2col_get_pixel(float *im, int height, int width, int channels,
 
 //From Berkeley Vision's Caffe!
 //https://github.com/BVLC/caffe/blob/master/LICENSE
-void im2col_cpu(float* data_im,
+void im2col_cpu_naive(float* data_im,
      int channels,  int height,  int width,
      int ksize,  int stride, int pad, float* data_col) 
 {
@@ -38,3 +42,192 @@ void im2col_cpu(float* data_im,
     }
 }
 
+// Output columns [*start, *end) read input columns inside the image for
+// kernel offset k; everything outside is padding.
+static void im2col_valid_range(int k, int stride, int pad, int width, int width_col, int *start, int *end)
+{
+    int s = (pad - k > 0) ? (pad - k + stride - 1)/stride : 0;
+    int e = (width - 1 + pad - k < 0) ? 0 : (width - 1 + pad - k)/stride + 1;
+    if(s > width_col) s = width_col;
+    if(e > width_col) e = width_col;
+    if(e < s) e = s;
+    *start = s;
+    *end = e;
+}
+
+void im2col_cpu(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad, float* data_col) 
+{
+    int height_col = (height + 2*pad - ksize) / stride + 1;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+    int channels_col = channels * ksize * ksize;
+    int c;
+    #pragma omp parallel for
+    for (c = 0; c < channels_col; ++c) {
+        int w_offset = c % ksize;
+        int h_offset = (c / ksize) % ksize;
+        int c_im = c / ksize / ksize;
+        float *im = data_im + c_im*height*width;
+        float *col = data_col + c*height_col*width_col;
+        int start, end, h, w;
+        im2col_valid_range(w_offset, stride, pad, width, width_col, &start, &end);
+        for (h = 0; h < height_col; ++h) {
+            int im_row = h_offset + h*stride - pad;
+            float *dst = col + h*width_col;
+            if (im_row < 0 || im_row >= height) {
+                memset(dst, 0, width_col*sizeof(float));
+                continue;
+            }
+            float *src = im + im_row*width + w_offset - pad;
+            memset(dst, 0, start*sizeof(float));
+            if (stride == 1) {
+                memcpy(dst + start, src + start, (end - start)*sizeof(float));
+            } else {
+                for (w = start; w < end; ++w) dst[w] = src[w*stride];
+            }
+            memset(dst + end, 0, (width_col - end)*sizeof(float));
+        }
+    }
+}
+
+void im2col_cpu_int8(int8_t* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad, int8_t* data_col) 
+{
+    int height_col = (height + 2*pad - ksize) / stride + 1;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+    int channels_col = channels * ksize * ksize;
+    int c;
+    #pragma omp parallel for
+    for (c = 0; c < channels_col; ++c) {
+        int w_offset = c % ksize;
+        int h_offset = (c / ksize) % ksize;
+        int c_im = c / ksize / ksize;
+        int8_t *im = data_im + c_im*height*width;
+        int8_t *col = data_col + c*height_col*width_col;
+        int start, end, h, w;
+        im2col_valid_range(w_offset, stride, pad, width, width_col, &start, &end);
+        for (h = 0; h < height_col; ++h) {
+            int im_row = h_offset + h*stride - pad;
+            int8_t *dst = col + h*width_col;
+            if (im_row < 0 || im_row >= height) {
+                memset(dst, 0, width_col);
+                continue;
+            }
+            int8_t *src = im + im_row*width + w_offset - pad;
+            memset(dst, 0, start);
+            if (stride == 1) {
+                memcpy(dst + start, src + start, end - start);
+            } else {
+                for (w = start; w < end; ++w) dst[w] = src[w*stride];
+            }
+            memset(dst + end, 0, width_col - end);
+        }
+    }
+}
+
+// Channel-last layout: one row of channels*ksize*ksize values per output
+// pixel, i.e. the transpose of im2col_cpu, for use with gemm(0,1,...).
+void im2row_cpu(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad, float* data_row) 
+{
+    int height_col = (height + 2*pad - ksize) / stride + 1;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+    int channels_col = channels * ksize * ksize;
+    int h;
+    #pragma omp parallel for
+    for (h = 0; h < height_col; ++h) {
+        int c, kh, kw, w;
+        for (kh = 0; kh < ksize; ++kh) {
+            int im_row = kh + h*stride - pad;
+            for (kw = 0; kw < ksize; ++kw) {
+                int start, end;
+                im2col_valid_range(kw, stride, pad, width, width_col, &start, &end);
+                for (c = 0; c < channels; ++c) {
+                    int c_col = (c*ksize + kh)*ksize + kw;
+                    float *dst = data_row + (size_t)h*width_col*channels_col + c_col;
+                    if (im_row < 0 || im_row >= height) {
+                        for (w = 0; w < width_col; ++w) dst[w*channels_col] = 0;
+                        continue;
+                    }
+                    float *src = data_im + (c*height + im_row)*width + kw - pad;
+                    for (w = 0; w < start; ++w) dst[w*channels_col] = 0;
+                    for (w = start; w < end; ++w) dst[w*channels_col] = src[w*stride];
+                    for (w = end; w < width_col; ++w) dst[w*channels_col] = 0;
+                }
+            }
+        }
+    }
+}
+
+static void time_im2col_layer(int c, int h, int w, int ksize, int stride, int n)
+{
+    int pad = ksize/2;
+    int height_col = (h + 2*pad - ksize)/stride + 1;
+    int width_col = (w + 2*pad - ksize)/stride + 1;
+    int k = c*ksize*ksize;
+    int p = height_col*width_col;
+    float *im = random_matrix(c, h*w);
+    float *ref = calloc((size_t)k*p, sizeof(float));
+    float *col = calloc((size_t)k*p, sizeof(float));
+    float *row = calloc((size_t)k*p, sizeof(float));
+    float *a = random_matrix(n, k);
+    float *c0 = calloc((size_t)n*p, sizeof(float));
+    float *c1 = calloc((size_t)n*p, sizeof(float));
+    int i, j, iters = 5;
+
+    double start = what_time_is_it_now();
+    for(i = 0; i < iters; ++i) im2col_cpu_naive(im, c, h, w, ksize, stride, pad, ref);
+    double naive = (what_time_is_it_now() - start)/iters;
+    start = what_time_is_it_now();
+    for(i = 0; i < iters; ++i) im2col_cpu(im, c, h, w, ksize, stride, pad, col);
+    double tiled = (what_time_is_it_now() - start)/iters;
+    start = what_time_is_it_now();
+    for(i = 0; i < iters; ++i) im2row_cpu(im, c, h, w, ksize, stride, pad, row);
+    double rows = (what_time_is_it_now() - start)/iters;
+
+    int mismatch = 0;
+    for(i = 0; i < k; ++i){
+        for(j = 0; j < p; ++j){
+            if(col[i*p + j] != ref[i*p + j]) ++mismatch;
+            if(row[(size_t)j*k + i] != ref[i*p + j]) ++mismatch;
+        }
+    }
+
+    start = what_time_is_it_now();
+    gemm_cpu(0,0,n,p,k,1,a,k,col,p,0,c0,p);
+    double gemm_col = what_time_is_it_now() - start;
+    start = what_time_is_it_now();
+    gemm_cpu(0,1,n,p,k,1,a,k,row,k,0,c1,p);
+    double gemm_row = what_time_is_it_now() - start;
+
+    printf("%4d x%4d x%4d %dx%d/%d: naive %7.2f ms, tiled %7.2f ms (%5.2fx), rows %7.2f ms | gemm col %7.2f ms, row %7.2f ms%s\n",
+            w, h, c, ksize, ksize, stride, naive*1000, tiled*1000, naive/tiled, rows*1000,
+            gemm_col*1000, gemm_row*1000, mismatch ? " MISMATCH" : "");
+
+    free(im);
+    free(ref);
+    free(col);
+    free(row);
+    free(a);
+    free(c0);
+    free(c1);
+}
+
+void test_im2col()
+{
+    // 3x3 layer shapes from yolov3-416: c, h, w, size, stride, filters
+    time_im2col_layer(3, 416, 416, 3, 1, 32);
+    time_im2col_layer(32, 416, 416, 3, 2, 64);
+    time_im2col_layer(32, 208, 208, 3, 1, 64);
+    time_im2col_layer(64, 208, 208, 3, 2, 128);
+    time_im2col_layer(64, 104, 104, 3, 1, 128);
+    time_im2col_layer(128, 104, 104, 3, 2, 256);
+    time_im2col_layer(128, 52, 52, 3, 1, 256);
+    time_im2col_layer(256, 52, 52, 3, 2, 512);
+    time_im2col_layer(256, 26, 26, 3, 1, 512);
+    time_im2col_layer(512, 26, 26, 3, 2, 1024);
+    time_im2col_layer(512, 13, 13, 3, 1, 1024);
+}
@@ -789,16 +789,218 @@ void place_image(image im, int w, int h, int dx, int dy, image canvas)
     }
 }
 
-image center_crop_image(image im, int w, int h)
+// warp_pixels for maps without rotation, where a tap's column only depends
+// on x and its row only on y, so both are worked out once per image
+static void warp_pixels_axes(float *data, unsigned char *bytes, int sw, int sh, int sc, image dst, float *m, int flip, int x0, int y0, int x1, int y1, float fill)
+{
+    int x, y, k;
+    int *left = calloc(2*dst.w, sizeof(int));
+    int *right = left + dst.w;
+    float *wl = calloc(3*dst.w, sizeof(float));
+    float *wr = wl + dst.w;
+    float *inside = wr + dst.w;
+    size_t plane = (size_t)sw*sh;
+    size_t out_plane = (size_t)dst.w*dst.h;
+    // Bytes are interleaved and scaled to [0, 1] through the weights
+    int step = bytes ? sc : 1;
+    float norm = bytes ? 1.f/255.f : 1.f;
+    for(x = 0; x < dst.w; ++x){
+        int px = flip ? dst.w - 1 - x : x;
+        float sx = fminf(fmaxf(m[0]*px + m[2], -2), sw + 1);
+        int ix = floorf(sx);
+        float dx = sx - ix;
+        inside[x] = px >= x0 && px < x1;
+        wl[x] = (1-dx)*inside[x]*(ix >= 0 && ix < sw);
+        wr[x] = dx*inside[x]*(ix >= -1 && ix + 1 < sw);
+        left[x] = (ix < 0 ? 0 : (ix >= sw ? sw - 1 : ix))*step;
+        right[x] = (ix + 1 < 0 ? 0 : (ix + 1 >= sw ? sw - 1 : ix + 1))*step;
+    }
+    for(y = 0; y < dst.h; ++y){
+        float sy = fminf(fmaxf(m[4]*y + m[5], -2), sh + 1);
+        int iy = floorf(sy);
+        float dy = sy - iy;
+        float row_inside = y >= y0 && y < y1;
+        float wt = (1-dy)*row_inside*(iy >= 0 && iy < sh)*norm;
+        float wb = dy*row_inside*(iy >= -1 && iy + 1 < sh)*norm;
+        int t = iy < 0 ? 0 : (iy >= sh ? sh - 1 : iy);
+        int b = iy + 1 < 0 ? 0 : (iy + 1 >= sh ? sh - 1 : iy + 1);
+        for(k = 0; k < dst.c; ++k){
+            float *out = dst.data + k*out_plane + (size_t)y*dst.w;
+            if(!row_inside || k >= sc){
+                for(x = 0; x < dst.w; ++x) out[x] = row_inside ? (1 - inside[x])*fill : fill;
+                continue;
+            }
+            if(bytes){
+                unsigned char *top = bytes + (size_t)t*sw*sc + k;
+                unsigned char *bottom = bytes + (size_t)b*sw*sc + k;
+                for(x = 0; x < dst.w; ++x){
+                    out[x] = wt*(wl[x]*top[left[x]] + wr[x]*top[right[x]])
+                        + wb*(wl[x]*bottom[left[x]] + wr[x]*bottom[right[x]])
+                        + (1 - inside[x])*fill;
+                }
+                continue;
+            }
+            float *top = data + k*plane + (size_t)t*sw;
+            float *bottom = data + k*plane + (size_t)b*sw;
+            for(x = 0; x < dst.w; ++x){
+                out[x] = wt*(wl[x]*top[left[x]] + wr[x]*top[right[x]])
+                    + wb*(wl[x]*bottom[left[x]] + wr[x]*bottom[right[x]])
+                    + (1 - inside[x])*fill;
+            }
+        }
+    }
+    free(left);
+    free(wl);
+}
+
+// warp_image from either sw x sh x sc float planes in data or interleaved
+// bytes scaled to [0, 1], so packed images need no float copy of their own
+#define WARP_CHUNK 256
+static void warp_pixels(float *data, unsigned char *bytes, int sw, int sh, int sc, image dst, float *m, int flip, int x0, int y0, int x1, int y1, float fill)
+{
+    int x, y, k, i;
+    int offset[4][WARP_CHUNK];
+    float weight[4][WARP_CHUNK];
+    float outside[WARP_CHUNK];
+    size_t plane = (size_t)sw*sh;
+    size_t out_plane = (size_t)dst.w*dst.h;
+    int step = bytes ? sc : 1;
+    float norm = bytes ? 1.f/255.f : 1.f;
+    if(m[1] == 0 && m[3] == 0){
+        warp_pixels_axes(data, bytes, sw, sh, sc, dst, m, flip, x0, y0, x1, y1, fill);
+        return;
+    }
+    for(y = 0; y < dst.h; ++y){
+        for(x = 0; x < dst.w; x += WARP_CHUNK){
+            int n = (dst.w - x < WARP_CHUNK) ? dst.w - x : WARP_CHUNK;
+            // Taps and weights are worked out once for all channels. Taps
+            // outside src read a pixel on its border with weight 0.
+            for(i = 0; i < n; ++i){
+                int px = flip ? dst.w - 1 - x - i : x + i;
+                float inside = px >= x0 && px < x1 && y >= y0 && y < y1;
+                float sx = fminf(fmaxf(m[0]*px + m[1]*y + m[2], -2), sw + 1);
+                float sy = fminf(fmaxf(m[3]*px + m[4]*y + m[5], -2), sh + 1);
+                float fx = floorf(sx);
+                float fy = floorf(sy);
+                int ix = fx;
+                int iy = fy;
+                float dx = sx - fx;
+                float dy = sy - fy;
+                float left = inside*(ix >= 0 && ix < sw)*norm;
+                float right = inside*(ix >= -1 && ix + 1 < sw)*norm;
+                float top = iy >= 0 && iy < sh;
+                float bottom = iy >= -1 && iy + 1 < sh;
+                int l = ix < 0 ? 0 : (ix >= sw ? sw - 1 : ix);
+                int r = ix + 1 < 0 ? 0 : (ix + 1 >= sw ? sw - 1 : ix + 1);
+                int t = iy < 0 ? 0 : (iy >= sh ? sh - 1 : iy);
+                int b = iy + 1 < 0 ? 0 : (iy + 1 >= sh ? sh - 1 : iy + 1);
+                offset[0][i] = (t*sw + l)*step;
+                offset[1][i] = (b*sw + l)*step;
+                offset[2][i] = (t*sw + r)*step;
+                offset[3][i] = (b*sw + r)*step;
+                weight[0][i] = (1-dy)*(1-dx)*top*left;
+                weight[1][i] = dy*(1-dx)*bottom*left;
+                weight[2][i] = (1-dy)*dx*top*right;
+                weight[3][i] = dy*dx*bottom*right;
+                outside[i] = inside ? 0 : fill;
+            }
+            for(k = 0; k < dst.c; ++k){
+                float *out = dst.data + k*out_plane + (size_t)y*dst.w + x;
+                if(k >= sc){
+                    for(i = 0; i < n; ++i) out[i] = outside[i];
+                    continue;
+                }
+                if(bytes){
+                    unsigned char *s = bytes + k;
+                    for(i = 0; i < n; ++i){
+                        out[i] = weight[0][i]*s[offset[0][i]] + weight[1][i]*s[offset[1][i]]
+                            + weight[2][i]*s[offset[2][i]] + weight[3][i]*s[offset[3][i]] + outside[i];
+                    }
+                    continue;
+                }
+                float *s = data + k*plane;
+                for(i = 0; i < n; ++i){
+                    out[i] = weight[0][i]*s[offset[0][i]] + weight[1][i]*s[offset[1][i]]
+                        + weight[2][i]*s[offset[2][i]] + weight[3][i]*s[offset[3][i]] + outside[i];
+                }
+            }
+        }
+    }
+}
+
+// Resamples src into dst in one pass: output pixel (x, y), mirrored to
+// (dst.w-1-x, y) first when flip is set, is src read bilinearly at
+// (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5]), where src is 0 outside
+// its bounds like get_pixel_extend. Output pixels outside [x0, x1) x [y0, y1)
+// are set to fill instead.
+void warp_image(image src, image dst, float *m, int flip, int x0, int y0, int x1, int y1, float fill)
 {
-    int m = (im.w < im.h) ? im.w : im.h;   
-    image c = crop_image(im, (im.w - m) / 2, (im.h - m)/2, m, m);
-    image r = resize_image(c, w, h);
-    free_image(c);
-    return r;
+    warp_pixels(src.data, 0, src.w, src.h, src.c, dst, m, flip, x0, y0, x1, y1, fill);
 }
 
-image rotate_crop_image(image im, float rad, float s, int w, int h, float dx, float dy, float aspect)
+static void place_matrix(int sw, int sh, int w, int h, int dx, int dy, float *m)
+{
+    if(w > 0 && h > 0){
+        m[0] = (float)sw / w;
+        m[2] = -dx*m[0];
+        m[4] = (float)sh / h;
+        m[5] = -dy*m[4];
+    }
+}
+
+// Fills canvas with fill and places im on it scaled to w x h at (dx, dy),
+// then mirrors it when flip is set, all in one pass
+void place_image_flip(image im, int w, int h, int dx, int dy, int flip, float fill, image canvas)
+{
+    float m[6] = {0};
+    place_matrix(im.w, im.h, w, h, dx, dy, m);
+    warp_pixels(im.data, 0, im.w, im.h, im.c, canvas, m, flip, dx, dy, dx + w, dy + h, fill);
+}
+
+// place_image_flip from interleaved bytes (sw x sh x sc), as stbi_load and
+// the dataset shards store them
+void place_bytes_flip(unsigned char *data, int sw, int sh, int sc, int w, int h, int dx, int dy, int flip, float fill, image canvas)
+{
+    float m[6] = {0};
+    place_matrix(sw, sh, w, h, dx, dy, m);
+    warp_pixels(0, data, sw, sh, sc, canvas, m, flip, dx, dy, dx + w, dy + h, fill);
+}
+
+static void augment_matrix(int sw, int sh, augment_args a, float *m)
+{
+    double c = cos(a.rad);
+    double s = sin(a.rad);
+    double sx = a.aspect/a.scale;
+    double sy = 1./a.scale;
+    double ox = (a.dx - a.w/2.)*sx;
+    double oy = (a.dy - a.h/2.)*sy;
+    m[0] = c*sx;
+    m[1] = -s*sy;
+    m[2] = c*ox - s*oy + sw/2.;
+    m[3] = s*sx;
+    m[4] = c*sy;
+    m[5] = s*ox + c*oy + sh/2.;
+}
+
+// The crop of rotate_crop_image with the arguments in a, mirrored when flip
+// is set, written into out (a.w x a.h)
+void augment_image_into(image im, augment_args a, int flip, image out)
+{
+    float m[6];
+    augment_matrix(im.w, im.h, a, m);
+    warp_pixels(im.data, 0, im.w, im.h, im.c, out, m, flip, 0, 0, out.w, out.h, 0);
+}
+
+// augment_image_into from interleaved bytes (sw x sh x sc)
+void augment_bytes_into(unsigned char *data, int sw, int sh, int sc, augment_args a, int flip, image out)
+{
+    float m[6];
+    augment_matrix(sw, sh, a, m);
+    warp_pixels(0, data, sw, sh, sc, out, m, flip, 0, 0, out.w, out.h, 0);
+}
+
+// rotate_crop_image one pixel and channel at a time, for test_warp_image
+static image rotate_crop_image_pixels(image im, float rad, float s, int w, int h, float dx, float dy, float aspect)
 {
     int x, y, c;
     float cx = im.w/2.;
@@ -817,6 +1019,30 @@ image rotate_crop_image(image im, float rad, float s, int w, int h, float dx, fl
     return rot;
 }
 
+image center_crop_image(image im, int w, int h)
+{
+    int m = (im.w < im.h) ? im.w : im.h;   
+    image c = crop_image(im, (im.w - m) / 2, (im.h - m)/2, m, m);
+    image r = resize_image(c, w, h);
+    free_image(c);
+    return r;
+}
+
+image rotate_crop_image(image im, float rad, float s, int w, int h, float dx, float dy, float aspect)
+{
+    augment_args a = {0};
+    a.rad = rad;
+    a.scale = s;
+    a.w = w;
+    a.h = h;
+    a.dx = dx;
+    a.dy = dy;
+    a.aspect = aspect;
+    image rot = make_image(w, h, im.c);
+    augment_image_into(im, a, 0, rot);
+    return rot;
+}
+
 image rotate_image(image im, float rad)
 {
     int x, y, c;
@@ -941,40 +1167,133 @@ void composite_3d(char *f1, char *f2, char *out, int delta)
 #endif
 }
 
-void letterbox_image_into(image im, int w, int h, image boxed)
+// Where a source image of sw x sh lands when letterboxed into w x h: scaled
+// to new_w x new_h, keeping its aspect ratio, with its top left at (dx, dy)
+static void letterbox_geometry(int sw, int sh, int w, int h, int *new_w, int *new_h, int *dx, int *dy)
 {
-    int new_w = im.w;
-    int new_h = im.h;
-    if (((float)w/im.w) < ((float)h/im.h)) {
-        new_w = w;
-        new_h = (im.h * w)/im.w;
+    *new_w = sw;
+    *new_h = sh;
+    if (((float)w/sw) < ((float)h/sh)) {
+        *new_w = w;
+        *new_h = (sh * w)/sw;
     } else {
-        new_h = h;
-        new_w = (im.w * h)/im.h;
+        *new_h = h;
+        *new_w = (sw * h)/sh;
     }
-    image resized = resize_image(im, new_w, new_h);
-    embed_image(resized, boxed, (w-new_w)/2, (h-new_h)/2); 
-    free_image(resized);
+    *dx = (w - *new_w)/2;
+    *dy = (h - *new_h)/2;
 }
 
-image letterbox_image(image im, int w, int h)
+// Sets everything of the w x h x c canvas outside the letterboxed window to .5
+static void fill_letterbox_border(float *boxed, int w, int h, int c, int new_w, int new_h, int dx, int dy)
 {
-    int new_w = im.w;
-    int new_h = im.h;
-    if (((float)w/im.w) < ((float)h/im.h)) {
-        new_w = w;
-        new_h = (im.h * w)/im.w;
-    } else {
-        new_h = h;
-        new_w = (im.w * h)/im.h;
+    int k, y, x;
+    for(k = 0; k < c; ++k){
+        float *plane = boxed + (size_t)k*w*h;
+        for(y = 0; y < h; ++y){
+            float *row = plane + (size_t)y*w;
+            if(y < dy || y >= dy + new_h){
+                for(x = 0; x < w; ++x) row[x] = .5;
+                continue;
+            }
+            for(x = 0; x < dx; ++x) row[x] = .5;
+            for(x = dx + new_w; x < w; ++x) row[x] = .5;
+        }
+    }
+}
+
+// Same sampling grid as resize_image: output pixel x reads source column
+// x*(sw-1)/(new_w-1), so the first and last columns line up exactly
+static float letterbox_scale(int from, int to)
+{
+    return to > 1 ? (float)(from - 1) / (to - 1) : 0;
+}
+
+// Bilinear letterbox of a uint8 HWC buffer, as decoded by stb_image, straight
+// into a normalized (/255) CHW canvas of w x h x c floats. No intermediate
+// image is built: every output value is interpolated from the four source
+// bytes around it, and the loops are free of branches and bounds checks.
+void letterbox_bytes_into(unsigned char *data, int sw, int sh, int c, int w, int h, float *boxed)
+{
+    int new_w, new_h, dx, dy;
+    int k, y, x;
+    letterbox_geometry(sw, sh, w, h, &new_w, &new_h, &dx, &dy);
+    fill_letterbox_border(boxed, w, h, c, new_w, new_h, dx, dy);
+
+    float w_scale = letterbox_scale(sw, new_w);
+    float h_scale = letterbox_scale(sh, new_h);
+    int step = sw > 1 ? c : 0;
+    float norm = 1.f/255.f;
+    for(k = 0; k < c; ++k){
+        for(y = 0; y < new_h; ++y){
+            float sy = y*h_scale;
+            int iy = (int) sy;
+            float fy = sy - iy;
+            if(y == new_h - 1 || sh == 1){
+                iy = sh - 1;
+                fy = 0;
+            }
+            int iy1 = iy + (iy < sh - 1);
+            unsigned char *row0 = data + (size_t)iy*sw*c + k;
+            unsigned char *row1 = data + (size_t)iy1*sw*c + k;
+            float *out = boxed + (size_t)k*w*h + (size_t)(dy + y)*w + dx;
+            for(x = 0; x < new_w - 1; ++x){
+                float sx = x*w_scale;
+                int ix = (int) sx;
+                float fx = sx - ix;
+                int i = ix*c;
+                float top = (1 - fx)*row0[i] + fx*row0[i + step];
+                float bot = (1 - fx)*row1[i] + fx*row1[i + step];
+                out[x] = ((1 - fy)*top + fy*bot)*norm;
+            }
+            out[new_w - 1] = ((1 - fy)*row0[(sw - 1)*c] + fy*row1[(sw - 1)*c])*norm;
+        }
+    }
+}
+
+// Letterboxes im into boxed (w x h x im.c), including the .5 border, with
+// the same fused interpolation as letterbox_bytes_into
+void letterbox_image_into(image im, int w, int h, image boxed)
+{
+    int new_w, new_h, dx, dy;
+    int k, y, x;
+    letterbox_geometry(im.w, im.h, w, h, &new_w, &new_h, &dx, &dy);
+    fill_letterbox_border(boxed.data, w, h, im.c, new_w, new_h, dx, dy);
+
+    float w_scale = letterbox_scale(im.w, new_w);
+    float h_scale = letterbox_scale(im.h, new_h);
+    int step = im.w > 1;
+    for(k = 0; k < im.c; ++k){
+        float *plane = im.data + (size_t)k*im.w*im.h;
+        for(y = 0; y < new_h; ++y){
+            float sy = y*h_scale;
+            int iy = (int) sy;
+            float fy = sy - iy;
+            if(y == new_h - 1 || im.h == 1){
+                iy = im.h - 1;
+                fy = 0;
+            }
+            int iy1 = iy + (iy < im.h - 1);
+            float *row0 = plane + (size_t)iy*im.w;
+            float *row1 = plane + (size_t)iy1*im.w;
+            float *out = boxed.data + (size_t)k*w*h + (size_t)(dy + y)*w + dx;
+            for(x = 0; x < new_w - 1; ++x){
+                float sx = x*w_scale;
+                int ix = (int) sx;
+                float fx = sx - ix;
+                float top = (1 - fx)*row0[ix] + fx*row0[ix + step];
+                float bot = (1 - fx)*row1[ix] + fx*row1[ix + step];
+                out[x] = (1 - fy)*top + fy*bot;
+            }
+            out[new_w - 1] = (1 - fy)*row0[im.w - 1] + fy*row1[im.w - 1];
+        }
     }
-    image resized = resize_image(im, new_w, new_h);
+}
+
+image letterbox_image(image im, int w, int h)
+{
     image boxed = make_image(w, h, im.c);
-    fill_image(boxed, .5);
-    //int i;
-    //for(i = 0; i < boxed.w*boxed.h*boxed.c; ++i) boxed.data[i] = 0;
-    embed_image(resized, boxed, (w-new_w)/2, (h-new_h)/2); 
-    free_image(resized);
+    letterbox_image_into(im, w, h, boxed);
     return boxed;
 }
 
@@ -1312,7 +1631,9 @@ void exposure_image(image im, float sat)
     constrain_image(im);
 }
 
-void distort_image(image im, float hue, float sat, float val)
+// distort_image as a round trip through a full HSV image, kept to check the
+// fused version against
+static void distort_image_hsv(image im, float hue, float sat, float val)
 {
     rgb_to_hsv(im);
     scale_image_channel(im, 1, sat);
@@ -1327,6 +1648,54 @@ void distort_image(image im, float hue, float sat, float val)
     constrain_image(im);
 }
 
+// Channel n of hsv_to_rgb without the sector switch: v - v*s*clamp(k, 0, 1)
+// with k = min(x, 4 - x) and x = (n + 6h) mod 6, clamped to [0, 1]
+static inline float hsv_channel(float n, float h6, float s, float v)
+{
+    float x = n + h6;
+    x = x >= 6 ? x - 6 : x;
+    float k = fmaxf(fminf(fminf(x, 4 - x), 1), 0);
+    return fmaxf(fminf(v - v*s*k, 1), 0);
+}
+
+// Shifts the hue of every pixel by hue and scales its saturation by sat and
+// its value by val, in one branch free pass over the three planes
+void distort_image(image im, float hue, float sat, float val)
+{
+    int i;
+    if(im.c != 3){
+        distort_image_hsv(im, hue, sat, val);
+        return;
+    }
+    int n = im.w*im.h;
+    float *red = im.data;
+    float *green = im.data + n;
+    float *blue = im.data + 2*n;
+    for(i = 0; i < n; ++i){
+        float r = red[i];
+        float g = green[i];
+        float b = blue[i];
+        float max = fmaxf(fmaxf(r, g), b);
+        float min = fminf(fminf(r, g), b);
+        float delta = max - min;
+        float inv = delta > 0 ? 1/delta : 0;
+        float h = (r == max) ? (g - b)*inv : (g == max) ? 2 + (b - r)*inv : 4 + (r - g)*inv;
+        h = h < 0 ? h + 6 : h;
+        float s = max > 0 ? delta/max : 0;
+
+        h = h/6 + hue;
+        h = h > 1 ? h - 1 : h;
+        h = h < 0 ? h + 1 : h;
+        s *= sat;
+        float v = max*val;
+
+        float h6 = 6*h;
+        red[i] = hsv_channel(5, h6, s, v);
+        green[i] = hsv_channel(3, h6, s, v);
+        blue[i] = hsv_channel(1, h6, s, v);
+    }
+}
+
 void random_distort_image(image im, float hue, float saturation, float exposure)
 {
     float dhue = rand_uniform(-hue, hue);
@@ -1337,11 +1706,106 @@ void random_distort_image(image im, float hue, float saturation, float exposure)
 
 void saturate_exposure_image(image im, float sat, float exposure)
 {
-    rgb_to_hsv(im);
-    scale_image_channel(im, 1, sat);
-    scale_image_channel(im, 2, exposure);
-    hsv_to_rgb(im);
-    constrain_image(im);
+    distort_image(im, 0, sat, exposure);
+}
+
+// Times distort_image against the HSV round trip on random w x h images and
+// jitter as random_distort_image draws it, and reports the largest
+// difference
+void test_distort_image(int w, int h, float hue, float saturation, float exposure, int runs)
+{
+    int i, j;
+    double start, fused = 0, round_trip = 0;
+    float err = 0;
+    image input = make_image(w, h, 3);
+    image a = make_image(w, h, 3);
+    image b = make_image(w, h, 3);
+    for(i = 0; i < runs; ++i){
+        for(j = 0; j < w*h*3; ++j) input.data[j] = rand_uniform(0, 1);
+        // Some grey and black pixels, where hue is undefined
+        for(j = 0; j < w*h; j += 97){
+            input.data[j + w*h] = input.data[j + 2*w*h] = input.data[j];
+            if(j % 3 == 0) input.data[j] = input.data[j + w*h] = input.data[j + 2*w*h] = 0;
+        }
+        float dhue = rand_uniform(-hue, hue);
+        float dsat = rand_scale(saturation);
+        float dexp = rand_scale(exposure);
+        copy_image_into(input, a);
+        copy_image_into(input, b);
+
+        start = what_time_is_it_now();
+        distort_image_hsv(a, dhue, dsat, dexp);
+        round_trip += what_time_is_it_now() - start;
+
+        start = what_time_is_it_now();
+        distort_image(b, dhue, dsat, dexp);
+        fused += what_time_is_it_now() - start;
+
+        for(j = 0; j < w*h*3; ++j) err = fmaxf(err, fabsf(a.data[j] - b.data[j]));
+    }
+    // The fused pass only reorders float operations, so it agrees with the
+    // round trip to within a few ulps of the [0, 1] pixel range
+    printf("%dx%d, hue %.2f saturation %.2f exposure %.2f: HSV round trip %.3f ms, fused %.3f ms (%.1fx), max difference %.2e%s\n",
+            w, h, hue, saturation, exposure, round_trip*1000/runs, fused*1000/runs, round_trip/fused, err,
+            err > 1e-5 ? " MISMATCH" : "");
+    free_image(input);
+    free_image(a);
+    free_image(b);
+}
+
+// Times the fused warps against the passes they replace on a w x h source:
+// placing it in a w x h canvas as the detector does, and a rotated crop of
+// w x w as the classifier does, both flipped
+void test_warp_image(int w, int h, int runs)
+{
+    int i, j;
+    double start, place = 0, fused_place = 0, crop = 0, fused_crop = 0;
+    float place_err = 0, crop_err = 0;
+    image input = make_image(w, h, 3);
+    image a = make_image(w, h, 3);
+    image b = make_image(w, h, 3);
+    image fused = make_image(w, w, 3);
+    for(i = 0; i < runs; ++i){
+        for(j = 0; j < w*h*3; ++j) input.data[j] = rand_uniform(0, 1);
+        float scale = rand_uniform(.25, 2);
+        int nw = scale*w*rand_scale(1.3);
+        int nh = scale*h;
+        int dx = rand_uniform(0, w - nw);
+        int dy = rand_uniform(0, h - nh);
+
+        start = what_time_is_it_now();
+        fill_image(a, .5);
+        place_image(input, nw, nh, dx, dy, a);
+        flip_image(a);
+        place += what_time_is_it_now() - start;
+
+        start = what_time_is_it_now();
+        place_image_flip(input, nw, nh, dx, dy, 1, .5, b);
+        fused_place += what_time_is_it_now() - start;
+
+        for(j = 0; j < w*h*3; ++j) place_err = fmaxf(place_err, fabsf(a.data[j] - b.data[j]));
+
+        augment_args args = random_augment_args(input, 7, 1.15, w/2, w, w, w);
+        start = what_time_is_it_now();
+        image rot = rotate_crop_image_pixels(input, args.rad, args.scale, args.w, args.h, args.dx, args.dy, args.aspect);
+        flip_image(rot);
+        crop += what_time_is_it_now() - start;
+
+        start = what_time_is_it_now();
+        augment_image_into(input, args, 1, fused);
+        fused_crop += what_time_is_it_now() - start;
+
+        for(j = 0; j < w*w*3; ++j) crop_err = fmaxf(crop_err, fabsf(rot.data[j] - fused.data[j]));
+        free_image(rot);
+    }
+    printf("%dx%d placed: fill, place and flip %.3f ms, fused %.3f ms (%.1fx), max difference %.2e\n",
+            w, h, place*1000/runs, fused_place*1000/runs, place/fused_place, place_err);
+    printf("%dx%d rotated crop: crop and flip %.3f ms, fused %.3f ms (%.1fx), max difference %.2e\n",
+            w, w, crop*1000/runs, fused_crop*1000/runs, crop/fused_crop, crop_err);
+    free_image(input);
+    free_image(a);
+    free_image(b);
+    free_image(fused);
 }
 
 image resize_image(image im, int w, int h)
@@ -1439,6 +1903,20 @@ void test_resize(char *filename)
 }
 
 
+// Decoded uint8 HWC pixels to a float CHW image in [0, 1]
+image bytes_to_image(unsigned char *data, int w, int h, int c)
+{
+    int i, k;
+    float norm = 1.f/255.f;
+    image im = make_image(w, h, c);
+    for(k = 0; k < c; ++k){
+        float *plane = im.data + (size_t)k*w*h;
+        unsigned char *src = data + k;
+        for(i = 0; i < w*h; ++i) plane[i] = src[i*c]*norm;
+    }
+    return im;
+}
+
 image load_image_stb(char *filename, int channels)
 {
     int w, h, c;
@@ -1448,21 +1926,63 @@ image load_image_stb(char *filename, int channels)
         exit(0);
     }
     if(channels) c = channels;
-    int i,j,k;
-    image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
-        }
+    image im = bytes_to_image(data, w, h, c);
+    free(data);
+    return im;
+}
+
+image load_image_from_memory(unsigned char *buf, int len, int channels)
+{
+    int w, h, c;
+    unsigned char *data = stbi_load_from_memory(buf, len, &w, &h, &c, channels);
+    if (!data) {
+        fprintf(stderr, "Cannot decode image\nSTB Reason: %s\n", stbi_failure_reason());
+        return make_empty_image(0, 0, 0);
     }
+    if(channels) c = channels;
+    image im = bytes_to_image(data, w, h, c);
     free(data);
     return im;
 }
 
+typedef struct {
+    unsigned char *data;
+    int size;
+    int capacity;
+} jpg_buffer;
+
+static void append_jpg_data(void *context, void *data, int size)
+{
+    jpg_buffer *b = context;
+    if(b->size + size > b->capacity){
+        b->capacity = 2*(b->size + size);
+        b->data = realloc(b->data, b->capacity);
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+unsigned char *encode_image_jpg(image im, int quality, int *size)
+{
+    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
+    int i,k;
+    for(k = 0; k < im.c; ++k){
+        for(i = 0; i < im.w*im.h; ++i){
+            data[i*im.c+k] = (unsigned char) (255*constrain(0, 1, im.data[i + k*im.w*im.h]) + .5);
+        }
+    }
+    jpg_buffer b = {0};
+    int success = stbi_write_jpg_to_func(append_jpg_data, &b, im.w, im.h, im.c, data, quality);
+    free(data);
+    if(!success){
+        free(b.data);
+        b.data = 0;
+        b.size = 0;
+    }
+    *size = b.size;
+    return b.data;
+}
+
 image load_image(char *filename, int w, int h, int c)
 {
 #ifdef OPENCV
@@ -1479,6 +1999,23 @@ image load_image(char *filename, int w, int h, int c)
     return out;
 }
 
+// Decodes filename and letterboxes it straight into boxed (w x h x c
+// floats) without going through an intermediate float image. Returns the
+// unresized image as well, e.g. for drawing detections on.
+image load_image_letterbox(char *filename, int w, int h, int c, float *boxed)
+{
+    int sw, sh, sc;
+    unsigned char *data = stbi_load(filename, &sw, &sh, &sc, c);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n", filename, stbi_failure_reason());
+        exit(0);
+    }
+    letterbox_bytes_into(data, sw, sh, c, w, h, boxed);
+    image im = bytes_to_image(data, sw, sh, c);
+    free(data);
+    return im;
+}
+
 image load_image_color(char *filename, int w, int h)
 {
     return load_image(filename, w, h, 3);
@@ -29,11 +29,16 @@ image rotate_crop_image(image im, float rad, float s, int w, int h, float dx, fl
 image random_crop_image(image im, int w, int h);
 image random_augment_image(image im, float angle, float aspect, int low, int high, int w, int h);
 augment_args random_augment_args(image im, float angle, float aspect, int low, int high, int w, int h);
-void letterbox_image_into(image im, int w, int h, image boxed);
 image resize_max(image im, int max);
 void translate_image(image m, float s);
 void embed_image(image source, image dest, int dx, int dy);
 void place_image(image im, int w, int h, int dx, int dy, image canvas);
+void place_image_flip(image im, int w, int h, int dx, int dy, int flip, float fill, image canvas);
+void place_bytes_flip(unsigned char *data, int sw, int sh, int sc, int w, int h, int dx, int dy, int flip, float fill, image canvas);
+void warp_image(image src, image dst, float *m, int flip, int x0, int y0, int x1, int y1, float fill);
+void augment_image_into(image im, augment_args a, int flip, image out);
+void augment_bytes_into(unsigned char *data, int sw, int sh, int sc, augment_args a, int flip, image out);
+image bytes_to_image(unsigned char *data, int w, int h, int c);
 void saturate_image(image im, float sat);
 void exposure_image(image im, float sat);
 void distort_image(image im, float hue, float sat, float val);
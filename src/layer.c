@@ -12,6 +12,12 @@ void free_layer(layer l)
 #endif
         return;
     }
+    if(l.shared){
+        // Parameters belong to the network this layer was replicated from
+        l.biases = l.scales = l.weights = l.packed_weights = l.weight_scales = 0;
+        l.rolling_mean = l.rolling_variance = 0;
+        l.qweights = 0;
+    }
     if(l.cweights)           free(l.cweights);
     if(l.indexes)            free(l.indexes);
     if(l.input_layers)       free(l.input_layers);
@@ -33,6 +39,9 @@ void free_layer(layer l)
     if(l.scale_updates)      free(l.scale_updates);
     if(l.weights)            free(l.weights);
     if(l.weight_updates)     free(l.weight_updates);
+    if(l.packed_weights)     free(l.packed_weights);
+    if(l.weight_scales)      free(l.weight_scales);
+    if(l.qweights)           free(l.qweights);
     if(l.delta)              free(l.delta);
     if(l.output)             free(l.output);
     if(l.squared)            free(l.squared);
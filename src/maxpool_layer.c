@@ -76,9 +76,66 @@ void resize_maxpool_layer(maxpool_layer *l, int w, int h)
     #endif
 }
 
+// 2x2 windows at stride 2 without padding never leave the input, so each
+// output is the max of two pairs of neighbouring inputs
+static void forward_maxpool_layer_2x2(const maxpool_layer l, float *input)
+{
+    int p;
+    #pragma omp parallel for
+    for(p = 0; p < l.batch*l.c; ++p){
+        int i, j;
+        float *in = input + (size_t)p*l.w*l.h;
+        float *out = l.output + (size_t)p*l.out_w*l.out_h;
+        for(i = 0; i < l.out_h; ++i){
+            float *row0 = in + 2*i*l.w;
+            float *row1 = row0 + l.w;
+            float *o = out + i*l.out_w;
+            for(j = 0; j < l.out_w; ++j){
+                float a = row0[2*j] > row0[2*j+1] ? row0[2*j] : row0[2*j+1];
+                float b = row1[2*j] > row1[2*j+1] ? row1[2*j] : row1[2*j+1];
+                o[j] = a > b ? a : b;
+            }
+        }
+    }
+}
+
+// Without backward to feed, the argmax indexes are not needed and every
+// window can be clipped to the input up front
+static void forward_maxpool_layer_inference(const maxpool_layer l, float *input)
+{
+    int p;
+    #pragma omp parallel for
+    for(p = 0; p < l.batch*l.c; ++p){
+        int i, j, m, n;
+        float *in = input + (size_t)p*l.w*l.h;
+        float *out = l.output + (size_t)p*l.out_w*l.out_h;
+        for(i = 0; i < l.out_h; ++i){
+            int top = i*l.stride - l.pad;
+            int n0 = top < 0 ? -top : 0;
+            int n1 = top + l.size > l.h ? l.h - top : l.size;
+            for(j = 0; j < l.out_w; ++j){
+                int left = j*l.stride - l.pad;
+                int m0 = left < 0 ? -left : 0;
+                int m1 = left + l.size > l.w ? l.w - left : l.size;
+                float max = -FLT_MAX;
+                for(n = n0; n < n1; ++n){
+                    float *row = in + (top + n)*l.w + left;
+                    for(m = m0; m < m1; ++m) max = (row[m] > max) ? row[m] : max;
+                }
+                out[i*l.out_w + j] = max;
+            }
+        }
+    }
+}
+
 void forward_maxpool_layer(const maxpool_layer l, network net)
 {
     int b,i,j,k,m,n;
+    if(!net.train){
+        if(l.size == 2 && l.stride == 2 && l.pad == 0) forward_maxpool_layer_2x2(l, net.input);
+        else forward_maxpool_layer_inference(l, net.input);
+        return;
+    }
     int w_offset = -l.pad;
     int h_offset = -l.pad;
 
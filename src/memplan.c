@@ -0,0 +1,234 @@
+#include "memplan.h"
+#include "network.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+// Offsets are kept 64 byte aligned
+#define MEMPLAN_ALIGN 16
+
+typedef struct{
+    size_t size;
+    size_t offset;
+    int first;
+    int last;
+} planned_buffer;
+
+static int plannable_layer(LAYER_TYPE type)
+{
+    return type == CONVOLUTIONAL || type == CONNECTED || type == MAXPOOL || type == AVGPOOL ||
+        type == ROUTE || type == SHORTCUT || type == UPSAMPLE || type == REORG ||
+        type == YOLO || type == REGION || type == DETECTION || type == SOFTMAX ||
+        type == ACTIVE || type == BATCHNORM;
+}
+
+int network_memory_plannable(network *net)
+{
+    int i;
+    if(net->n < 1) return 0;
+    for(i = 0; i < net->n; ++i){
+        if(!plannable_layer(net->layers[i].type)) return 0;
+    }
+    return 1;
+}
+
+// Layer i's output is written at step i and read by layer i+1, by any route
+// or shortcut that names it, and, for detection heads and the final layer,
+// by the caller after the forward pass has finished (last[i] == net->n).
+void network_output_lifetimes(network *net, int *last)
+{
+    int i, j;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        last[i] = i + 1;
+        if(l.type == YOLO || l.type == REGION || l.type == DETECTION) last[i] = net->n;
+    }
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j){
+                int k = l.input_layers[j];
+                if(last[k] < i) last[k] = i;
+            }
+        } else if(l.type == SHORTCUT){
+            if(last[l.index] < i) last[l.index] = i;
+        }
+    }
+}
+
+static void compute_lifetimes(network *net, int batch, planned_buffer *b)
+{
+    int i;
+    int *last = calloc(net->n, sizeof(int));
+    network_output_lifetimes(net, last);
+    for(i = 0; i < net->n; ++i){
+        b[i].size = ((size_t)net->layers[i].outputs*batch + MEMPLAN_ALIGN - 1)/MEMPLAN_ALIGN*MEMPLAN_ALIGN;
+        b[i].offset = 0;
+        b[i].first = i;
+        b[i].last = last[i];
+    }
+    free(last);
+}
+
+// Greedy by size: the largest buffers are placed first, each at the lowest
+// offset that does not collide with a placed buffer alive at the same time.
+static size_t assign_offsets(planned_buffer *b, int n)
+{
+    int *order = calloc(n, sizeof(int));
+    int *placed = calloc(n, sizeof(int));
+    int i, j, k;
+    size_t total = 0;
+    for(i = 0; i < n; ++i) order[i] = i;
+    for(i = 1; i < n; ++i){
+        int o = order[i];
+        for(j = i; j > 0 && b[order[j-1]].size < b[o].size; --j) order[j] = order[j-1];
+        order[j] = o;
+    }
+    for(i = 0; i < n; ++i){
+        planned_buffer *cur = &b[order[i]];
+        size_t offset = 0;
+        int moved = 1;
+        while(moved){
+            moved = 0;
+            for(j = 0; j < i; ++j){
+                planned_buffer *p = &b[placed[j]];
+                if(p->last < cur->first || cur->last < p->first) continue;
+                if(offset < p->offset + p->size && p->offset < offset + cur->size){
+                    offset = p->offset + p->size;
+                    moved = 1;
+                }
+            }
+        }
+        cur->offset = offset;
+        placed[i] = order[i];
+        if(offset + cur->size > total) total = offset + cur->size;
+    }
+    for(k = 0; k < n; ++k) assert(b[k].offset + b[k].size <= total);
+    free(order);
+    free(placed);
+    return total;
+}
+
+// Connected layers do not set nweights
+#define LAYER_WEIGHTS (l->nweights ? (size_t)l->nweights : (size_t)l->inputs*l->outputs)
+
+#define TRAINING_BUFFERS(X) \
+    X(delta, (size_t)l->outputs*batch) \
+    X(x, (size_t)l->outputs*batch) \
+    X(x_norm, (size_t)l->outputs*batch) \
+    X(mean, l->out_c) \
+    X(variance, l->out_c) \
+    X(mean_delta, l->out_c) \
+    X(variance_delta, l->out_c) \
+    X(weight_updates, LAYER_WEIGHTS) \
+    X(bias_updates, l->n) \
+    X(scale_updates, l->n) \
+    X(m, LAYER_WEIGHTS) \
+    X(v, LAYER_WEIGHTS)
+
+// Bytes held by buffers only backward and update ever touch, at the given
+// batch size. With free_them set they are released as well.
+static size_t training_buffers(layer *l, int batch, int free_them)
+{
+    size_t bytes = 0;
+#define X(name, count) \
+    if(l->name){ \
+        bytes += (count)*sizeof(float); \
+        if(free_them){ \
+            free(l->name); \
+            l->name = 0; \
+        } \
+    }
+    TRAINING_BUFFERS(X)
+#undef X
+    // Only backward reads the argmax of each maxpool window
+    if(l->type == MAXPOOL && l->indexes){
+        bytes += (size_t)l->outputs*batch*sizeof(int);
+        if(free_them){
+            free(l->indexes);
+            l->indexes = 0;
+        }
+    }
+    return bytes;
+}
+
+size_t network_training_memory(network *net, int batch)
+{
+    int i;
+    size_t bytes = 0;
+    for(i = 0; i < net->n; ++i) bytes += training_buffers(&net->layers[i], batch, 0);
+    return bytes;
+}
+
+void plan_network_memory(network *net)
+{
+    int i;
+    if(net->arena || !network_memory_plannable(net)) return;
+#ifdef GPU
+    if(net->gpu_index >= 0) return;
+#endif
+    planned_buffer *b = calloc(net->n, sizeof(planned_buffer));
+    compute_lifetimes(net, net->batch, b);
+    size_t total = assign_offsets(b, net->n);
+
+    net->arena = calloc(total, sizeof(float));
+    if(!net->arena) malloc_error();
+    net->arena_size = total;
+    for(i = 0; i < net->n; ++i){
+        layer *l = &net->layers[i];
+        free(l->output);
+        l->output = net->arena + b[i].offset;
+        training_buffers(l, l->batch, 1);
+    }
+    net->output = net->layers[net->n - 1].output;
+    free(b);
+}
+
+// Gives every layer its own output buffer again, e.g. before resizing
+void unplan_network_memory(network *net)
+{
+    int i;
+    if(!net->arena) return;
+    for(i = 0; i < net->n; ++i){
+        layer *l = &net->layers[i];
+        l->output = calloc((size_t)l->outputs*l->batch, sizeof(float));
+    }
+    net->output = net->layers[net->n - 1].output;
+    free(net->arena);
+    net->arena = 0;
+    net->arena_size = 0;
+}
+
+int layer_output_in_arena(network *net, layer l)
+{
+    return net->arena && l.output >= net->arena && l.output < net->arena + net->arena_size;
+}
+
+void print_memory_plan(network *net, int batch)
+{
+    int i;
+    if(!network_memory_plannable(net)){
+        fprintf(stderr, "This network contains layers the memory planner does not support\n");
+        return;
+    }
+    planned_buffer *b = calloc(net->n, sizeof(planned_buffer));
+    compute_lifetimes(net, batch, b);
+    size_t total = assign_offsets(b, net->n);
+    size_t naive = 0;
+    double mb = 1024.*1024./sizeof(float);
+
+    printf("layer     type     output MB   live      offset MB\n");
+    for(i = 0; i < net->n; ++i){
+        naive += b[i].size;
+        char live[32];
+        if(b[i].last == net->n) sprintf(live, "%d-end", b[i].first);
+        else sprintf(live, "%d-%d", b[i].first, b[i].last);
+        printf("%5d %-10s %9.2f   %-9s %9.2f\n", i, get_layer_string(net->layers[i].type), b[i].size/mb, live, b[i].offset/mb);
+    }
+    printf("Batch %d: per-layer outputs %.2f MB, planned arena %.2f MB (%.1fx smaller)\n",
+            batch, naive/mb, total/mb, (double)naive/total);
+    printf("Training-only buffers released at inference: %.2f MB\n", network_training_memory(net, batch)/1024./1024.);
+    free(b);
+}
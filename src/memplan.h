@@ -0,0 +1,12 @@
+#ifndef MEMPLAN_H
+#define MEMPLAN_H
+#include "darknet.h"
+
+int network_memory_plannable(network *net);
+void network_output_lifetimes(network *net, int *last);
+size_t network_training_memory(network *net, int batch);
+void plan_network_memory(network *net);
+void unplan_network_memory(network *net);
+int layer_output_in_arena(network *net, layer l);
+
+#endif
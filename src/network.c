@@ -6,6 +6,9 @@
 #include "data.h"
 #include "utils.h"
 #include "blas.h"
+#include "memplan.h"
+#include "profiler.h"
+#include "box.h"
 
 #include "crop_layer.h"
 #include "connected_layer.h"
@@ -60,6 +63,61 @@ network *load_network(char *cfg, char *weights, int clear)
     return net;
 }
 
+network *load_network_inference(char *cfg, char *weights)
+{
+    network *net = parse_network_cfg(cfg);
+    net->inference = 1;
+    if(weights && weights[0] != 0){
+        load_weights(net, weights);
+    }
+    plan_network_memory(net);
+    return net;
+}
+
+static void share_parameters(float **dst, float *src)
+{
+    if(*dst) free(*dst);
+    *dst = src;
+}
+
+// Parses cfg into a new inference network whose parameters point at those of
+// base, so several threads can each run their own copy (activations and
+// workspace) over a single set of weights. base must outlive the replica.
+network *load_network_replica(char *cfg, network *base)
+{
+    network *net = parse_network_cfg(cfg);
+    net->inference = 1;
+    if(net->n != base->n) error("Replica cfg does not match the base network");
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer *l = &net->layers[i];
+        layer b = base->layers[i];
+        if(l->type != b.type || l->nweights != b.nweights || l->outputs != b.outputs){
+            error("Replica cfg does not match the base network");
+        }
+        if(l->type == RNN || l->type == GRU || l->type == LSTM || l->type == CRNN){
+            error("Replicas of recurrent networks are not supported");
+        }
+        share_parameters(&l->biases, b.biases);
+        share_parameters(&l->scales, b.scales);
+        share_parameters(&l->weights, b.weights);
+        share_parameters(&l->rolling_mean, b.rolling_mean);
+        share_parameters(&l->rolling_variance, b.rolling_variance);
+        share_parameters(&l->packed_weights, b.packed_weights);
+        share_parameters(&l->weight_scales, b.weight_scales);
+        if(l->qweights) free(l->qweights);
+        l->qweights = b.qweights;
+        l->input_scale = b.input_scale;
+        l->batchnorm_folded = b.batchnorm_folded;
+        l->shared = 1;
+#ifdef GPU
+        if(gpu_index >= 0 && l->type == CONVOLUTIONAL) push_convolutional_layer(*l);
+#endif
+    }
+    plan_network_memory(net);
+    return net;
+}
+
 size_t get_current_batch(network *net)
 {
     size_t batch_num = (*net->seen)/(net->batch*net->subdivisions);
@@ -168,6 +226,10 @@ char *get_layer_string(LAYER_TYPE a)
             return "normalization";
         case BATCHNORM:
             return "batchnorm";
+        case UPSAMPLE:
+            return "upsample";
+        case L2NORM:
+            return "l2norm";
         default:
             break;
     }
@@ -195,13 +257,17 @@ void forward_network(network *netp)
 #endif
     network net = *netp;
     int i;
+    double start = 0;
+    if(net.profile) profile_begin_pass(net.profile, PROFILE_FORWARD);
     for(i = 0; i < net.n; ++i){
         net.index = i;
         layer l = net.layers[i];
+        if(net.profile) start = profile_clock();
         if(l.delta){
             fill_cpu(l.outputs * l.batch, 0, l.delta, 1);
         }
         l.forward(l, net);
+        if(net.profile) profile_record(net.profile, PROFILE_FORWARD, i, start, profile_clock());
         net.input = l.output;
         if(l.truth) {
             net.truth = l.output;
@@ -271,6 +337,8 @@ void backward_network(network *netp)
     network net = *netp;
     int i;
     network orig = net;
+    double start = 0;
+    if(net.profile) profile_begin_pass(net.profile, PROFILE_BACKWARD);
     for(i = net.n-1; i >= 0; --i){
         layer l = net.layers[i];
         if(l.stopbackward) break;
@@ -282,7 +350,9 @@ void backward_network(network *netp)
             net.delta = prev.delta;
         }
         net.index = i;
+        if(net.profile) start = profile_clock();
         l.backward(l, net);
+        if(net.profile) profile_record(net.profile, PROFILE_BACKWARD, i, start, profile_clock());
     }
 }
 
@@ -353,6 +423,10 @@ void set_batch_network(network *net, int b)
         }
 #endif
     }
+    if(net->arena){
+        unplan_network_memory(net);
+        plan_network_memory(net);
+    }
 }
 
 int resize_network(network *net, int w, int h)
@@ -362,6 +436,8 @@ int resize_network(network *net, int w, int h)
     cuda_free(net->workspace);
 #endif
     int i;
+    int planned = net->arena != 0;
+    unplan_network_memory(net);
     //if(w == net->w && h == net->h) return 0;
     net->w = w;
     net->h = h;
@@ -433,6 +509,7 @@ int resize_network(network *net, int w, int h)
     free(net->workspace);
     net->workspace = calloc(1, workspace_size);
 #endif
+    if(planned) plan_network_memory(net);
     //fprintf(stderr, " Done!\n");
     return 0;
 }
@@ -559,10 +636,43 @@ void fill_network_boxes(network *net, int w, int h, float thresh, float hier, in
     }
 }
 
+// Region layers with more than 4 coords carry masks, which a
+// detection_buffer has no room for
+static int network_has_masks(network *net)
+{
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if((l.type == REGION || l.type == DETECTION) && l.coords > 4) return 1;
+    }
+    return 0;
+}
+
+// fill_network_detections, copied out as detection structs for the callers
+// that draw, print or evaluate them. YOLO boxes come out anchor by anchor
+// rather than cell by cell.
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int b, int *num)
 {
-    detection *dets = make_network_boxes(net, b, thresh, num);
-    fill_network_boxes(net, w, h, thresh, hier, map, relative, b, dets);
+    int i;
+    if(network_has_masks(net)){
+        detection *dets = make_network_boxes(net, b, thresh, num);
+        fill_network_boxes(net, w, h, thresh, hier, map, relative, b, dets);
+        return dets;
+    }
+
+    detection_buffer *d = make_detection_buffer();
+    fill_network_detections(net, w, h, thresh, hier, map, relative, b, d);
+    detection *dets = calloc(d->n, sizeof(detection));
+    for(i = 0; i < d->n; ++i){
+        box bbox = {d->x[i], d->y[i], d->w[i], d->h[i]};
+        dets[i].bbox = bbox;
+        dets[i].classes = d->classes;
+        dets[i].objectness = d->objectness[i];
+        dets[i].prob = calloc(d->classes, sizeof(float));
+        memcpy(dets[i].prob, d->prob + (size_t)i*d->classes, d->classes*sizeof(float));
+    }
+    if(num) *num = d->n;
+    free_detection_buffer(d);
     return dets;
 }
 
@@ -576,6 +686,51 @@ void free_detections(detection *dets, int n)
     free(dets);
 }
 
+// Appends detections of a layer that has no fused decoder
+static void append_detections(detection_buffer *d, detection *dets, int n)
+{
+    int i, j;
+    reserve_detection_buffer(d, n);
+    for(i = 0; i < n; ++i){
+        int k = d->n + i;
+        d->x[k] = dets[i].bbox.x;
+        d->y[k] = dets[i].bbox.y;
+        d->w[k] = dets[i].bbox.w;
+        d->h[k] = dets[i].bbox.h;
+        d->objectness[k] = dets[i].objectness;
+        for(j = 0; j < d->classes; ++j) d->prob[(size_t)k*d->classes + j] = dets[i].prob[j];
+    }
+    d->n += n;
+}
+
+// get_network_boxes into a buffer that is reused from frame to frame. YOLO
+// layers are decoded straight into it and only their boxes above thresh are
+// stored. Returns the number of boxes.
+int fill_network_detections(network *net, int w, int h, float thresh, float hier, int *map, int relative, int b, detection_buffer *d)
+{
+    int i, j;
+    reset_detection_buffer(d, net->layers[net->n - 1].classes);
+    for(j = 0; j < net->n; ++j){
+        layer l = net->layers[j];
+        if(l.type == YOLO){
+            yolo_decode_detections(l, w, h, net->w, net->h, thresh, relative, b, d);
+        }
+        if(l.type == REGION || l.type == DETECTION){
+            int count = l.w*l.h*l.n;
+            detection *dets = calloc(count, sizeof(detection));
+            for(i = 0; i < count; ++i){
+                dets[i].prob = calloc(d->classes, sizeof(float));
+                if(l.coords > 4) dets[i].mask = calloc(l.coords-4, sizeof(float));
+            }
+            if(l.type == REGION) get_region_detections(l, w, h, net->w, net->h, thresh, map, hier, relative, dets);
+            else get_detection_detections(l, w, h, thresh, dets);
+            append_detections(d, dets, count);
+            free_detections(dets, count);
+        }
+    }
+    return d->n;
+}
+
 float *network_predict_image(network *net, image im)
 {
     image imr = letterbox_image(im, net->w, net->h);
@@ -717,9 +872,12 @@ void free_network(network *net)
 {
     int i;
     for(i = 0; i < net->n; ++i){
+        if(layer_output_in_arena(net, net->layers[i])) net->layers[i].output = 0;
         free_layer(net->layers[i]);
     }
     free(net->layers);
+    free(net->arena);
+    free_network_profile(net->profile);
     if(net->input) free(net->input);
     if(net->truth) free(net->truth);
 #ifdef GPU
@@ -0,0 +1,344 @@
+#include "nms.h"
+#include "box.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct{
+    float score;
+    int index;
+} scored_index;
+
+// Highest score first, ties in box order so that the result does not depend
+// on the qsort implementation
+static int scored_index_comparator(const void *pa, const void *pb)
+{
+    const scored_index *a = (const scored_index *)pa;
+    const scored_index *b = (const scored_index *)pb;
+    if(a->score != b->score) return a->score < b->score ? 1 : -1;
+    return a->index - b->index;
+}
+
+// The candidates of every class in one array, class k at
+// [start[k], start[k+1]) sorted by score. A box is only listed under the
+// classes it scored for.
+typedef struct{
+    int *start;
+    scored_index *order;
+} class_lists;
+
+static class_lists make_class_lists(detection_buffer *d)
+{
+    int i, k;
+    int classes = d->classes;
+    class_lists c;
+    c.start = calloc(classes + 1, sizeof(int));
+    for(i = 0; i < d->n; ++i){
+        if(d->objectness[i] == 0) continue;
+        float *prob = d->prob + (size_t)i*classes;
+        for(k = 0; k < classes; ++k) c.start[k+1] += prob[k] != 0;
+    }
+    for(k = 0; k < classes; ++k) c.start[k+1] += c.start[k];
+
+    int *next = calloc(classes + 1, sizeof(int));
+    memcpy(next, c.start, classes*sizeof(int));
+    c.order = calloc(c.start[classes] + 1, sizeof(scored_index));
+    for(i = 0; i < d->n; ++i){
+        if(d->objectness[i] == 0) continue;
+        float *prob = d->prob + (size_t)i*classes;
+        for(k = 0; k < classes; ++k){
+            if(prob[k] == 0) continue;
+            scored_index s = {prob[k], i};
+            c.order[next[k]++] = s;
+        }
+    }
+    free(next);
+    for(k = 0; k < classes; ++k){
+        qsort(c.order + c.start[k], c.start[k+1] - c.start[k], sizeof(scored_index), scored_index_comparator);
+    }
+    return c;
+}
+
+static void free_class_lists(class_lists c)
+{
+    free(c.start);
+    free(c.order);
+}
+
+static inline box buffer_box(detection_buffer *d, int i)
+{
+    box b = {d->x[i], d->y[i], d->w[i], d->h[i]};
+    return b;
+}
+
+#define NMS_GRID_MAX 32
+
+// The boxes kept so far for one class, listed under every grid cell their
+// extent covers. Boxes that overlap share at least one cell, so a candidate
+// is only compared with the kept boxes in the cells it covers.
+typedef struct{
+    int size;
+    float x0, y0;
+    float cell_w, cell_h;
+    int head[NMS_GRID_MAX*NMS_GRID_MAX];
+    int *next;
+    int *box;
+    int entries;
+    int capacity;
+} nms_grid;
+
+// Monotonic in v, so overlapping extents map to overlapping cell ranges
+static inline int grid_cell(float v, float origin, float cell, int size)
+{
+    float f = (v - origin)/cell;
+    if(!(f > 0)) return 0;
+    if(f >= size - 1) return size - 1;
+    return (int)f;
+}
+
+static void reset_grid(nms_grid *g, detection_buffer *d, scored_index *order, int m, float thresh)
+{
+    int i;
+    float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+    for(i = 0; i < m; ++i){
+        box b = buffer_box(d, order[i].index);
+        x0 = fminf(x0, b.x - b.w/2);
+        y0 = fminf(y0, b.y - b.h/2);
+        x1 = fmaxf(x1, b.x + b.w/2);
+        y1 = fmaxf(y1, b.y + b.h/2);
+    }
+    // About four candidates per cell. Below a threshold of 0 even boxes that
+    // do not overlap suppress each other, which needs a single cell.
+    g->size = (int)sqrtf(m/4.f);
+    if(g->size < 1 || thresh < 0) g->size = 1;
+    if(g->size > NMS_GRID_MAX) g->size = NMS_GRID_MAX;
+    g->x0 = x0;
+    g->y0 = y0;
+    g->cell_w = (x1 - x0)/g->size;
+    g->cell_h = (y1 - y0)/g->size;
+    for(i = 0; i < g->size*g->size; ++i) g->head[i] = -1;
+    g->entries = 0;
+}
+
+static void grid_insert(nms_grid *g, int cell, int index)
+{
+    if(g->entries == g->capacity){
+        g->capacity = g->capacity ? 2*g->capacity : 1024;
+        g->next = realloc(g->next, g->capacity*sizeof(int));
+        g->box = realloc(g->box, g->capacity*sizeof(int));
+        if(!g->next || !g->box) malloc_error();
+    }
+    g->next[g->entries] = g->head[cell];
+    g->box[g->entries] = index;
+    g->head[cell] = g->entries++;
+}
+
+// Greedy NMS of one class: a candidate is dropped when it overlaps a higher
+// scoring box that was kept by more than thresh, which is what do_nms_sort
+// computes by comparing each kept box with all lower scoring ones.
+static void suppress_class(detection_buffer *d, int k, scored_index *order, int m, float thresh, nms_grid *g)
+{
+    int i, e, cx, cy;
+    if(m < 2) return;
+    reset_grid(g, d, order, m, thresh);
+    for(i = 0; i < m; ++i){
+        int index = order[i].index;
+        box b = buffer_box(d, index);
+        int x0 = grid_cell(b.x - b.w/2, g->x0, g->cell_w, g->size);
+        int x1 = grid_cell(b.x + b.w/2, g->x0, g->cell_w, g->size);
+        int y0 = grid_cell(b.y - b.h/2, g->y0, g->cell_h, g->size);
+        int y1 = grid_cell(b.y + b.h/2, g->y0, g->cell_h, g->size);
+        int keep = 1;
+        for(cy = y0; cy <= y1 && keep; ++cy){
+            for(cx = x0; cx <= x1 && keep; ++cx){
+                for(e = g->head[cy*g->size + cx]; e >= 0; e = g->next[e]){
+                    if(box_iou(buffer_box(d, g->box[e]), b) > thresh){
+                        keep = 0;
+                        break;
+                    }
+                }
+            }
+        }
+        if(!keep){
+            d->prob[(size_t)index*d->classes + k] = 0;
+            continue;
+        }
+        for(cy = y0; cy <= y1; ++cy){
+            for(cx = x0; cx <= x1; ++cx) grid_insert(g, cy*g->size + cx, index);
+        }
+    }
+}
+
+// do_nms_sort on a detection_buffer: the same boxes survive, but each class
+// only sorts and compares the boxes that scored for it, and only with the
+// kept boxes near them. Boxes stay where they are; the scores of the
+// suppressed ones are set to 0.
+void do_nms_sort_buffer(detection_buffer *d, float thresh)
+{
+    int k;
+    class_lists c = make_class_lists(d);
+    nms_grid *g = calloc(1, sizeof(nms_grid));
+    for(k = 0; k < d->classes; ++k){
+        suppress_class(d, k, c.order + c.start[k], c.start[k+1] - c.start[k], thresh, g);
+    }
+    free(g->next);
+    free(g->box);
+    free(g);
+    free_class_lists(c);
+}
+
+// do_nms_sort_buffer on the detections of a whole batch, one image per
+// thread
+void do_nms_sort_batch(detection_buffer **d, int n, float thresh)
+{
+    int i;
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < n; ++i) do_nms_sort_buffer(d[i], thresh);
+}
+
+// Gaussian soft-NMS per class: rather than dropping the boxes that overlap
+// the best remaining one, their scores are multiplied by exp(-iou^2/sigma)
+// and the best of the rest is picked next. Scores that decay to thresh or
+// below are set to 0, the others are left decayed.
+void do_soft_nms_buffer(detection_buffer *d, float sigma, float thresh)
+{
+    int i, j, k;
+    class_lists c = make_class_lists(d);
+    for(k = 0; k < d->classes; ++k){
+        scored_index *s = c.order + c.start[k];
+        int m = c.start[k+1] - c.start[k];
+        for(i = 0; i < m; ++i){
+            int best = i;
+            for(j = i+1; j < m; ++j){
+                if(scored_index_comparator(s + j, s + best) < 0) best = j;
+            }
+            scored_index swap = s[i];
+            s[i] = s[best];
+            s[best] = swap;
+            if(s[i].score <= thresh) break;
+
+            box a = buffer_box(d, s[i].index);
+            for(j = i+1; j < m; ++j){
+                float iou = box_iou(a, buffer_box(d, s[j].index));
+                if(iou > 0) s[j].score *= expf(-iou*iou/sigma);
+            }
+        }
+        for(j = 0; j < m; ++j){
+            d->prob[(size_t)s[j].index*d->classes + k] = j < i ? s[j].score : 0;
+        }
+    }
+    free_class_lists(c);
+}
+
+// n boxes in clusters of about 20 around objects, each scoring for the
+// class of its object and for active-1 random others
+static void random_detections(detection_buffer *d, int n, int classes, int active)
+{
+    int i, j;
+    reset_detection_buffer(d, classes);
+    reserve_detection_buffer(d, n);
+    memset(d->prob, 0, (size_t)n*classes*sizeof(float));
+    box object = {0};
+    int object_class = 0;
+    for(i = 0; i < n; ++i){
+        if(i % 20 == 0){
+            object.w = rand_uniform(.02, .3);
+            object.h = rand_uniform(.02, .3);
+            object.x = rand_uniform(0, 1);
+            object.y = rand_uniform(0, 1);
+            object_class = rand() % classes;
+        }
+        d->x[i] = object.x + rand_uniform(-.3, .3)*object.w;
+        d->y[i] = object.y + rand_uniform(-.3, .3)*object.h;
+        d->w[i] = object.w*rand_uniform(.7, 1.4);
+        d->h[i] = object.h*rand_uniform(.7, 1.4);
+        d->objectness[i] = rand_uniform(.005, 1);
+        float *prob = d->prob + (size_t)i*classes;
+        prob[object_class] = d->objectness[i]*rand_uniform(.2, 1);
+        for(j = 1; j < active; ++j) prob[rand() % classes] = d->objectness[i]*rand_uniform(0, .2);
+    }
+    d->n = n;
+}
+
+static void copy_detection_buffer(detection_buffer *to, detection_buffer *from)
+{
+    reset_detection_buffer(to, from->classes);
+    reserve_detection_buffer(to, from->n);
+    memcpy(to->x, from->x, from->n*sizeof(float));
+    memcpy(to->y, from->y, from->n*sizeof(float));
+    memcpy(to->w, from->w, from->n*sizeof(float));
+    memcpy(to->h, from->h, from->n*sizeof(float));
+    memcpy(to->objectness, from->objectness, from->n*sizeof(float));
+    memcpy(to->prob, from->prob, (size_t)from->n*from->classes*sizeof(float));
+    to->n = from->n;
+}
+
+// Times do_nms_sort against do_nms_sort_buffer, batched and soft-NMS on n
+// random boxes and checks that do_nms_sort and do_nms_sort_buffer keep the
+// same boxes for the same classes
+void test_nms(int n, int classes, int active, float thresh, int runs)
+{
+    int i, j, r;
+    int batch = 8;
+    double start, sorted = 0, engine = 0, batched = 0, soft = 0;
+    detection_buffer *input = make_detection_buffer();
+    detection_buffer **d = calloc(batch, sizeof(detection_buffer *));
+    for(i = 0; i < batch; ++i) d[i] = make_detection_buffer();
+    detection *dets = calloc(n, sizeof(detection));
+    float *probs = calloc((size_t)n*classes, sizeof(float));
+    random_detections(input, n, classes, active);
+
+    for(r = 0; r < runs; ++r){
+        for(i = 0; i < n; ++i){
+            dets[i].bbox = buffer_box(input, i);
+            dets[i].objectness = input->objectness[i];
+            dets[i].classes = classes;
+            dets[i].prob = probs + (size_t)i*classes;
+        }
+        memcpy(probs, input->prob, (size_t)n*classes*sizeof(float));
+        start = what_time_is_it_now();
+        do_nms_sort(dets, n, classes, thresh);
+        sorted += what_time_is_it_now() - start;
+
+        copy_detection_buffer(d[0], input);
+        start = what_time_is_it_now();
+        do_nms_sort_buffer(d[0], thresh);
+        engine += what_time_is_it_now() - start;
+
+        for(i = 0; i < batch; ++i) copy_detection_buffer(d[i], input);
+        start = what_time_is_it_now();
+        do_nms_sort_batch(d, batch, thresh);
+        batched += what_time_is_it_now() - start;
+
+        copy_detection_buffer(d[1], input);
+        start = what_time_is_it_now();
+        do_soft_nms_buffer(d[1], .5, .001);
+        soft += what_time_is_it_now() - start;
+    }
+
+    // do_nms_sort reorders dets, but each keeps its own prob array
+    int kept = 0, mismatched = 0;
+    for(i = 0; i < n; ++i){
+        int index = (dets[i].prob - probs)/classes;
+        for(j = 0; j < classes; ++j){
+            int a = dets[i].prob[j] != 0;
+            int b = d[0]->prob[(size_t)index*classes + j] != 0;
+            kept += a;
+            mismatched += a != b;
+        }
+    }
+    printf("%d boxes, %d classes, %d scored per box, thresh %.2f: %d kept, %d differences\n", n, classes, active, thresh, kept, mismatched);
+    printf("do_nms_sort        %9.3f ms\n", sorted*1000/runs);
+    printf("do_nms_sort_buffer %9.3f ms (%6.1fx)\n", engine*1000/runs, sorted/engine);
+    printf("do_nms_sort_batch  %9.3f ms per image, batch %d\n", batched*1000/runs/batch, batch);
+    printf("do_soft_nms_buffer %9.3f ms\n", soft*1000/runs);
+
+    for(i = 0; i < batch; ++i) free_detection_buffer(d[i]);
+    free(d);
+    free_detection_buffer(input);
+    free(dets);
+    free(probs);
+}
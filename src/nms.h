@@ -0,0 +1,7 @@
+#ifndef NMS_H
+#define NMS_H
+#include "darknet.h"
+
+void test_nms(int n, int classes, int active, float thresh, int runs);
+
+#endif
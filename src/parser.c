@@ -27,6 +27,7 @@
 #include "parser.h"
 #include "region_layer.h"
 #include "yolo_layer.h"
+#include "quantize.h"
 #include "reorg_layer.h"
 #include "rnn_layer.h"
 #include "route_layer.h"
@@ -200,6 +201,8 @@ convolutional_layer parse_convolutional(list *options, size_params params)
     convolutional_layer layer = make_convolutional_layer(batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, params.net->adam);
     layer.flipped = option_find_int_quiet(options, "flipped", 0);
     layer.dot = option_find_float_quiet(options, "dot", 0);
+    char *algorithm_s = option_find_str_quiet(options, "algorithm", "auto");
+    set_convolutional_algorithm(&layer, algorithm_s);
 
     return layer;
 }
@@ -961,6 +964,34 @@ void save_convolutional_weights(layer l, FILE *fp)
     fwrite(l.weights, sizeof(float), num, fp);
 }
 
+// Int8 weight files store convolutional layers with batchnorm folded in:
+// biases, a quantized flag, then either the input scale, per-filter weight
+// scales and int8 weights, or the fp32 weights for layers left unquantized.
+// They are told apart by their minor version, the revision keeps its
+// meaning.
+#define INT8_WEIGHTS_MINOR 100
+
+void save_convolutional_weights_int8(layer *l, FILE *fp)
+{
+    fold_convolutional_batchnorm(l);
+    int size = l->nweights/l->n;
+    int quantized = l->input_scale > 0;
+    fwrite(l->biases, sizeof(float), l->n, fp);
+    fwrite(&quantized, sizeof(int), 1, fp);
+    if(quantized){
+        float *scales = calloc(l->n, sizeof(float));
+        int8_t *q = calloc(l->nweights, sizeof(int8_t));
+        quantize_weights(l->weights, l->n, size, scales, q);
+        fwrite(&l->input_scale, sizeof(float), 1, fp);
+        fwrite(scales, sizeof(float), l->n, fp);
+        fwrite(q, sizeof(int8_t), l->nweights, fp);
+        free(scales);
+        free(q);
+    } else {
+        fwrite(l->weights, sizeof(float), l->nweights, fp);
+    }
+}
+
 void save_batchnorm_weights(layer l, FILE *fp)
 {
 #ifdef GPU
@@ -989,19 +1020,15 @@ void save_connected_weights(layer l, FILE *fp)
     }
 }
 
-void save_weights_upto(network *net, char *filename, int cutoff)
+static void write_weights(network *net, FILE *fp, int cutoff, int int8)
 {
 #ifdef GPU
     if(net->gpu_index >= 0){
         cuda_set_device(net->gpu_index);
     }
 #endif
-    fprintf(stderr, "Saving weights to %s\n", filename);
-    FILE *fp = fopen(filename, "wb");
-    if(!fp) file_error(filename);
-
     int major = 0;
-    int minor = 2;
+    int minor = int8 ? INT8_WEIGHTS_MINOR : 2;
     int revision = 0;
     fwrite(&major, sizeof(int), 1, fp);
     fwrite(&minor, sizeof(int), 1, fp);
@@ -1012,7 +1039,9 @@ void save_weights_upto(network *net, char *filename, int cutoff)
     for(i = 0; i < net->n && i < cutoff; ++i){
         layer l = net->layers[i];
         if (l.dontsave) continue;
-        if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
+        if(int8 && l.type == CONVOLUTIONAL){
+            save_convolutional_weights_int8(net->layers + i, fp);
+        } else if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
             save_convolutional_weights(l, fp);
         } if(l.type == CONNECTED){
             save_connected_weights(l, fp);
@@ -1060,8 +1089,54 @@ void save_weights_upto(network *net, char *filename, int cutoff)
             fwrite(l.weights, sizeof(float), size, fp);
         }
     }
+}
+
+static void save_weights_format(network *net, char *filename, int cutoff, int int8)
+{
+    fprintf(stderr, "Saving weights to %s\n", filename);
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) file_error(filename);
+    write_weights(net, fp, cutoff, int8);
+    fclose(fp);
+}
+
+// Writes what save_weights would write to *buffer, which holds *capacity
+// bytes and is reused when it is large enough, or replaced with one that is
+// (free it when done). Returns the number of bytes written.
+size_t weights_to_buffer(network *net, char **buffer, size_t *capacity)
+{
+    if(*buffer){
+        // open_memstream leaves room for a terminating null byte, which
+        // fmemopen writes past the data
+        FILE *fp = fmemopen(*buffer, *capacity + 1, "wb");
+        if(fp){
+            setvbuf(fp, 0, _IONBF, 0);
+            write_weights(net, fp, net->n, 0);
+            size_t size = ftell(fp);
+            int full = fflush(fp) || ferror(fp) || size > *capacity;
+            fclose(fp);
+            if(!full) return size;
+        }
+        free(*buffer);
+        *buffer = 0;
+    }
+    FILE *fp = open_memstream(buffer, capacity);
+    if(!fp) malloc_error();
+    write_weights(net, fp, net->n, 0);
     fclose(fp);
+    return *capacity;
 }
+
+void save_weights_upto(network *net, char *filename, int cutoff)
+{
+    save_weights_format(net, filename, cutoff, 0);
+}
+
+void save_weights_int8(network *net, char *filename)
+{
+    save_weights_format(net, filename, net->n, 1);
+}
+
 void save_weights(network *net, char *filename)
 {
     save_weights_upto(net, filename, net->n);
@@ -1199,6 +1274,50 @@ void load_convolutional_weights(layer l, FILE *fp)
 }
 
 
+void load_convolutional_weights_int8(layer *l, FILE *fp, int inference)
+{
+    int i, j;
+    int size = l->nweights/l->n;
+    int quantized = 0;
+    fread(l->biases, sizeof(float), l->n, fp);
+    if(l->batch_normalize){
+        for(i = 0; i < l->n; ++i){
+            l->scales[i] = 1;
+            l->rolling_mean[i] = 0;
+            l->rolling_variance[i] = 1;
+        }
+        l->batchnorm_folded = 1;
+    }
+    fread(&quantized, sizeof(int), 1, fp);
+    if(quantized){
+        int8_t *q = calloc(l->nweights, sizeof(int8_t));
+        if(!l->weight_scales) l->weight_scales = calloc(l->n, sizeof(float));
+        fread(&l->input_scale, sizeof(float), 1, fp);
+        fread(l->weight_scales, sizeof(float), l->n, fp);
+        fread(q, sizeof(int8_t), l->nweights, fp);
+        if(inference) pack_convolutional_int8_weights(l, q);
+        if(l->qweights){
+            // Inference only reads the packed int8 weights
+            free(l->weights);
+            l->weights = 0;
+        } else {
+            for(i = 0; i < l->n; ++i){
+                for(j = 0; j < size; ++j){
+                    l->weights[i*size + j] = q[i*size + j]*l->weight_scales[i];
+                }
+            }
+        }
+        free(q);
+    } else {
+        fread(l->weights, sizeof(float), l->nweights, fp);
+    }
+#ifdef GPU
+    if(gpu_index >= 0){
+        push_convolutional_layer(*l);
+    }
+#endif
+}
+
 void load_weights_upto(network *net, char *filename, int start, int cutoff)
 {
 #ifdef GPU
@@ -1225,14 +1344,21 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
         *net->seen = iseen;
     }
     int transpose = (major > 1000) || (minor > 1000);
+    int int8 = (major == 0 && minor == INT8_WEIGHTS_MINOR);
 
     int i;
     for(i = start; i < net->n && i < cutoff; ++i){
         layer l = net->layers[i];
         if (l.dontload) continue;
-        if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
+        if(int8 && l.type == CONVOLUTIONAL){
+            load_convolutional_weights_int8(net->layers + i, fp, net->inference);
+        } else if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
             load_convolutional_weights(l, fp);
         }
+        if(l.type == CONVOLUTIONAL && net->inference){
+            fold_convolutional_batchnorm(&net->layers[i]);
+            pack_convolutional_weights(&net->layers[i]);
+        }
         if(l.type == CONNECTED){
             load_connected_weights(l, fp, transpose);
         }
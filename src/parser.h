@@ -5,5 +5,6 @@
 
 void save_network(network net, char *filename);
 void save_weights_double(network net, char *filename);
+size_t weights_to_buffer(network *net, char **buffer, size_t *capacity);
 
 #endif
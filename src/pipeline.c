@@ -0,0 +1,359 @@
+#include "pipeline.h"
+#include "memplan.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// One entry of a handoff queue. outputs is the arena of the frame in the
+// slot: a buffer for every layer output that is read past the end of its
+// stage. Every slot owns one arena of the same layout, so a stage passes a
+// frame on by swapping arenas with the slot it fills.
+typedef struct{
+    void *tag;
+    int end;
+    float *input;
+    float **outputs;
+    network view;
+} pipeline_slot;
+
+// Bounded single producer, single consumer ring. The producer fills
+// slots[head % size] in place and publishes it by advancing head, the
+// consumer reads slots[tail % size] and frees it by advancing tail.
+typedef struct{
+    pipeline_slot *slots;
+    int size;
+    size_t head;
+    size_t tail;
+} handoff_queue;
+
+typedef struct{
+    network *net;
+    int first;
+    int last;
+    int threads;
+    float *input;
+    float **planned;
+    handoff_queue *in;
+    handoff_queue *out;
+    pthread_t thread;
+} pipeline_stage;
+
+struct pipeline{
+    network *base;
+    int n;
+    pipeline_stage *stages;
+    handoff_queue *queues;
+};
+
+static void backoff(int *spins)
+{
+    ++*spins;
+    if(*spins < 64) return;
+    if(*spins < 1024){
+        sched_yield();
+        return;
+    }
+    struct timespec ts = {0, 50000};
+    nanosleep(&ts, 0);
+}
+
+static pipeline_slot *wait_for_item(handoff_queue *q)
+{
+    int spins = 0;
+    while(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail) backoff(&spins);
+    return q->slots + q->tail % q->size;
+}
+
+static void consume_item(handoff_queue *q)
+{
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+static pipeline_slot *wait_for_space(handoff_queue *q)
+{
+    int spins = 0;
+    while(q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == (size_t)q->size) backoff(&spins);
+    return q->slots + q->head % q->size;
+}
+
+static void publish_item(handoff_queue *q)
+{
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+static void make_handoff_queue(handoff_queue *q, network *net, int *crosses, int depth, int last)
+{
+    int i, j;
+    q->size = depth;
+    q->head = q->tail = 0;
+    q->slots = calloc(depth, sizeof(pipeline_slot));
+    for(i = 0; i < depth; ++i){
+        pipeline_slot *s = q->slots + i;
+        s->outputs = calloc(net->n, sizeof(float *));
+        for(j = 0; j < net->n; ++j){
+            if(crosses[j]) s->outputs[j] = calloc((size_t)net->layers[j].outputs*net->batch, sizeof(float));
+        }
+        if(last){
+            // What pipeline_pop hands out: the network with the outputs
+            // get_network_boxes reads pointing into the popped arena
+            s->view = *net;
+            s->view.layers = calloc(net->n, sizeof(layer));
+            memcpy(s->view.layers, net->layers, net->n*sizeof(layer));
+            s->view.input = 0;
+        }
+    }
+}
+
+static void free_handoff_queue(handoff_queue *q, int n)
+{
+    int i, j;
+    for(i = 0; i < q->size; ++i){
+        pipeline_slot *s = q->slots + i;
+        for(j = 0; j < n; ++j) free(s->outputs[j]);
+        free(s->outputs);
+        free(s->view.layers);
+    }
+    free(q->slots);
+}
+
+static void measure_layer_costs(network *net, double *costs, int runs)
+{
+    int i, r;
+    float *input = calloc((size_t)net->inputs*net->batch, sizeof(float));
+    network orig = *net;
+    net->train = 0;
+    net->truth = 0;
+    for(i = 0; i < net->n; ++i) costs[i] = 0;
+    // The first run only warms up caches and packed weights
+    for(r = 0; r <= runs; ++r){
+        net->input = input;
+        for(i = 0; i < net->n; ++i){
+            net->index = i;
+            layer l = net->layers[i];
+            double start = what_time_is_it_now();
+            l.forward(l, *net);
+            if(r) costs[i] += what_time_is_it_now() - start;
+            net->input = l.output;
+        }
+    }
+    for(i = 0; i < net->n; ++i) costs[i] /= runs;
+    net->input = orig.input;
+    net->truth = orig.truth;
+    net->train = orig.train;
+    net->index = orig.index;
+    free(input);
+}
+
+// Splits the layers into n contiguous stages so that the most expensive
+// stage is as cheap as possible. first must hold n+1 entries.
+static void balance_stages(double *costs, int layers, int n, int *first)
+{
+    int i, j, k;
+    double *prefix = calloc(layers + 1, sizeof(double));
+    double *best = calloc((size_t)(n + 1)*(layers + 1), sizeof(double));
+    int *split = calloc((size_t)(n + 1)*(layers + 1), sizeof(int));
+    for(i = 0; i < layers; ++i) prefix[i+1] = prefix[i] + costs[i];
+
+    // best[k*(layers+1) + i]: cheapest bottleneck of layers [0, i) in k stages
+    for(i = 1; i <= layers; ++i) best[(layers+1) + i] = prefix[i];
+    for(k = 2; k <= n; ++k){
+        for(i = k; i <= layers; ++i){
+            double b = -1;
+            for(j = k - 1; j < i; ++j){
+                double c = best[(k-1)*(layers+1) + j];
+                double stage = prefix[i] - prefix[j];
+                if(stage > c) c = stage;
+                if(b < 0 || c < b){
+                    b = c;
+                    split[k*(layers+1) + i] = j;
+                }
+            }
+            best[k*(layers+1) + i] = b;
+        }
+    }
+    first[n] = layers;
+    for(k = n, i = layers; k > 1; --k){
+        i = split[k*(layers+1) + i];
+        first[k-1] = i;
+    }
+    first[0] = 0;
+    free(prefix);
+    free(best);
+    free(split);
+}
+
+static void run_stage(pipeline_stage *s, pipeline_slot *in, pipeline_slot *out)
+{
+    network *net = s->net;
+    int i;
+    // The frame's arena moves on with it and the free one goes back upstream
+    float **outputs = out->outputs;
+    out->outputs = in->outputs;
+    in->outputs = outputs;
+    out->input = in->input;
+
+    for(i = 0; i < s->first; ++i){
+        if(out->outputs[i]) net->layers[i].output = out->outputs[i];
+    }
+    for(i = s->first; i < s->last; ++i){
+        net->layers[i].output = out->outputs[i] ? out->outputs[i] : s->planned[i];
+    }
+    net->input = s->first ? out->outputs[s->first - 1] : out->input;
+    net->truth = 0;
+    net->train = 0;
+    for(i = s->first; i < s->last; ++i){
+        net->index = i;
+        layer l = net->layers[i];
+        l.forward(l, *net);
+        net->input = l.output;
+    }
+}
+
+static void *stage_thread(void *ptr)
+{
+    pipeline_stage *s = (pipeline_stage *)ptr;
+#ifdef _OPENMP
+    omp_set_num_threads(s->threads);
+#endif
+    int end = 0;
+    while(!end){
+        pipeline_slot *in = wait_for_item(s->in);
+        pipeline_slot *out = wait_for_space(s->out);
+        out->tag = in->tag;
+        out->end = end = in->end;
+        if(!end) run_stage(s, in, out);
+        publish_item(s->out);
+        consume_item(s->in);
+    }
+    return 0;
+}
+
+// Runs net as a pipeline of n stages, each on its own thread with its own
+// replica of the network (stage 0 uses net itself). The layers are split
+// where the measured per-layer cost is balanced, so while one frame is in
+// the later layers the next can already go through the early ones. depth
+// is the number of frames each handoff queue can hold.
+pipeline *make_pipeline(char *cfgfile, network *net, int n, int depth, int threads)
+{
+    int i, j;
+#ifdef GPU
+    if(net->gpu_index >= 0) error("Pipelined execution runs on the CPU only");
+#endif
+    if(!network_memory_plannable(net)) error("Pipelined execution does not support this network");
+    if(n > net->n) n = net->n;
+    if(n < 1) n = 1;
+    if(depth < 1) depth = 1;
+    if(threads < 1) threads = 1;
+
+    pipeline *p = calloc(1, sizeof(pipeline));
+    p->base = net;
+    p->n = n;
+
+    double *costs = calloc(net->n, sizeof(double));
+    int *first = calloc(n + 1, sizeof(int));
+    int *last = calloc(net->n, sizeof(int));
+    int *crosses = calloc(net->n, sizeof(int));
+    measure_layer_costs(net, costs, 2);
+    balance_stages(costs, net->n, n, first);
+    network_output_lifetimes(net, last);
+    for(i = 0; i < n; ++i){
+        for(j = first[i]; j < first[i+1]; ++j) crosses[j] = last[j] >= first[i+1];
+    }
+
+    p->queues = calloc(n + 1, sizeof(handoff_queue));
+    for(i = 0; i <= n; ++i) make_handoff_queue(p->queues + i, net, crosses, depth, i == n);
+
+    p->stages = calloc(n, sizeof(pipeline_stage));
+    for(i = 0; i < n; ++i){
+        pipeline_stage *s = p->stages + i;
+        double cost = 0;
+        s->net = i ? load_network_replica(cfgfile, net) : net;
+        s->first = first[i];
+        s->last = first[i+1];
+        s->threads = threads;
+        s->in = p->queues + i;
+        s->out = p->queues + i + 1;
+        s->input = s->net->input;
+        s->planned = calloc(net->n, sizeof(float *));
+        for(j = 0; j < net->n; ++j) s->planned[j] = s->net->layers[j].output;
+        for(j = s->first; j < s->last; ++j) cost += costs[j];
+        fprintf(stderr, "Pipeline stage %d: layers %3d - %3d, %8.2f ms\n", i, s->first, s->last - 1, cost*1000);
+    }
+    for(i = 0; i < n; ++i){
+        if(pthread_create(&p->stages[i].thread, 0, stage_thread, p->stages + i)) error("Pipeline thread creation failed");
+    }
+    free(costs);
+    free(first);
+    free(last);
+    free(crosses);
+    return p;
+}
+
+// Queues one batch (net->inputs*net->batch floats), blocking while the
+// first stage is busy. The first stage reads input in place, so it must stay
+// untouched until pipeline_pop has returned the batch. tag is handed back
+// with the batch's results.
+void pipeline_push(pipeline *p, float *input, void *tag)
+{
+    handoff_queue *q = p->queues;
+    pipeline_slot *s = wait_for_space(q);
+    s->input = input;
+    s->tag = tag;
+    s->end = 0;
+    publish_item(q);
+}
+
+// No more batches will be pushed
+void pipeline_finish(pipeline *p)
+{
+    handoff_queue *q = p->queues;
+    pipeline_slot *s = wait_for_space(q);
+    s->tag = 0;
+    s->end = 1;
+    publish_item(q);
+}
+
+// Waits for the oldest batch to leave the last stage and returns a network
+// whose detection layers hold its outputs, e.g. for get_network_boxes, or 0
+// once the pipeline is finished. The view stays valid until pipeline_release.
+network *pipeline_pop(pipeline *p, void **tag)
+{
+    int j;
+    pipeline_slot *s = wait_for_item(p->queues + p->n);
+    if(tag) *tag = s->tag;
+    if(s->end) return 0;
+    for(j = 0; j < p->base->n; ++j) s->view.layers[j].output = s->outputs[j];
+    s->view.output = s->outputs[p->base->n - 1];
+    return &s->view;
+}
+
+void pipeline_release(pipeline *p)
+{
+    consume_item(p->queues + p->n);
+}
+
+// Must be called after pipeline_pop has returned 0
+void free_pipeline(pipeline *p)
+{
+    int i, j;
+    network *net = p->base;
+    for(i = 0; i < p->n; ++i){
+        pipeline_stage *s = p->stages + i;
+        pthread_join(s->thread, 0);
+        for(j = 0; j < net->n; ++j) s->net->layers[j].output = s->planned[j];
+        s->net->input = s->input;
+        if(i) free_network(s->net);
+        free(s->planned);
+    }
+    for(i = 0; i <= p->n; ++i) free_handoff_queue(p->queues + i, net->n);
+    free(p->stages);
+    free(p->queues);
+    free(p);
+}
@@ -0,0 +1,13 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include "darknet.h"
+
+typedef struct pipeline pipeline;
+pipeline *make_pipeline(char *cfgfile, network *net, int n, int depth, int threads);
+void pipeline_push(pipeline *p, float *input, void *tag);
+void pipeline_finish(pipeline *p);
+network *pipeline_pop(pipeline *p, void **tag);
+void pipeline_release(pipeline *p);
+void free_pipeline(pipeline *p);
+
+#endif
@@ -0,0 +1,237 @@
+#include "profiler.h"
+#include "network.h"
+#include "gemm.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Per-layer wall times of every profiled forward and backward pass. Row r of
+// time[pass] holds the n layer times of run r in seconds, -1 where a layer
+// did not run (e.g. below stopbackward).
+struct network_profile{
+    int n;
+    int runs[2];
+    int capacity[2];
+    double *start[2];
+    double *time[2];
+    double origin;
+};
+
+static const char *pass_names[] = {"forward", "backward"};
+
+double profile_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void profile_begin_pass(network_profile *p, int pass)
+{
+    int i;
+    if(p->runs[pass] == p->capacity[pass]){
+        p->capacity[pass] = p->capacity[pass] ? 2*p->capacity[pass] : 64;
+        p->start[pass] = realloc(p->start[pass], (size_t)p->capacity[pass]*p->n*sizeof(double));
+        p->time[pass] = realloc(p->time[pass], (size_t)p->capacity[pass]*p->n*sizeof(double));
+        if(!p->start[pass] || !p->time[pass]) malloc_error();
+    }
+    double *row = p->time[pass] + (size_t)p->runs[pass]*p->n;
+    for(i = 0; i < p->n; ++i) row[i] = -1;
+    ++p->runs[pass];
+}
+
+void profile_record(network_profile *p, int pass, int index, double start, double end)
+{
+    size_t r = (size_t)(p->runs[pass] - 1)*p->n + index;
+    p->start[pass][r] = start - p->origin;
+    p->time[pass][r] = end - start;
+}
+
+void free_network_profile(network_profile *p)
+{
+    if(!p) return;
+    free(p->start[0]);
+    free(p->start[1]);
+    free(p->time[0]);
+    free(p->time[1]);
+    free(p);
+}
+
+// Starts collecting per-layer times on every forward_network and
+// backward_network call, discarding anything collected before
+void enable_network_profile(network *net)
+{
+    free_network_profile(net->profile);
+    net->profile = calloc(1, sizeof(network_profile));
+    net->profile->n = net->n;
+    net->profile->origin = profile_clock();
+}
+
+void disable_network_profile(network *net)
+{
+    free_network_profile(net->profile);
+    net->profile = 0;
+}
+
+// Multiply-adds of the layers that do matrix math, counted as two operations
+double layer_flops(layer l)
+{
+    double per_image = 0;
+    if(l.type == CONVOLUTIONAL){
+        per_image = 2.0 * l.n * l.size*l.size*l.c/l.groups * l.out_h*l.out_w;
+    } else if(l.type == DECONVOLUTIONAL){
+        per_image = 2.0 * l.n * l.size*l.size*l.c * l.h*l.w;
+    } else if(l.type == CONNECTED){
+        per_image = 2.0 * l.inputs * l.outputs;
+    } else if(l.type == LOCAL){
+        per_image = 2.0 * l.size*l.size*l.c * l.n * l.out_h*l.out_w;
+    }
+    return per_image*l.batch;
+}
+
+double layer_bytes_read(layer l)
+{
+    double bytes = (double)l.inputs*l.batch*sizeof(float);
+    if(l.qweights) bytes += gemm_int8_packed_a_size(l.n, l.size*l.size*l.c);
+    else if(l.weights) bytes += (double)(l.nweights ? l.nweights : l.inputs*l.outputs)*sizeof(float);
+    if(l.biases) bytes += (double)l.n*sizeof(float);
+    return bytes;
+}
+
+double layer_bytes_written(layer l)
+{
+    return (double)l.outputs*l.batch*sizeof(float);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(double *)a;
+    double y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct{
+    int count;
+    double mean, min, p50, p90, p99, max;
+} time_stats;
+
+// Nearest rank percentiles of the times of one layer (or of whole passes
+// with index -1) over all runs, in milliseconds
+static time_stats profile_stats(network_profile *p, int pass, int index)
+{
+    time_stats s = {0};
+    int r, i;
+    double *t = calloc(p->runs[pass] + 1, sizeof(double));
+    for(r = 0; r < p->runs[pass]; ++r){
+        double *row = p->time[pass] + (size_t)r*p->n;
+        double sum = 0;
+        int ran = 0;
+        for(i = 0; i < p->n; ++i){
+            if(row[i] < 0 || (index >= 0 && i != index)) continue;
+            sum += row[i];
+            ran = 1;
+        }
+        if(ran) t[s.count++] = sum*1000;
+    }
+    if(s.count){
+        qsort(t, s.count, sizeof(double), compare_doubles);
+        for(i = 0; i < s.count; ++i) s.mean += t[i]/s.count;
+        s.min = t[0];
+        s.p50 = t[(s.count - 1)*50/100];
+        s.p90 = t[(s.count - 1)*90/100];
+        s.p99 = t[(s.count - 1)*99/100];
+        s.max = t[s.count - 1];
+    }
+    free(t);
+    return s;
+}
+
+static void print_stats_json(FILE *fp, const char *name, time_stats s)
+{
+    fprintf(fp, "\"%s\": {\"runs\": %d, \"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+            name, s.count, s.mean, s.min, s.p50, s.p90, s.p99, s.max);
+}
+
+void print_network_profile(network *net)
+{
+    network_profile *p = net->profile;
+    int i, pass;
+    if(!p) return;
+    for(pass = 0; pass < 2; ++pass){
+        if(!p->runs[pass]) continue;
+        time_stats total = profile_stats(p, pass, -1);
+        printf("%s: %d runs, %.2f ms mean, %.2f ms p50, %.2f ms p90, %.2f ms p99\n",
+                pass_names[pass], total.count, total.mean, total.p50, total.p90, total.p99);
+        printf("layer  type              mean ms   p50 ms   p90 ms   share    GFLOPS   MB read  MB write\n");
+        for(i = 0; i < net->n; ++i){
+            layer l = net->layers[i];
+            time_stats s = profile_stats(p, pass, i);
+            if(!s.count) continue;
+            // Backward computes both the weight and the input gradients
+            double flops = layer_flops(l)*(pass == PROFILE_BACKWARD ? 2 : 1);
+            printf("%5d  %-15s %9.3f %8.3f %8.3f  %5.1f%%  %8.2f %9.2f %9.2f\n", i, get_layer_string(l.type),
+                    s.mean, s.p50, s.p90, 100*s.mean/total.mean, s.mean > 0 ? flops/s.mean/1e6 : 0,
+                    layer_bytes_read(l)/1024/1024, layer_bytes_written(l)/1024/1024);
+        }
+    }
+}
+
+void save_network_profile_json(network *net, char *filename)
+{
+    network_profile *p = net->profile;
+    int i, pass;
+    if(!p) return;
+    FILE *fp = fopen(filename, "w");
+    if(!fp) file_error(filename);
+    fprintf(fp, "{\n  \"batch\": %d, \"w\": %d, \"h\": %d, \"c\": %d,\n", net->batch, net->w, net->h, net->c);
+    for(pass = 0; pass < 2; ++pass){
+        fprintf(fp, "  ");
+        print_stats_json(fp, pass_names[pass], profile_stats(p, pass, -1));
+        fprintf(fp, ",\n");
+    }
+    fprintf(fp, "  \"layers\": [\n");
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        fprintf(fp, "    {\"index\": %d, \"type\": \"%s\", \"flops\": %.0f, \"bytes_read\": %.0f, \"bytes_written\": %.0f, \"workspace\": %zu",
+                i, get_layer_string(l.type), layer_flops(l), layer_bytes_read(l), layer_bytes_written(l), l.workspace_size);
+        for(pass = 0; pass < 2; ++pass){
+            time_stats s = profile_stats(p, pass, i);
+            if(!s.count) continue;
+            fprintf(fp, ", ");
+            print_stats_json(fp, pass_names[pass], s);
+        }
+        fprintf(fp, "}%s\n", i < net->n - 1 ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+// Chrome trace event format, open in chrome://tracing or Perfetto
+void save_network_profile_trace(network *net, char *filename)
+{
+    network_profile *p = net->profile;
+    int r, i, pass;
+    int first = 1;
+    if(!p) return;
+    FILE *fp = fopen(filename, "w");
+    if(!fp) file_error(filename);
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for(pass = 0; pass < 2; ++pass){
+        for(r = 0; r < p->runs[pass]; ++r){
+            for(i = 0; i < p->n; ++i){
+                size_t k = (size_t)r*p->n + i;
+                if(p->time[pass][k] < 0) continue;
+                layer l = net->layers[i];
+                fprintf(fp, "%s{\"name\": \"%d %s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"run\": %d, \"flops\": %.0f}}",
+                        first ? "" : ",\n", i, get_layer_string(l.type), pass_names[pass], pass,
+                        p->start[pass][k]*1e6, p->time[pass][k]*1e6, r, layer_flops(l));
+                first = 0;
+            }
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
@@ -0,0 +1,19 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+#include "darknet.h"
+
+typedef enum{
+    PROFILE_FORWARD = 0,
+    PROFILE_BACKWARD = 1
+} PROFILE_PASS;
+
+double profile_clock();
+void profile_begin_pass(network_profile *p, int pass);
+void profile_record(network_profile *p, int pass, int index, double start, double end);
+void free_network_profile(network_profile *p);
+
+double layer_flops(layer l);
+double layer_bytes_read(layer l);
+double layer_bytes_written(layer l);
+
+#endif
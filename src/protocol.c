@@ -0,0 +1,338 @@
+#include "protocol.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef LZ4
+#include <lz4.h>
+#endif
+
+typedef char frame_header_is_64_bytes[sizeof(frame_header) == 64 ? 1 : -1];
+
+int compression_supported(int compression)
+{
+    if(compression == COMPRESS_NONE) return 1;
+#ifdef LZ4
+    if(compression == COMPRESS_LZ4) return 1;
+#endif
+    return 0;
+}
+
+double frame_timestamp_now()
+{
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    return (double)time.tv_sec*1000000 + time.tv_usec;
+}
+
+void make_frame_header(frame_header *hdr, int type, uint32_t frame_id, int c, int h, int w)
+{
+    memset(hdr, 0, sizeof(frame_header));
+    hdr->magic = FRAME_MAGIC;
+    hdr->version = FRAME_VERSION;
+    hdr->type = type;
+    hdr->frame_id = frame_id;
+    hdr->timestamp = frame_timestamp_now();
+    hdr->c = c;
+    hdr->h = h;
+    hdr->w = w;
+    hdr->in_w = hdr->im_w = w;
+    hdr->in_h = hdr->im_h = h;
+}
+
+static size_t dtype_size(int dtype)
+{
+    if(dtype == DTYPE_F32) return 4;
+    if(dtype == DTYPE_F16) return 2;
+    return 1;
+}
+
+// Largest payload a well formed image or activation frame of hdr's shape can
+// carry: the tensor in hdr's dtype, or for JPEG at most what it takes as f32
+size_t frame_payload_limit(frame_header *hdr)
+{
+    size_t n = (size_t)hdr->c*hdr->h*hdr->w;
+    if(hdr->dtype == DTYPE_JPEG) return n*sizeof(float);
+    return n*dtype_size(hdr->dtype);
+}
+
+// Rejects headers whose payload could not belong to the frame they describe,
+// so that a receiver never allocates more than the tensor it expects
+int check_frame_header(frame_header *hdr)
+{
+    if(hdr->magic != FRAME_MAGIC || hdr->version != FRAME_VERSION) return 0;
+    if(hdr->payload_size > FRAME_MAX_PAYLOAD || hdr->raw_size > FRAME_MAX_PAYLOAD) return 0;
+    if(hdr->c < 0 || hdr->h < 0 || hdr->w < 0) return 0;
+    if((size_t)hdr->c*hdr->h*hdr->w > FRAME_MAX_PAYLOAD) return 0;
+    if(hdr->compression == COMPRESS_NONE && hdr->payload_size != hdr->raw_size) return 0;
+    if(hdr->type == FRAME_IMAGE || hdr->type == FRAME_ACTIVATIONS){
+        if(hdr->dtype > DTYPE_JPEG) return 0;
+        size_t limit = frame_payload_limit(hdr);
+        if(hdr->payload_size > limit || hdr->raw_size > limit) return 0;
+    } else if(hdr->type == FRAME_DETECTIONS){
+        if(hdr->raw_size != (size_t)hdr->c*sizeof(wire_detection)) return 0;
+    } else {
+        return 0;
+    }
+    return compression_supported(hdr->compression);
+}
+
+int parse_frame_dtype(char *s)
+{
+    if(0==strcmp(s, "f32")) return DTYPE_F32;
+    if(0==strcmp(s, "f16")) return DTYPE_F16;
+    if(0==strcmp(s, "i8")) return DTYPE_I8;
+    if(0==strcmp(s, "u8")) return DTYPE_U8;
+    if(0==strcmp(s, "jpeg")) return DTYPE_JPEG;
+    fprintf(stderr, "Unknown frame dtype %s, sending f32\n", s);
+    return DTYPE_F32;
+}
+
+// IEEE half precision, round to nearest even
+static uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = ((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if(((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if(exp >= 31) return sign | 0x7c00;
+    if(exp <= 0){
+        if(exp < -10) return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if(rem > mid || (rem == mid && (half & 1))) ++half;
+        return sign | half;
+    }
+    uint32_t half = sign | (exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if(rem > 0x1000 || (rem == 0x1000 && (half & 1))) ++half;
+    return half;
+}
+
+static float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if(exp == 0){
+        if(mant == 0){
+            x = sign;
+        } else {
+            exp = 127 - 15 + 1;
+            while(!(mant & 0x400)){
+                mant <<= 1;
+                --exp;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else if(exp == 31){
+        x = sign | 0x7f800000 | (mant << 13);
+    } else {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Converts x (c*h*w floats) into the wire format of hdr and optionally
+// compresses it. Fills in dtype, compression, scale and the payload sizes.
+// Returns a malloc'd payload, or 0 on failure.
+unsigned char *pack_frame(frame_header *hdr, float *x, int dtype, int compression, int quality)
+{
+    size_t n = (size_t)hdr->c*hdr->h*hdr->w;
+    size_t i;
+    unsigned char *raw = 0;
+    size_t raw_size = 0;
+
+    if(dtype == DTYPE_JPEG && hdr->c != 3) dtype = DTYPE_U8;
+    if(!compression_supported(compression)) compression = COMPRESS_NONE;
+    hdr->dtype = dtype;
+    hdr->scale = 1;
+
+    if(dtype == DTYPE_JPEG){
+        int size = 0;
+        image im = float_to_image(hdr->w, hdr->h, hdr->c, x);
+        raw = encode_image_jpg(im, quality, &size);
+        if(!raw) return 0;
+        raw_size = size;
+        // JPEG is already entropy coded
+        compression = COMPRESS_NONE;
+    } else {
+        raw_size = n*dtype_size(dtype);
+        raw = malloc(raw_size);
+        if(!raw) return 0;
+        if(dtype == DTYPE_F32){
+            memcpy(raw, x, raw_size);
+        } else if(dtype == DTYPE_F16){
+            uint16_t *h = (uint16_t *)raw;
+            for(i = 0; i < n; ++i) h[i] = float_to_half(x[i]);
+        } else if(dtype == DTYPE_U8){
+            for(i = 0; i < n; ++i) raw[i] = (unsigned char)(255*constrain(0, 1, x[i]) + .5);
+        } else if(dtype == DTYPE_I8){
+            float max = 0;
+            for(i = 0; i < n; ++i) if(fabs(x[i]) > max) max = fabs(x[i]);
+            hdr->scale = max > 0 ? max/127 : 1;
+            int8_t *q = (int8_t *)raw;
+            for(i = 0; i < n; ++i) q[i] = (int8_t)roundf(x[i]/hdr->scale);
+        }
+    }
+
+    hdr->compression = compression;
+    hdr->raw_size = raw_size;
+    hdr->payload_size = raw_size;
+#ifdef LZ4
+    if(compression == COMPRESS_LZ4){
+        int bound = LZ4_compressBound(raw_size);
+        unsigned char *packed = malloc(bound);
+        int size = packed ? LZ4_compress_default((char *)raw, (char *)packed, raw_size, bound) : 0;
+        if(size > 0 && (size_t)size < raw_size){
+            free(raw);
+            hdr->payload_size = size;
+            return packed;
+        }
+        // Incompressible, send as is
+        free(packed);
+        hdr->compression = COMPRESS_NONE;
+    }
+#endif
+    return raw;
+}
+
+// Decodes the payload of an image or activation frame into out, which must
+// hold c*h*w floats. Returns 0 if the payload does not match the header.
+int unpack_frame(frame_header *hdr, unsigned char *payload, float *out)
+{
+    size_t n = (size_t)hdr->c*hdr->h*hdr->w;
+    size_t i;
+    unsigned char *raw = payload;
+
+    if(!check_frame_header(hdr)) return 0;
+#ifdef LZ4
+    if(hdr->compression == COMPRESS_LZ4){
+        raw = malloc(hdr->raw_size);
+        if(!raw) return 0;
+        int size = LZ4_decompress_safe((char *)payload, (char *)raw, hdr->payload_size, hdr->raw_size);
+        if(size < 0 || (uint32_t)size != hdr->raw_size){
+            free(raw);
+            return 0;
+        }
+    }
+#endif
+
+    int ok = 1;
+    if(hdr->dtype == DTYPE_JPEG){
+        image im = load_image_from_memory(raw, hdr->raw_size, hdr->c);
+        ok = im.data && im.w == hdr->w && im.h == hdr->h && im.c == hdr->c;
+        if(ok) memcpy(out, im.data, n*sizeof(float));
+        if(im.data) free_image(im);
+    } else if(hdr->dtype > DTYPE_JPEG || hdr->raw_size != n*dtype_size(hdr->dtype)){
+        ok = 0;
+    } else if(hdr->dtype == DTYPE_F32){
+        memcpy(out, raw, n*sizeof(float));
+    } else if(hdr->dtype == DTYPE_F16){
+        uint16_t *h = (uint16_t *)raw;
+        for(i = 0; i < n; ++i) out[i] = half_to_float(h[i]);
+    } else if(hdr->dtype == DTYPE_U8){
+        for(i = 0; i < n; ++i) out[i] = raw[i]/255.f;
+    } else if(hdr->dtype == DTYPE_I8){
+        int8_t *q = (int8_t *)raw;
+        for(i = 0; i < n; ++i) out[i] = q[i]*hdr->scale;
+    }
+
+    if(raw != payload) free(raw);
+    return ok;
+}
+
+// Turns hdr into the response carrying count wire_detection records
+static void set_detections_header(frame_header *hdr, int count)
+{
+    hdr->type = FRAME_DETECTIONS;
+    hdr->dtype = DTYPE_F32;
+    hdr->compression = COMPRESS_NONE;
+    hdr->c = count;
+    hdr->h = hdr->w = 1;
+    hdr->scale = 1;
+    hdr->raw_size = hdr->payload_size = count*sizeof(wire_detection);
+}
+
+// Turns hdr into the response to the frame it describes and returns the
+// detections above thresh as wire_detection records, one per box and class.
+unsigned char *pack_detections(frame_header *hdr, detection *dets, int nboxes, int classes, float thresh)
+{
+    int i, j;
+    int count = 0;
+    wire_detection *out = calloc(nboxes*classes + 1, sizeof(wire_detection));
+    for(i = 0; i < nboxes; ++i){
+        for(j = 0; j < classes; ++j){
+            if(dets[i].prob[j] > thresh){
+                wire_detection d = {dets[i].bbox.x, dets[i].bbox.y, dets[i].bbox.w, dets[i].bbox.h, j, dets[i].prob[j]};
+                out[count++] = d;
+            }
+        }
+    }
+    set_detections_header(hdr, count);
+    return (unsigned char *)out;
+}
+
+// pack_detections for a detection_buffer
+unsigned char *pack_detection_buffer(frame_header *hdr, detection_buffer *d, float thresh)
+{
+    int i, j;
+    int count = 0;
+    for(i = 0; i < d->n*d->classes; ++i) count += d->prob[i] > thresh;
+    wire_detection *out = calloc(count + 1, sizeof(wire_detection));
+    if(!out) return 0;
+    count = 0;
+    for(i = 0; i < d->n; ++i){
+        float *prob = d->prob + (size_t)i*d->classes;
+        for(j = 0; j < d->classes; ++j){
+            if(prob[j] > thresh){
+                wire_detection w = {d->x[i], d->y[i], d->w[i], d->h[i], j, prob[j]};
+                out[count++] = w;
+            }
+        }
+    }
+    set_detections_header(hdr, count);
+    return (unsigned char *)out;
+}
+
+// Blocking send of one frame, returns -1 on error
+int send_frame(int fd, frame_header *hdr, unsigned char *payload)
+{
+    if(write_all_fail(fd, (char *)hdr, sizeof(frame_header))) return -1;
+    if(hdr->payload_size && write_all_fail(fd, (char *)payload, hdr->payload_size)) return -1;
+    return 0;
+}
+
+// Blocking receive of one frame into a malloc'd payload. Returns 0 when the
+// peer has closed the connection, -1 on error and 1 otherwise.
+int receive_frame(int fd, frame_header *hdr, unsigned char **payload)
+{
+    *payload = 0;
+    ssize_t bytes;
+    do {
+        bytes = read(fd, hdr, 1);
+    } while(bytes < 0 && errno == EINTR);
+    if(bytes == 0) return 0;
+    if(bytes < 0 || read_all_fail(fd, (char *)hdr + 1, sizeof(frame_header) - 1)) return -1;
+    if(!check_frame_header(hdr)) return -1;
+    *payload = malloc(hdr->payload_size + 1);
+    if(!*payload || read_all_fail(fd, (char *)*payload, hdr->payload_size)){
+        free(*payload);
+        *payload = 0;
+        return -1;
+    }
+    return 1;
+}
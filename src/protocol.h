@@ -0,0 +1,75 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+#include <stdint.h>
+#include <stddef.h>
+#include "darknet.h"
+
+// Framed wire protocol shared by client, jetson and server. Every message is
+// a fixed size header followed by payload_size bytes of payload. Multi-byte
+// fields, in the header as well as in the payload, are in host byte order,
+// like the weight files, so both ends must share it; a peer of the other
+// byte order fails the magic check.
+
+#define FRAME_MAGIC 0x4b524144 // "DARK"
+#define FRAME_VERSION 1
+#define FRAME_MAX_PAYLOAD (256 << 20)
+
+typedef enum {
+    FRAME_IMAGE = 1,       // letterboxed network input, c x h x w in [0, 1]
+    FRAME_ACTIVATIONS = 2, // output of the sender's part of a split network
+    FRAME_DETECTIONS = 3   // response, c = number of wire_detection records
+} FRAME_TYPE;
+
+typedef enum {
+    DTYPE_F32 = 0,
+    DTYPE_F16 = 1,
+    DTYPE_I8 = 2,   // symmetric, value = q * scale
+    DTYPE_U8 = 3,   // value = q / 255
+    DTYPE_JPEG = 4  // 3 channel JPEG of an image frame
+} FRAME_DTYPE;
+
+typedef enum {
+    COMPRESS_NONE = 0,
+    COMPRESS_LZ4 = 1
+} FRAME_COMPRESSION;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t type;
+    uint8_t dtype;
+    uint8_t compression;
+    uint8_t reserved[3];
+    uint32_t frame_id;
+    uint64_t timestamp;     // sender clock in microseconds, echoed in the response
+    int32_t c, h, w;        // tensor shape
+    int32_t in_w, in_h;     // network input size the image was letterboxed to
+    int32_t im_w, im_h;     // original image size, detections are relative to it
+    float scale;            // DTYPE_I8 quantization step
+    uint32_t payload_size;  // bytes following the header
+    uint32_t raw_size;      // payload bytes before compression
+} frame_header;
+
+typedef struct {
+    float x, y, w, h;
+    int32_t class;
+    float prob;
+} wire_detection;
+
+int compression_supported(int compression);
+double frame_timestamp_now();
+
+void make_frame_header(frame_header *hdr, int type, uint32_t frame_id, int c, int h, int w);
+unsigned char *pack_frame(frame_header *hdr, float *x, int dtype, int compression, int quality);
+int unpack_frame(frame_header *hdr, unsigned char *payload, float *out);
+unsigned char *pack_detections(frame_header *hdr, detection *dets, int nboxes, int classes, float thresh);
+unsigned char *pack_detection_buffer(frame_header *hdr, detection_buffer *d, float thresh);
+
+int send_frame(int fd, frame_header *hdr, unsigned char *payload);
+int receive_frame(int fd, frame_header *hdr, unsigned char **payload);
+int check_frame_header(frame_header *hdr);
+size_t frame_payload_limit(frame_header *hdr);
+
+int parse_frame_dtype(char *s);
+
+#endif
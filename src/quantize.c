@@ -0,0 +1,100 @@
+#include "quantize.h"
+#include "convolutional_layer.h"
+#include "image.h"
+#include "utils.h"
+#include <math.h>
+
+// Symmetric int8 quantization, q = round(x/scale) clamped to [-127, 127]
+void quantize_array(float *x, int n, float scale, int8_t *q)
+{
+    float inv = 1./scale;
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < n; ++i){
+        float v = roundf(x[i]*inv);
+        v = (v > 127) ? 127 : v;
+        v = (v < -127) ? -127 : v;
+        q[i] = (int8_t)v;
+    }
+}
+
+// Per output channel: each of the n filters of size weights gets its own scale
+void quantize_weights(float *weights, int n, int size, float *scales, int8_t *q)
+{
+    int i, j;
+    for(i = 0; i < n; ++i){
+        float max = 0;
+        for(j = 0; j < size; ++j){
+            float v = fabs(weights[i*size + j]);
+            if(v > max) max = v;
+        }
+        scales[i] = (max > 0) ? max/127 : 1;
+        quantize_array(weights + i*size, size, scales[i], q + i*size);
+    }
+}
+
+static float max_abs(float *x, int n)
+{
+    float max = 0;
+    int i;
+    for(i = 0; i < n; ++i){
+        float v = fabs(x[i]);
+        if(v > max) max = v;
+    }
+    return max;
+}
+
+// The first layer sees raw pixels and the layers feeding a detection head
+// decide box coordinates, so both stay in fp32.
+static int network_layer_quantizable(network *net, int i)
+{
+    layer l = net->layers[i];
+    if(i == 0 || l.type != CONVOLUTIONAL) return 0;
+    if(i + 1 < net->n){
+        LAYER_TYPE next = net->layers[i+1].type;
+        if(next == YOLO || next == REGION || next == DETECTION) return 0;
+    }
+    return convolutional_layer_quantizable(l);
+}
+
+// Runs the images through the fp32 network and sets input_scale on every
+// convolutional layer that can run in int8 from the largest input seen.
+void calibrate_network(network *net, char **paths, int n)
+{
+    float *ranges = calloc(net->n, sizeof(float));
+    network orig = *net;
+    int i, j;
+    // As in network_predict: no truth or delta, which inference networks
+    // don't have buffers for
+    net->train = 0;
+    net->truth = 0;
+    net->delta = 0;
+    for(i = 0; i < n; ++i){
+        image im = load_image_color(paths[i], 0, 0);
+        image sized = letterbox_image(im, net->w, net->h);
+        net->input = sized.data;
+        for(j = 0; j < net->n; ++j){
+            layer l = net->layers[j];
+            net->index = j;
+            if(l.type == CONVOLUTIONAL){
+                float range = max_abs(net->input, l.inputs*l.batch);
+                if(range > ranges[j]) ranges[j] = range;
+            }
+            l.forward(l, *net);
+            net->input = l.output;
+        }
+        fprintf(stderr, "\rCalibrated %d/%d", i+1, n);
+        free_image(im);
+        free_image(sized);
+    }
+    fprintf(stderr, "\n");
+    for(j = 0; j < net->n; ++j){
+        layer *l = net->layers + j;
+        if(l->type != CONVOLUTIONAL) continue;
+        int quantized = network_layer_quantizable(net, j) && ranges[j] > 0;
+        l->input_scale = quantized ? ranges[j]/127 : 0;
+        fprintf(stderr, "%5d conv  input range %10.4f  %s\n", j, ranges[j], quantized ? "int8" : "fp32");
+    }
+    *net = orig;
+    free(ranges);
+}
@@ -0,0 +1,10 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+#include <stdint.h>
+#include "darknet.h"
+
+void quantize_array(float *x, int n, float scale, int8_t *q);
+void quantize_weights(float *weights, int n, int size, float *scales, int8_t *q);
+void calibrate_network(network *net, char **paths, int n);
+
+#endif
@@ -80,7 +80,7 @@ void forward_route_layer(const route_layer l, network net)
         float *input = net.layers[index].output;
         int input_size = l.input_sizes[i];
         for(j = 0; j < l.batch; ++j){
-            copy_cpu(input_size, input + j*input_size, 1, l.output + offset + j*l.outputs, 1);
+            copy_cpu_parallel(input_size, input + j*input_size, l.output + offset + j*l.outputs);
         }
         offset += input_size;
     }
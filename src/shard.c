@@ -0,0 +1,267 @@
+#include "shard.h"
+#include "data.h"
+#include "image.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A shard is a header, then for every image its pixels, boxes and path, each
+// aligned to SHARD_ALIGN, and at the end the index of all images:
+//
+//   shard_header | pixels boxes path | pixels boxes path | ... | shard_entry[count]
+//
+// Pixels are uint8 rows of interleaved channels, as stb_image decodes them.
+#define SHARD_MAGIC "DKSHARD1"
+#define SHARD_ALIGN 64
+
+typedef struct{
+    char magic[8];
+    int32_t count;
+    int32_t reserved;
+    int64_t index;
+} shard_header;
+
+typedef struct{
+    int64_t pixels;
+    int64_t boxes;
+    int64_t path;
+    int32_t w, h, c;
+    int32_t nboxes;
+} shard_entry;
+
+typedef struct{
+    unsigned char *base;
+    size_t size;
+} mapped_shard;
+
+struct dataset_shards{
+    int n;
+    mapped_shard *shards;
+    int count;
+    int *shard;
+    shard_entry **entries;
+};
+
+int is_shard_list(char **paths, int n)
+{
+    if(n < 1) return 0;
+    size_t len = strlen(paths[0]);
+    return len > 6 && 0 == strcmp(paths[0] + len - 6, ".shard");
+}
+
+// Whether the pixels and boxes of e lie inside a shard of size bytes and its
+// path starts there. Only the index is read, so nothing else is paged in.
+static int check_shard_entry(shard_entry *e, size_t size)
+{
+    if(e->w <= 0 || e->h <= 0 || e->c <= 0 || e->nboxes < 0) return 0;
+    if(e->pixels < 0 || e->boxes < 0 || e->path < 0) return 0;
+    if((size_t)e->pixels > size || (size_t)e->boxes > size || (size_t)e->path >= size) return 0;
+    if((size_t)e->w*e->h > (size - e->pixels)/e->c) return 0;
+    if((size_t)e->nboxes > (size - e->boxes)/sizeof(shard_box)) return 0;
+    return 1;
+}
+
+// Maps every shard read-only. Images are only paged in when an augmentation
+// reads them, straight from the mapping.
+dataset_shards *open_dataset_shards(char **paths, int n)
+{
+    int i, j;
+    dataset_shards *s = calloc(1, sizeof(dataset_shards));
+    s->n = n;
+    s->shards = calloc(n, sizeof(mapped_shard));
+    for(i = 0; i < n; ++i){
+        struct stat st;
+        int fd = open(paths[i], O_RDONLY);
+        if(fd < 0 || fstat(fd, &st)) file_error(paths[i]);
+        void *base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(base == MAP_FAILED) file_error(paths[i]);
+        // Batches are drawn at random, reading ahead only wastes I/O
+        madvise(base, st.st_size, MADV_RANDOM);
+        s->shards[i].base = base;
+        s->shards[i].size = st.st_size;
+
+        shard_header *h = (shard_header *)base;
+        if(st.st_size < (off_t)sizeof(shard_header) || memcmp(h->magic, SHARD_MAGIC, 8)
+                || h->count < 0 || h->index < (int64_t)sizeof(shard_header) || h->index % sizeof(int64_t)
+                || h->index > st.st_size || (int64_t)h->count > (st.st_size - h->index)/(int64_t)sizeof(shard_entry)){
+            fprintf(stderr, "Not a dataset shard: %s\n", paths[i]);
+            error("Bad shard");
+        }
+        shard_entry *entries = (shard_entry *)((unsigned char *)base + h->index);
+        for(j = 0; j < h->count; ++j){
+            if(!check_shard_entry(entries + j, st.st_size)){
+                fprintf(stderr, "Image %d of %s lies outside the shard\n", j, paths[i]);
+                error("Bad shard");
+            }
+        }
+        s->count += h->count;
+    }
+    s->shard = calloc(s->count, sizeof(int));
+    s->entries = calloc(s->count, sizeof(shard_entry *));
+    int k = 0;
+    for(i = 0; i < n; ++i){
+        shard_header *h = (shard_header *)s->shards[i].base;
+        shard_entry *entries = (shard_entry *)(s->shards[i].base + h->index);
+        for(j = 0; j < h->count; ++j, ++k){
+            s->shard[k] = i;
+            s->entries[k] = entries + j;
+        }
+    }
+    fprintf(stderr, "%d images in %d shards\n", s->count, n);
+    return s;
+}
+
+void free_dataset_shards(dataset_shards *s)
+{
+    int i;
+    for(i = 0; i < s->n; ++i) munmap(s->shards[i].base, s->shards[i].size);
+    free(s->shards);
+    free(s->shard);
+    free(s->entries);
+    free(s);
+}
+
+int dataset_shards_count(dataset_shards *s)
+{
+    return s->count;
+}
+
+shard_record get_shard_record(dataset_shards *s, int i)
+{
+    shard_record r;
+    unsigned char *base = s->shards[s->shard[i]].base;
+    shard_entry *e = s->entries[i];
+    r.pixels = base + e->pixels;
+    r.w = e->w;
+    r.h = e->h;
+    r.c = e->c;
+    r.boxes = (shard_box *)(base + e->boxes);
+    r.nboxes = e->nboxes;
+    r.path = (char *)(base + e->path);
+    // The path is the one field whose end the index doesn't record
+    if(!memchr(r.path, 0, s->shards[s->shard[i]].size - e->path)) error("Bad shard: unterminated image path");
+    return r;
+}
+
+static void write_aligned(FILE *fp, void *data, size_t size, int64_t *offset)
+{
+    static const char zeros[SHARD_ALIGN] = {0};
+    long pos = ftell(fp);
+    long pad = (SHARD_ALIGN - pos % SHARD_ALIGN) % SHARD_ALIGN;
+    fwrite(zeros, 1, pad, fp);
+    *offset = pos + pad;
+    if(size && fwrite(data, 1, size, fp) != size) error("Shard write failed");
+}
+
+static FILE *start_shard(char *prefix, int number, list *written)
+{
+    char buff[4096];
+    sprintf(buff, "%s.%d.shard", prefix, number);
+    FILE *fp = fopen(buff, "wb");
+    if(!fp) file_error(buff);
+    shard_header h = {{0}};
+    fwrite(&h, sizeof(h), 1, fp);
+    list_insert(written, copy_string(buff));
+    return fp;
+}
+
+static void finish_shard(FILE *fp, shard_entry *entries, int count)
+{
+    shard_header h = {{0}};
+    memcpy(h.magic, SHARD_MAGIC, 8);
+    h.count = count;
+    write_aligned(fp, entries, count*sizeof(shard_entry), &h.index);
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, fp);
+    fclose(fp);
+}
+
+// Converts the images of listfile, scaled down so that neither side exceeds
+// size (0 keeps them as they are), and their boxes into prefix.N.shard
+// files of about shard_mb MB each. The shards are listed in prefix.list,
+// which can replace the image list of a training run.
+void pack_dataset(char *listfile, char *prefix, int size, int shard_mb)
+{
+    int i, j;
+    list *plist = get_paths(listfile);
+    char **paths = (char **)list_to_array(plist);
+    int n = plist->size;
+    list *written = make_list();
+    size_t limit = (size_t)shard_mb*1024*1024;
+    shard_entry *entries = calloc(n, sizeof(shard_entry));
+    int count = 0;
+    int number = 0;
+    FILE *fp = start_shard(prefix, number, written);
+    for(i = 0; i < n; ++i){
+        if(count && ftell(fp) > limit){
+            finish_shard(fp, entries, count);
+            fp = start_shard(prefix, ++number, written);
+            count = 0;
+        }
+        image im = load_image_color(paths[i], 0, 0);
+        if(size && (im.w > size || im.h > size)){
+            int w = im.w >= im.h ? size : im.w*size/im.h;
+            int h = im.h >= im.w ? size : im.h*size/im.w;
+            image sized = resize_image(im, w ? w : 1, h ? h : 1);
+            free_image(im);
+            im = sized;
+        }
+        unsigned char *pixels = calloc((size_t)im.w*im.h*im.c, 1);
+        for(j = 0; j < im.w*im.h*im.c; ++j){
+            int k = j % im.c;
+            int p = j / im.c;
+            float v = im.data[(size_t)k*im.w*im.h + p];
+            pixels[j] = (unsigned char)(constrain(0, 1, v)*255 + .5);
+        }
+
+        char labelpath[4096];
+        detection_label_path(paths[i], labelpath);
+        int nboxes = 0;
+        box_label *labels = 0;
+        if(access(labelpath, R_OK) == 0) labels = read_boxes(labelpath, &nboxes);
+        shard_box *boxes = calloc(nboxes + 1, sizeof(shard_box));
+        for(j = 0; j < nboxes; ++j){
+            shard_box b = {labels[j].id, labels[j].x, labels[j].y, labels[j].w, labels[j].h};
+            boxes[j] = b;
+        }
+
+        shard_entry *e = entries + count++;
+        e->w = im.w;
+        e->h = im.h;
+        e->c = im.c;
+        e->nboxes = nboxes;
+        write_aligned(fp, pixels, (size_t)im.w*im.h*im.c, &e->pixels);
+        write_aligned(fp, boxes, nboxes*sizeof(shard_box), &e->boxes);
+        write_aligned(fp, paths[i], strlen(paths[i]) + 1, &e->path);
+
+        free(boxes);
+        free(labels);
+        free(pixels);
+        free_image(im);
+        if(i % 100 == 0) fprintf(stderr, "\rPacked %d/%d images", i + 1, n);
+    }
+    finish_shard(fp, entries, count);
+    fprintf(stderr, "\rPacked %d images into %d shards\n", n, number + 1);
+
+    char buff[4096];
+    sprintf(buff, "%s.list", prefix);
+    FILE *out = fopen(buff, "w");
+    if(!out) file_error(buff);
+    char **shards = (char **)list_to_array(written);
+    for(i = 0; i < written->size; ++i) fprintf(out, "%s\n", shards[i]);
+    fclose(out);
+    printf("%s\n", buff);
+
+    free_ptrs((void **)shards, written->size);
+    free_list(written);
+    free(entries);
+    free_ptrs((void **)paths, n);
+    free_list(plist);
+}
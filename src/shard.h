@@ -0,0 +1,27 @@
+#ifndef SHARD_H
+#define SHARD_H
+#include <stdint.h>
+#include "darknet.h"
+
+typedef struct{
+    int32_t id;
+    float x, y, w, h;
+} shard_box;
+
+// One packed image, pointing into the mapped shard
+typedef struct{
+    unsigned char *pixels;
+    int w, h, c;
+    shard_box *boxes;
+    int nboxes;
+    char *path;
+} shard_record;
+
+int is_shard_list(char **paths, int n);
+dataset_shards *open_dataset_shards(char **paths, int n);
+int dataset_shards_count(dataset_shards *s);
+shard_record get_shard_record(dataset_shards *s, int i);
+void free_dataset_shards(dataset_shards *s);
+void pack_dataset(char *listfile, char *prefix, int size, int shard_mb);
+
+#endif
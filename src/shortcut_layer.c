@@ -61,8 +61,12 @@ void resize_shortcut_layer(layer *l, int w, int h)
 
 void forward_shortcut_layer(const layer l, network net)
 {
-    copy_cpu(l.outputs*l.batch, net.input, 1, l.output, 1);
-    shortcut_cpu(l.batch, l.w, l.h, l.c, net.layers[l.index].output, l.out_w, l.out_h, l.out_c, l.alpha, l.beta, l.output);
+    if(l.w == l.out_w && l.h == l.out_h && l.c == l.out_c){
+        shortcut_same_cpu(l.outputs*l.batch, net.input, net.layers[l.index].output, l.alpha, l.beta, l.output);
+    } else {
+        copy_cpu_parallel(l.outputs*l.batch, net.input, l.output);
+        shortcut_cpu(l.batch, l.w, l.h, l.c, net.layers[l.index].output, l.out_w, l.out_h, l.out_c, l.alpha, l.beta, l.output);
+    }
     activate_array(l.output, l.outputs*l.batch, l.activation);
 }
 
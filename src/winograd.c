@@ -0,0 +1,172 @@
+#include "winograd.h"
+#include "gemm.h"
+#include <stdlib.h>
+
+// Winograd minimal filtering F(2x2, 3x3), Lavin & Gray, "Fast Algorithms
+// for Convolutional Neural Networks". Each 4x4 input tile d and 3x3 filter g
+// give a 2x2 output tile Y = A^T [(G g G^T) .* (B^T d B)] A, so a layer
+// becomes 16 independent (n x c) * (c x tiles) GEMMs, one per tile element.
+
+#define WINOGRAD_CHUNK 256
+
+static int winograd_tiles(int out_h, int out_w)
+{
+    return ((out_h + 1)/2)*((out_w + 1)/2);
+}
+
+size_t winograd_packed_size(int c, int n)
+{
+    return 16*gemm_packed_size(n, c);
+}
+
+size_t winograd_workspace_size(int c, int n, int out_h, int out_w)
+{
+    int tiles = winograd_tiles(out_h, out_w);
+    if(tiles > WINOGRAD_CHUNK) tiles = WINOGRAD_CHUNK;
+    return (size_t)16*(c + n)*tiles*sizeof(float);
+}
+
+// U = G g G^T, stored as 16 (n x c) matrices and packed for gemm_cpu_prepacked
+void winograd_pack_weights(float *weights, int c, int n, float *packed)
+{
+    float *u = calloc((size_t)16*n*c, sizeof(float));
+    int f, ch, i, j;
+    for(f = 0; f < n; ++f){
+        for(ch = 0; ch < c; ++ch){
+            float *g = weights + (f*c + ch)*9;
+            float t[4][3];
+            for(j = 0; j < 3; ++j){
+                t[0][j] = g[j];
+                t[1][j] = .5*(g[j] + g[3+j] + g[6+j]);
+                t[2][j] = .5*(g[j] - g[3+j] + g[6+j]);
+                t[3][j] = g[6+j];
+            }
+            for(i = 0; i < 4; ++i){
+                float v[4];
+                v[0] = t[i][0];
+                v[1] = .5*(t[i][0] + t[i][1] + t[i][2]);
+                v[2] = .5*(t[i][0] - t[i][1] + t[i][2]);
+                v[3] = t[i][2];
+                for(j = 0; j < 4; ++j){
+                    u[((size_t)(i*4 + j)*n + f)*c + ch] = v[j];
+                }
+            }
+        }
+    }
+    size_t size = gemm_packed_size(n, c);
+    for(i = 0; i < 16; ++i){
+        gemm_pack_matrix(0, n, c, 1, u + (size_t)i*n*c, c, packed + i*size);
+    }
+    free(u);
+}
+
+// V = B^T d B for tiles [t0, t0+nt) of every channel, stored as 16 (c x nt) matrices
+static void winograd_input_transform(float *im, int c, int h, int w, int pad,
+        int tiles_w, int t0, int nt, float *v)
+{
+    int ch;
+    #pragma omp parallel for
+    for(ch = 0; ch < c; ++ch){
+        float *src = im + (size_t)ch*h*w;
+        int t, i, j;
+        for(t = 0; t < nt; ++t){
+            int tile = t0 + t;
+            int y0 = (tile/tiles_w)*2 - pad;
+            int x0 = (tile%tiles_w)*2 - pad;
+            float d[4][4];
+            if(y0 >= 0 && x0 >= 0 && y0 + 4 <= h && x0 + 4 <= w){
+                for(i = 0; i < 4; ++i){
+                    for(j = 0; j < 4; ++j){
+                        d[i][j] = src[(y0 + i)*w + x0 + j];
+                    }
+                }
+            } else {
+                for(i = 0; i < 4; ++i){
+                    for(j = 0; j < 4; ++j){
+                        int y = y0 + i;
+                        int x = x0 + j;
+                        d[i][j] = (y < 0 || x < 0 || y >= h || x >= w) ? 0 : src[y*w + x];
+                    }
+                }
+            }
+            float b[4][4];
+            for(j = 0; j < 4; ++j){
+                b[0][j] = d[0][j] - d[2][j];
+                b[1][j] = d[1][j] + d[2][j];
+                b[2][j] = d[2][j] - d[1][j];
+                b[3][j] = d[1][j] - d[3][j];
+            }
+            for(i = 0; i < 4; ++i){
+                float *dst = v + ((size_t)(i*4)*c + ch)*nt + t;
+                dst[0]               = b[i][0] - b[i][2];
+                dst[(size_t)c*nt]    = b[i][1] + b[i][2];
+                dst[(size_t)2*c*nt]  = b[i][2] - b[i][1];
+                dst[(size_t)3*c*nt]  = b[i][1] - b[i][3];
+            }
+        }
+    }
+}
+
+// Y = A^T M A for tiles [t0, t0+nt) of every filter, cropped to the output
+// size, with the bias and activation applied when bias is given
+static void winograd_output_transform(float *m, int n, int out_h, int out_w,
+        int tiles_w, int t0, int nt, float *out, float *bias, ACTIVATION a)
+{
+    int f;
+    #pragma omp parallel for
+    for(f = 0; f < n; ++f){
+        float *dst = out + (size_t)f*out_h*out_w;
+        int t, i, j;
+        for(t = 0; t < nt; ++t){
+            int tile = t0 + t;
+            int y0 = (tile/tiles_w)*2;
+            int x0 = (tile%tiles_w)*2;
+            float s[2][4];
+            for(j = 0; j < 4; ++j){
+                float m0 = m[((size_t)(0*4 + j)*n + f)*nt + t];
+                float m1 = m[((size_t)(1*4 + j)*n + f)*nt + t];
+                float m2 = m[((size_t)(2*4 + j)*n + f)*nt + t];
+                float m3 = m[((size_t)(3*4 + j)*n + f)*nt + t];
+                s[0][j] = m0 + m1 + m2;
+                s[1][j] = m1 - m2 - m3;
+            }
+            for(i = 0; i < 2 && y0 + i < out_h; ++i){
+                float y[2];
+                y[0] = s[i][0] + s[i][1] + s[i][2];
+                y[1] = s[i][1] - s[i][2] - s[i][3];
+                if(bias){
+                    y[0] = activate(y[0] + bias[f], a);
+                    y[1] = activate(y[1] + bias[f], a);
+                }
+                dst[(y0 + i)*out_w + x0] = y[0];
+                if(x0 + 1 < out_w) dst[(y0 + i)*out_w + x0 + 1] = y[1];
+            }
+        }
+    }
+}
+
+void winograd_convolution(float *im, int c, int h, int w, int pad,
+        float *packed, int n, float *workspace, size_t workspace_size, float *out,
+        float *bias, ACTIVATION a)
+{
+    int out_h = h + 2*pad - 2;
+    int out_w = w + 2*pad - 2;
+    int tiles_w = (out_w + 1)/2;
+    int tiles = winograd_tiles(out_h, out_w);
+    int chunk = workspace_size/sizeof(float)/(16*(c + n));
+    if(chunk > tiles) chunk = tiles;
+    if(chunk < 1) chunk = 1;
+
+    size_t size = gemm_packed_size(n, c);
+    float *v = workspace;
+    float *m = workspace + (size_t)16*c*chunk;
+    int t0, i;
+    for(t0 = 0; t0 < tiles; t0 += chunk){
+        int nt = (tiles - t0 < chunk) ? tiles - t0 : chunk;
+        winograd_input_transform(im, c, h, w, pad, tiles_w, t0, nt, v);
+        for(i = 0; i < 16; ++i){
+            gemm_cpu_prepacked(0, n, nt, c, packed + i*size, v + (size_t)i*c*nt, nt, 0, m + (size_t)i*n*nt, nt);
+        }
+        winograd_output_transform(m, n, out_h, out_w, tiles_w, t0, nt, out, bias, a);
+    }
+}
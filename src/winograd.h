@@ -0,0 +1,13 @@
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+#include <stddef.h>
+#include "activations.h"
+
+size_t winograd_packed_size(int c, int n);
+size_t winograd_workspace_size(int c, int n, int out_h, int out_w);
+void winograd_pack_weights(float *weights, int c, int n, float *packed);
+void winograd_convolution(float *im, int c, int h, int w, int pad,
+        float *packed, int n, float *workspace, size_t workspace_size, float *out,
+        float *bias, ACTIVATION a);
+
+#endif
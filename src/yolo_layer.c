@@ -145,7 +145,7 @@ void forward_yolo_layer(const layer l, network net)
     }
 #endif
 
-    memset(l.delta, 0, l.outputs * l.batch * sizeof(float));
+    if(l.delta) memset(l.delta, 0, l.outputs * l.batch * sizeof(float));
     if(!net.train) return;
     float avg_iou = 0;
     float recall = 0;
@@ -276,13 +276,10 @@ int yolo_num_detections(layer l, int b, float thresh)
 {
     int i, n;
     int count = 0;
-    for (i = 0; i < l.w*l.h; ++i){
-        for(n = 0; n < l.n; ++n){
-            int obj_index  = entry_index(l, b, n*l.w*l.h + i, 4);
-            if(l.output[obj_index] > thresh){
-                ++count;
-            }
-        }
+    int wh = l.w*l.h;
+    for(n = 0; n < l.n; ++n){
+        float *objectness = l.output + entry_index(l, b, n*wh, 4);
+        for(i = 0; i < wh; ++i) count += objectness[i] > thresh;
     }
     return count;
 }
@@ -342,6 +339,87 @@ int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh,
     return count;
 }
 
+// get_yolo_detections and correct_yolo_boxes in one pass per anchor,
+// appending to d: the cells above thresh are gathered first, then only
+// those are decoded, one output plane at a time
+int yolo_decode_detections(layer l, int w, int h, int netw, int neth, float thresh, int relative, int b, detection_buffer *d)
+{
+    int i, j, k, n;
+    int wh = l.w*l.h;
+    int new_w = 0;
+    int new_h = 0;
+    if (((float)netw/w) < ((float)neth/h)) {
+        new_w = netw;
+        new_h = (h * netw)/w;
+    } else {
+        new_h = neth;
+        new_w = (w * neth)/h;
+    }
+    double offset_x = (netw - new_w)/2./netw;
+    double offset_y = (neth - new_h)/2./neth;
+    float scale_x = (float)new_w/netw;
+    float scale_y = (float)new_h/neth;
+    float stretch_w = (float)netw/new_w;
+    float stretch_h = (float)neth/new_h;
+    int start = d->n;
+
+    for(n = 0; n < l.n; ++n){
+        float *p = l.output + entry_index(l, b, n*wh, 0);
+        float *objectness = p + 4*wh;
+        reserve_detection_buffer(d, wh);
+        int *cells = d->cells;
+
+        int m = 0;
+        for(i = 0; i < wh; ++i){
+            cells[m] = i;
+            m += objectness[i] > thresh;
+        }
+        if(!m) continue;
+
+        float anchor_w = l.biases[2*l.mask[n]];
+        float anchor_h = l.biases[2*l.mask[n]+1];
+        float *x = d->x + d->n;
+        float *y = d->y + d->n;
+        float *bw = d->w + d->n;
+        float *bh = d->h + d->n;
+        float *obj = d->objectness + d->n;
+        for(k = 0; k < m; ++k){
+            int cell = cells[k];
+            int row = cell / l.w;
+            int col = cell % l.w;
+            float bx = (col + p[cell]) / l.w;
+            float by = (row + p[wh + cell]) / l.h;
+            float bwk = exp(p[2*wh + cell]) * anchor_w / netw;
+            float bhk = exp(p[3*wh + cell]) * anchor_h / neth;
+            x[k] = (bx - offset_x) / scale_x;
+            y[k] = (by - offset_y) / scale_y;
+            bw[k] = bwk*stretch_w;
+            bh[k] = bhk*stretch_h;
+            obj[k] = objectness[cell];
+        }
+        if(!relative){
+            for(k = 0; k < m; ++k){
+                x[k] *= w;
+                bw[k] *= w;
+                y[k] *= h;
+                bh[k] *= h;
+            }
+        }
+
+        float *prob = d->prob + (size_t)d->n*d->classes;
+        for(k = 0; k < m; ++k){
+            float *scores = p + 5*wh + cells[k];
+            float *out = prob + (size_t)k*d->classes;
+            for(j = 0; j < l.classes; ++j){
+                float s = obj[k]*scores[j*wh];
+                out[j] = (s > thresh) ? s : 0;
+            }
+        }
+        d->n += m;
+    }
+    return d->n - start;
+}
+
 #ifdef GPU
 
 void forward_yolo_layer_gpu(const layer l, network net)